@@ -0,0 +1,157 @@
+// alloc_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Measures heap allocations and time per received message for udp messages
+// just at and just over the small-message size limit. A client and server
+// share one process and run loop; the client sends a batch of one-way
+// messages, and the loop runs until the server has received the whole batch.
+//
+// Heap calls are counted by wrapping malloc, which needs glibc; elsewhere
+// only times are reported.
+//
+// Run it with no arguments:
+//  ./alloc_bench
+//
+
+#include "msgbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define true  1
+#define false 0
+
+#define batch_size  100
+#define num_batches 200
+
+static int message_sizes[] = {64, 65};
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+static int port;
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * msg_sec + ts.tv_nsec;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// malloc counting
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+
+static uint64_t num_mallocs = 0;
+
+void *malloc(size_t size) {
+  num_mallocs++;
+  return __libc_malloc(size);
+}
+
+#define can_count_mallocs true
+
+#else
+
+static uint64_t num_mallocs = 0;
+
+#define can_count_mallocs false
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client and server
+
+static msg_Conn *listening_conn;
+static msg_Conn *client_conn;
+static int num_received;
+static int listening_ended;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Server: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_message)         num_received++;
+  if (event == msg_listening_ended) listening_ended = true;
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Client: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+static void run_batch(msg_Data data, int *num_expected) {
+  for (int i = 0; i < batch_size; ++i) msg_send(client_conn, data);
+  *num_expected += batch_size;
+  // The loop waits at most 100ms so that a dropped datagram can't stall us.
+  int64_t end = msg_loop_now() + 100 * msg_ms;
+  while (num_received < *num_expected && msg_loop_now() < end) msg_runloop(10);
+  *num_expected = num_received;
+}
+
+static void run_size(int message_size) {
+  num_received    = 0;
+  listening_ended = false;
+  client_conn     = NULL;
+
+  char address[64];
+  snprintf(address, 64, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  snprintf(address, 64, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(10);
+
+  msg_Data data = msg_new_data_space(message_size);
+  memset(data.bytes, 'x', data.num_bytes);
+
+  // Warm up so that buffers and free lists reach their steady state.
+  int num_expected = 0;
+  run_batch(data, &num_expected);
+
+  uint64_t mallocs_before  = num_mallocs;
+  int      received_before = num_received;
+  int64_t  start           = now_ns();
+  for (int i = 0; i < num_batches; ++i) run_batch(data, &num_expected);
+  int64_t  elapsed         = now_ns() - start;
+  int      received        = num_received - received_before;
+
+  printf("%7d  %9d  %14.0f", message_size, received,
+         (double)elapsed / received);
+  if (can_count_mallocs) {
+    printf("  %16.2f", (double)(num_mallocs - mallocs_before) / received);
+  }
+  printf("\n");
+
+  msg_delete_data(data);
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(10);
+  port++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+
+int main(int argc, char **argv) {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  printf("%7s  %9s  %14s", "bytes", "messages", "ns/message");
+  if (can_count_mallocs) printf("  %16s", "mallocs/message");
+  printf("\n");
+
+  for (int i = 0; i < array_size(message_sizes); ++i) {
+    run_size(message_sizes[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,196 @@
+// compression_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Measures what msg_set_compression saves and costs for several kinds of
+// payload. For each kind, a client sends large messages over a tcp conn to a
+// server in the same process, once without compression and once with it. Each
+// row gives the bytes sent per byte of payload, the codec's speed both ways
+// from msg_compression_stats, and the end-to-end throughput.
+//
+// On loopback the network is free, so the throughput column shows the codec's
+// cost; the ratio column shows what it saves on a real link.
+//
+
+#include "msgbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define true  1
+#define false 0
+
+#define num_messages 400
+#define message_len  (64 * 1024)
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+static int port;
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * msg_sec + ts.tv_nsec;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// payloads
+
+// Like a game's state snapshot in json.
+static void fill_snapshot(char *bytes, size_t num_bytes) {
+  size_t len = 0;
+  for (int i = 0; len < num_bytes; ++i) {
+    char entity[128];
+    int entity_len = snprintf(entity, sizeof(entity),
+                              "{\"id\":%d,\"name\":\"player_%d\",\"x\":%d.5,"
+                              "\"y\":%d.25,\"hp\":%d,\"state\":\"%s\"},",
+                              i, rand() % 500, rand() % 1000, rand() % 1000,
+                              rand() % 101, rand() % 2 ? "idle" : "moving");
+    if (entity_len > num_bytes - len) entity_len = (int)(num_bytes - len);
+    memcpy(bytes + len, entity, entity_len);
+    len += entity_len;
+  }
+}
+
+// Words from a small vocabulary, like log lines or chat.
+static void fill_text(char *bytes, size_t num_bytes) {
+  static const char *words[] = {
+    "the", "server", "client", "message", "sent", "to", "from", "a", "peer",
+    "request", "reply", "timed", "out", "after", "retry", "connection", "was",
+    "closed", "by", "remote", "host", "queue", "is", "full", "dropping"
+  };
+  size_t len = 0;
+  while (len < num_bytes) {
+    const char *word = words[rand() % array_size(words)];
+    for (size_t i = 0; word[i] && len < num_bytes; ++i) bytes[len++] = word[i];
+    if (len < num_bytes) bytes[len++] = ' ';
+  }
+}
+
+// Positions along random walks as raw floats, which vary in their low bits.
+static void fill_floats(char *bytes, size_t num_bytes) {
+  float value = 0.0f;
+  for (size_t i = 0; i + sizeof(float) <= num_bytes; i += sizeof(float)) {
+    value += (rand() % 21 - 10) * 0.01f;
+    memcpy(bytes + i, &value, sizeof(value));
+  }
+}
+
+// Already compressed or encrypted data.
+static void fill_random(char *bytes, size_t num_bytes) {
+  for (size_t i = 0; i < num_bytes; ++i) bytes[i] = (char)rand();
+}
+
+typedef struct {
+  const char *name;
+  void      (*fill)(char *bytes, size_t num_bytes);
+} Payload;
+
+static Payload payloads[] = {
+  { "json snapshot", fill_snapshot },
+  { "text",          fill_text     },
+  { "floats",        fill_floats   },
+  { "random",        fill_random   }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client and server
+
+static msg_Conn *listening_conn;
+static msg_Conn *client_conn;
+static msg_Conn *server_conn;
+static int       listening_ended;
+static int       num_received;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Server: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event == msg_message) {
+    server_conn = conn;
+    num_received++;
+  }
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Client: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+static double mb_per_sec(uint64_t num_bytes, int64_t time) {
+  return time ? num_bytes / (time / 1e9) / 1e6 : 0.0;
+}
+
+static void run(Payload *payload, int is_compressing) {
+  num_received    = 0;
+  listening_ended = false;
+  client_conn     = NULL;
+  server_conn     = NULL;
+
+  char address[64];
+  snprintf(address, 64, "tcp://127.0.0.1:%d", port++);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(10);
+  if (is_compressing) msg_set_compression(client_conn, 1024);
+
+  // Every message has new contents, as snapshots would.
+  msg_Data messages[8];
+  for (int i = 0; i < array_size(messages); ++i) {
+    messages[i] = msg_new_data_space(message_len);
+    payload->fill(messages[i].bytes, message_len);
+  }
+
+  int64_t start = now_ns();
+  for (int i = 0; i < num_messages; ++i) {
+    msg_send(client_conn, messages[i % array_size(messages)]);
+    msg_runloop(0);
+  }
+  while (num_received < num_messages) msg_runloop(1);
+  int64_t time = now_ns() - start;
+
+  msg_CompressionStats sent = msg_compression_stats(client_conn);
+  msg_CompressionStats recd = msg_compression_stats(server_conn);
+  uint64_t num_payload_bytes = (uint64_t)num_messages * message_len;
+  uint64_t num_wire_bytes    = num_payload_bytes - sent.num_bytes_before +
+                               sent.num_bytes_after;
+  printf("%-14s %-4s  %6.3f  %9.0f  %9.0f  %10.0f\n", payload->name,
+         is_compressing ? "on" : "off",
+         (double)num_wire_bytes / num_payload_bytes,
+         mb_per_sec(num_payload_bytes, sent.compress_time),
+         mb_per_sec(sent.num_bytes_before, recd.decompress_time),
+         mb_per_sec(num_payload_bytes, time));
+
+  for (int i = 0; i < array_size(messages); ++i) msg_delete_data(messages[i]);
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(10);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+
+int main(int argc, char **argv) {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  printf("%d messages of %d KB each over tcp loopback\n", num_messages,
+         message_len / 1024);
+  printf("%-19s  %6s  %9s  %9s  %10s\n", "", "ratio", "comp MB/s",
+         "dec MB/s", "total MB/s");
+  for (int i = 0; i < array_size(payloads); ++i) {
+    run(&payloads[i], false);
+    run(&payloads[i], true);
+  }
+  return 0;
+}
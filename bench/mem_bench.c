@@ -0,0 +1,103 @@
+// mem_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Measures how many messages per second a mem:// conn carries when a client
+// and server share one process and run loop, with no sockets involved. This is
+// roughly the overhead msgbox adds to each message of a simulation. The client
+// sends batches of one-way messages, and each batch is delivered by the next
+// loop iteration. A second run measures request/reply round trips.
+//
+// Run it with no arguments:
+//  ./mem_bench
+//
+
+#include "msgbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define true  1
+#define false 0
+
+#define message_len  64
+#define batch_size   1000
+#define num_batches  1000
+#define num_requests 50000   // Below the 16-bit reply_id wraparound.
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * msg_sec + ts.tv_nsec;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client and server
+
+static msg_Conn *listening_conn;
+static msg_Conn *client_conn;
+static int num_received;
+static int num_replies;
+static int listening_ended;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Server: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_message)         num_received++;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event == msg_request)         msg_send(conn, data);
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Client: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_connection_ready) client_conn = conn;
+  if (event == msg_reply)            num_replies++;
+}
+
+static void print_rate(const char *name, int num, int64_t elapsed) {
+  printf("%-10s  %9d  %12.0f  %10.0f\n", name, num,
+         (double)num * msg_sec / elapsed, (double)elapsed / num);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+
+int main(int argc, char **argv) {
+  msg_listen("mem://bench", server_update);
+  msg_connect("mem://bench", client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(0);
+
+  msg_Data data = msg_new_data_space(message_len);
+  memset(data.bytes, 'x', data.num_bytes);
+
+  printf("%-10s  %9s  %12s  %10s\n", "kind", "count", "per second", "ns each");
+
+  int64_t start = now_ns();
+  for (int i = 0; i < num_batches; ++i) {
+    for (int j = 0; j < batch_size; ++j) msg_send(client_conn, data);
+    msg_runloop(0);
+  }
+  print_rate("messages", num_received, now_ns() - start);
+
+  // Each request waits for its reply, so this measures round trips.
+  start = now_ns();
+  for (int i = 0; i < num_requests; ++i) {
+    msg_get(client_conn, data, msg_no_context);
+    while (num_replies <= i) msg_runloop(0);
+  }
+  print_rate("gets", num_replies, now_ns() - start);
+
+  msg_delete_data(data);
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(0);
+  return 0;
+}
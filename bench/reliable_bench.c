@@ -0,0 +1,338 @@
+// reliable_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Compares message latency under packet loss for tcp and for reliable udp
+// messages, ordered and unordered. A client sends a timestamped message every
+// millisecond to a server in the same process, and the server records how long
+// each one took to arrive.
+//
+// Traffic goes through a relay process that adds a one-way delay in each
+// direction and simulates loss:
+//
+//  * For udp, the relay drops datagrams in both directions, so msgbox's acks
+//    and resends are what's measured.
+//  * Tcp segments can't be dropped from user space, so the relay models what
+//    tcp does after a loss: the lost bytes arrive after a fast retransmit,
+//    about one round trip later, and every byte behind them waits too.
+//
+// Run it with no arguments, or with a loss percentage and a one-way delay in
+// ms, as in:
+//  ./reliable_bench 2 10
+//
+
+#include "msgbox.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+#define num_messages  2000
+#define message_len   32
+
+// The relay's model of tcp's fast retransmit waits for three more segments.
+#define fast_retransmit_wait (3 * msg_ms)
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+static double  loss_rate = 0.02;
+static int64_t delay     = 10 * msg_ms;
+
+static int port;
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * msg_sec + ts.tv_nsec;
+}
+
+static int is_lost() {
+  return rand() < loss_rate * RAND_MAX;
+}
+
+static struct sockaddr_in loopback_addr(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return addr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// the relay
+
+// Bytes waiting to be forwarded. Each direction has a constant delay, so each
+// queue is in order of due time.
+typedef struct {
+  int64_t due_at;
+  int     len;
+  char    bytes[2048];
+} Packet;
+
+#define queue_len 4096
+
+typedef struct {
+  Packet  packets[queue_len];
+  int     head;
+  int     count;
+  int64_t last_due_at;  // Used by tcp, whose bytes can't pass each other.
+} Queue;
+
+static Queue queues[2];  // Index 0 is toward the server; 1 toward the client.
+
+static void push(Queue *queue, char *bytes, int len, int64_t due_at) {
+  if (queue->count == queue_len) return;  // Treat overflow as a loss.
+  Packet *packet = &queue->packets[(queue->head + queue->count) % queue_len];
+  packet->due_at = due_at;
+  packet->len    = len;
+  memcpy(packet->bytes, bytes, len);
+  queue->count++;
+}
+
+static Packet *due_packet(Queue *queue, int64_t now) {
+  if (queue->count == 0) return NULL;
+  Packet *packet = &queue->packets[queue->head];
+  return packet->due_at <= now ? packet : NULL;
+}
+
+static void pop(Queue *queue) {
+  queue->head = (queue->head + 1) % queue_len;
+  queue->count--;
+}
+
+static int poll_timeout_ms() {
+  int64_t next = 0;
+  for (int i = 0; i < 2; ++i) {
+    if (queues[i].count == 0) continue;
+    int64_t due_at = queues[i].packets[queues[i].head].due_at;
+    if (next == 0 || due_at < next) next = due_at;
+  }
+  if (next == 0) return 100;
+  int64_t wait = next - now_ns();
+  return wait <= 0 ? 0 : (int)(wait / msg_ms) + 1;
+}
+
+// Relays datagrams between a client and the server at server_port, dropping
+// loss_rate of them in each direction.
+static void run_udp_relay(int relay_port, int server_port) {
+  int front = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = loopback_addr(relay_port);
+  bind(front, (struct sockaddr *)&addr, sizeof(addr));
+  int back = socket(AF_INET, SOCK_DGRAM, 0);
+  addr = loopback_addr(server_port);
+  connect(back, (struct sockaddr *)&addr, sizeof(addr));
+
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len = 0;
+  struct pollfd fds[2] = { {front, POLLIN, 0}, {back, POLLIN, 0} };
+  char buffer[2048];
+
+  while (true) {
+    poll(fds, 2, poll_timeout_ms());
+    int64_t now = now_ns();
+    for (int i = 0; i < 2; ++i) {
+      if (!(fds[i].revents & POLLIN)) continue;
+      socklen_t addr_len = sizeof(addr);
+      long len = recvfrom(fds[i].fd, buffer, sizeof(buffer), 0,
+                          (struct sockaddr *)&addr, &addr_len);
+      if (len <= 0) continue;
+      if (i == 0) {
+        client_addr     = addr;
+        client_addr_len = addr_len;
+      }
+      if (!is_lost()) push(&queues[i], buffer, (int)len, now + delay);
+    }
+    Packet *packet;
+    while ((packet = due_packet(&queues[0], now))) {
+      send(back, packet->bytes, packet->len, 0);
+      pop(&queues[0]);
+    }
+    while ((packet = due_packet(&queues[1], now))) {
+      sendto(front, packet->bytes, packet->len, 0,
+             (struct sockaddr *)&client_addr, client_addr_len);
+      pop(&queues[1]);
+    }
+  }
+}
+
+// Relays a tcp stream between a client and the server at server_port. A read
+// counts as a lost segment with probability loss_rate; it's delayed by a fast
+// retransmit, and the bytes behind it wait for it.
+static void run_tcp_relay(int relay_port, int server_port) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  struct sockaddr_in addr = loopback_addr(relay_port);
+  bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+  listen(listener, 1);
+  int front = accept(listener, NULL, NULL);
+  int back  = socket(AF_INET, SOCK_STREAM, 0);
+  addr = loopback_addr(server_port);
+  connect(back, (struct sockaddr *)&addr, sizeof(addr));
+
+  int socks[2] = {back, front};  // Where each queue's bytes go.
+  struct pollfd fds[2] = { {front, POLLIN, 0}, {back, POLLIN, 0} };
+  char buffer[2048];
+  int64_t rtt = 2 * delay;
+
+  while (true) {
+    poll(fds, 2, poll_timeout_ms());
+    int64_t now = now_ns();
+    for (int i = 0; i < 2; ++i) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP))) continue;
+      long len = recv(fds[i].fd, buffer, sizeof(buffer), 0);
+      if (len <= 0) exit(0);
+      int64_t due_at = now + delay;
+      if (is_lost()) due_at += rtt + fast_retransmit_wait;
+      Queue *queue = &queues[i];
+      if (due_at < queue->last_due_at) due_at = queue->last_due_at;
+      queue->last_due_at = due_at;
+      push(queue, buffer, (int)len, due_at);
+    }
+    for (int i = 0; i < 2; ++i) {
+      Packet *packet;
+      while ((packet = due_packet(&queues[i], now))) {
+        send(socks[i], packet->bytes, packet->len, 0);
+        pop(&queues[i]);
+      }
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client and server
+
+typedef enum { mode_tcp, mode_ordered, mode_unordered } Mode;
+
+static char *mode_names[] = {"tcp", "udp ordered", "udp unordered"};
+
+static Mode       mode;
+static msg_Conn * listening_conn;
+static msg_Conn * client_conn;
+static int        listening_ended;
+static int        num_sent;
+static int        num_received;
+static int64_t    latencies[num_messages];
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Server: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event == msg_message && num_received < num_messages) {
+    int64_t sent_at;
+    memcpy(&sent_at, data.bytes, sizeof(sent_at));
+    latencies[num_received++] = now_ns() - sent_at;
+  }
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Client: Error: %s\n", msg_error_str(data));
+  }
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+static void send_next(msg_Timer *timer, void *context) {
+  if (num_sent == num_messages) return msg_cancel_timer(timer);
+  msg_Data data = msg_new_data_space(message_len);
+  memset(data.bytes, 0, message_len);
+  int64_t sent_at = now_ns();
+  memcpy(data.bytes, &sent_at, sizeof(sent_at));
+  if (mode == mode_tcp) msg_send(client_conn, data);
+  else msg_send_reliable(client_conn, data, mode == mode_ordered);
+  msg_delete_data(data);
+  num_sent++;
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(int64_t *)a, y = *(int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void run_mode(Mode new_mode) {
+  mode            = new_mode;
+  num_sent        = 0;
+  num_received    = 0;
+  listening_ended = false;
+  client_conn     = NULL;
+  char *protocol  = mode == mode_tcp ? "tcp" : "udp";
+
+  char address[64];
+  snprintf(address, 64, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+
+  fflush(stdout);  // Otherwise the relay may print it again.
+  pid_t relay = fork();
+  if (relay == 0) {
+    srand(getpid());
+    if (mode == mode_tcp) run_tcp_relay(port + 1, port);
+    else                  run_udp_relay(port + 1, port);
+    exit(0);
+  }
+  usleep(50000);  // Give the relay time to start.
+
+  snprintf(address, 64, "%s://127.0.0.1:%d", protocol, port + 1);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(10);
+
+  msg_add_timer(0, msg_ms, send_next, NULL);
+  int64_t end = now_ns() + num_messages * msg_ms + 5 * msg_sec;
+  while (num_received < num_messages && now_ns() < end) msg_runloop(1);
+
+  // A message is late if it took noticeably longer than the delay.
+  int num_late = 0;
+  for (int i = 0; i < num_received; ++i) {
+    if (latencies[i] > delay * 3 / 2) num_late++;
+  }
+  qsort(latencies, num_received, sizeof(int64_t), compare_int64);
+  printf("%-14s  %8d  %7.1f%%  %8.1f  %8.1f  %8.1f\n", mode_names[mode],
+         num_received, 100.0 * num_late / num_received,
+         latencies[num_received / 2]       / 1e6,
+         latencies[num_received * 99 / 100] / 1e6,
+         latencies[num_received - 1]       / 1e6);
+
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(10);
+  kill(relay, SIGTERM);
+  waitpid(relay, NULL, 0);
+  port += 2;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+
+int main(int argc, char **argv) {
+  if (argc > 1) loss_rate = atof(argv[1]) / 100;
+  if (argc > 2) delay     = atoi(argv[2]) * msg_ms;
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  printf("%d messages, %.1f%% loss, %d ms one-way delay\n", num_messages,
+         loss_rate * 100, (int)(delay / msg_ms));
+  printf("%-14s  %8s  %8s  %8s  %8s  %8s\n", "", "received", "late",
+         "p50 ms", "p99 ms", "max ms");
+
+  Mode modes[] = {mode_tcp, mode_ordered, mode_unordered};
+  for (int i = 0; i < array_size(modes); ++i) run_mode(modes[i]);
+  return 0;
+}
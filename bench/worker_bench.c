@@ -0,0 +1,224 @@
+// worker_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Measures request throughput against a server whose request handler is
+// CPU-heavy, for several worker counts passed to msg_use_workers.
+//
+// A forked client process opens one udp conn to each of num_ports listening
+// conns, and keeps a few requests outstanding on each conn. The server works
+// for a fixed amount of time on each request before it replies.
+//
+// Run it with no arguments:
+//  ./worker_bench
+//
+
+#include "msgbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+#define num_ports        8     // The client has one conn per port.
+#define num_outstanding  4     // Requests in flight per conn.
+#define requests_per_conn 1000
+#define work_ns          (100 * 1000)  // CPU time spent per request.
+
+static int worker_counts[] = {0, 1, 2, 4, 8};
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+static int base_port;
+
+static int64_t thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * msg_sec + ts.tv_nsec;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+static int num_listening_ended;
+
+// Stands in for pathfinding or physics validation.
+static uint64_t do_work(uint64_t x) {
+  int64_t end = thread_cpu_ns() + work_ns;
+  while (thread_cpu_ns() < end) {
+    for (int i = 0; i < 100; ++i) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+    }
+  }
+  return x;
+}
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) {
+    fprintf(stderr, "Server: Error: %s\n", msg_error_str(data));
+  }
+
+  if (event == msg_request) {
+    uint64_t x = do_work(*(uint64_t *)data.bytes);
+    msg_Data reply = msg_new_data_space(sizeof(x));
+    *(uint64_t *)reply.bytes = x;
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_message) {
+    // The client is done with this conn. Each listening conn has one client
+    // conn, so it can be closed now.
+    msg_unlisten(conn);
+  }
+
+  if (event == msg_listening_ended) {
+    __atomic_add_fetch(&num_listening_ended, 1, __ATOMIC_ACQ_REL);
+  }
+}
+
+static void run_server(int workers, int ready_fd) {
+  num_listening_ended = 0;
+  msg_use_workers(workers);
+  for (int i = 0; i < num_ports; ++i) {
+    char address[64];
+    snprintf(address, 64, "udp://*:%d", base_port + i);
+    msg_listen(address, server_update);
+  }
+  msg_runloop(0);
+
+  // Tell the client to start.
+  char byte = 1;
+  if (write(ready_fd, &byte, 1) != 1) return;
+
+  while (__atomic_load_n(&num_listening_ended, __ATOMIC_ACQUIRE) < num_ports) {
+    msg_runloop(10);
+  }
+  msg_use_workers(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+static int num_replies[num_ports];
+static int num_finished;
+
+static void send_request(msg_Conn *conn, int port_index) {
+  msg_Data data = msg_new_data_space(sizeof(uint64_t));
+  *(uint64_t *)data.bytes = rand() + 1;
+  msg_get(conn, data, (void *)(intptr_t)port_index);
+  msg_delete_data(data);
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  int port_index = (int)(intptr_t)conn->conn_context;
+
+  if (event == msg_error) {
+    // A timed-out request is retried, as udp may drop a datagram.
+    fprintf(stderr, "Client: Error: %s\n", msg_error_str(data));
+    if (strstr(msg_error_str(data), "timed out")) {
+      send_request(conn, port_index);
+    }
+  }
+
+  if (event == msg_connection_ready) {
+    for (int i = 0; i < num_outstanding; ++i) send_request(conn, port_index);
+  }
+
+  if (event == msg_reply) {
+    int n = ++num_replies[port_index];
+    if (n + num_outstanding <= requests_per_conn) send_request(conn, port_index);
+    if (n == requests_per_conn) {
+      msg_Data done = msg_new_data("done");
+      msg_send(conn, done);
+      msg_delete_data(done);
+      num_finished++;
+    }
+  }
+}
+
+// Returns the time taken to receive every reply, in ns.
+static int64_t run_client() {
+  memset(num_replies, 0, sizeof(num_replies));
+  num_finished = 0;
+
+  for (int i = 0; i < num_ports; ++i) {
+    char address[64];
+    snprintf(address, 64, "udp://127.0.0.1:%d", base_port + i);
+    msg_connect(address, client_update, (void *)(intptr_t)i);
+  }
+
+  msg_runloop(0);
+  int64_t start = msg_loop_now();
+  while (num_finished < num_ports) msg_runloop(10);
+  return msg_loop_now() - start;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+
+// The client process runs before the server sets up msgbox, so that the two
+// don't share any msgbox state. It runs once per worker count, starting when
+// the server writes to ready_fd, and writes its times to times_fd.
+static void client_process(int ready_fd, int times_fd) {
+  for (int i = 0; i < array_size(worker_counts); ++i) {
+    char byte;
+    if (read(ready_fd, &byte, 1) != 1) exit(1);
+    int64_t elapsed = run_client();
+    if (write(times_fd, &elapsed, sizeof(elapsed)) != sizeof(elapsed)) exit(1);
+    base_port += num_ports;
+  }
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  srand(time(NULL));
+  base_port = rand() % 1024 + 1024;
+
+  int ready_fds[2], times_fds[2];
+  if (pipe(ready_fds) == -1 || pipe(times_fds) == -1) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t client_pid = fork();
+  if (client_pid == -1) {
+    perror("fork");
+    return 1;
+  }
+  if (client_pid == 0) client_process(ready_fds[0], times_fds[1]);
+
+  int total_requests = num_ports * requests_per_conn;
+  printf("%d requests, %d us of work each, %d conns\n",
+         total_requests, work_ns / 1000, num_ports);
+  printf("%7s  %12s  %7s\n", "workers", "requests/s", "speedup");
+
+  double base_rate = 0;
+  for (int i = 0; i < array_size(worker_counts); ++i) {
+    run_server(worker_counts[i], ready_fds[1]);
+
+    int64_t elapsed = 0;
+    if (read(times_fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) {
+      fprintf(stderr, "The client failed to report its time.\n");
+      return 1;
+    }
+
+    double rate = total_requests / ((double)elapsed / msg_sec);
+    if (i == 0) base_rate = rate;
+    printf("%7d  %12.0f  %6.2fx\n", worker_counts[i], rate, rate / base_rate);
+
+    base_port += num_ports;
+  }
+
+  waitpid(client_pid, NULL, 0);
+  return 0;
+}
@@ -117,6 +117,31 @@ void map__clear(Map map) {
   map->count = 0;
 }
 
+void map__shrink(Map map) {
+  int old_n = map->buckets->count;
+  int n = old_n;
+  while (n > MIN_BUCKETS && map->count < (n / 2) * MAX_LOAD / 4) n /= 2;
+  if (n == old_n) return;
+
+  // Since n divides old_n, pairs in the first n buckets are already in place.
+  for (int index = n; index < old_n; ++index) {
+    List *bucket = (List *)array__item_ptr(map->buckets, index);
+    while (*bucket) {
+      map__key_value *pair = (*bucket)->item;
+      list__remove_first(bucket);
+      int new_index = ((unsigned int)map->hash(pair->key)) % n;
+      list__insert((List *)array__item_ptr(map->buckets, new_index), pair);
+    }
+  }
+  map->buckets->count = n;
+
+  // If realloc fails, the larger buckets array is still valid, so we keep it.
+  void *items = realloc(map->buckets->items, n * map->buckets->item_size);
+  if (items == NULL) return;
+  map->buckets->items    = items;
+  map->buckets->capacity = n;
+}
+
 map__key_value *map__next(Map map, int *i, void **p) {
   // *i is the bucket index.
   // *p is the List entry in that bucket.
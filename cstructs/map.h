@@ -43,6 +43,10 @@ map__key_value * map__get    (Map map, void *needle);
 
 void             map__clear  (Map map);
 
+// Halves the number of buckets, and frees the unused ones, while the map is
+// lightly loaded. The map never grows smaller than its initial size.
+void             map__shrink (Map map);
+
 // This is for use with map__for.
 map__key_value * map__next   (Map map, int *i, void **p);
 
@@ -16,6 +16,7 @@
 #include "../cstructs/cstructs.h"
 #include "dbgcheck.h"
 
+#include <stddef.h>
 #include <stdio.h>
 
 // Universal forward declarations for os-specific code.
@@ -76,8 +77,13 @@ static int net_allocs[] = {0};  // Indexed by class.
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
 // EWOULDBLOCK is the same as EAGAIN on mac.
 #define err_would_block   EWOULDBLOCK
 #define err_in_progress   EINPROGRESS
@@ -191,10 +197,64 @@ static int avoid_sigpipe(int sock) {
 // End SIGPIPE section.
 /////
 
+/////
+// This section is about sending file bytes to a socket with sendfile, which
+// doesn't copy them through user space. A file that ends before num_bytes is an
+// error, since the peer expects every byte.
+
+#include <sys/stat.h>
+
+#define dup_file   dup
+#define close_file close
+
+// Returns the size of the file, or -1 on error.
+// mac/linux version
+static int64_t file_size(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) return -1;
+  return (int64_t)file_stat.st_size;
+}
+
+#ifdef __APPLE__
+
+#include <sys/uio.h>
+
+// Returns the number of bytes sent, or -1 on error.
+// mac version
+static long send_file_bytes(int sock, int fd, int64_t offset,
+                            size_t num_bytes) {
+  off_t len = (off_t)num_bytes;
+  int ret_val = sendfile(fd, sock, (off_t)offset, &len, NULL, 0);
+  // On EAGAIN, len is still the number of bytes sent.
+  if (ret_val == -1 && (errno != EAGAIN || len == 0)) return -1;
+  if (len == 0) set_errno(EIO);
+  return len ? (long)len : -1;
+}
+
+#else
+
+#include <sys/sendfile.h>
+
+// Returns the number of bytes sent, or -1 on error.
+// linux version
+static long send_file_bytes(int sock, int fd, int64_t offset,
+                            size_t num_bytes) {
+  off_t file_offset = (off_t)offset;
+  long bytes_sent = sendfile(sock, fd, &file_offset, num_bytes);
+  if (bytes_sent == 0) set_errno(EIO);
+  return bytes_sent ? bytes_sent : -1;
+}
+
+#endif
+
+// End sendfile section.
+/////
+
 // mac/linux version
 static void set_conn_to_poll_mode(int index, PollMode poll_mode) {
   struct pollfd *poll_fd = array__item_ptr(poll_fds, index);
-  poll_fd->events = ((poll_mode & poll_mode_read) ? POLLIN : POLLOUT);
+  poll_fd->events = ((poll_mode & poll_mode_read)  ? POLLIN  : 0) |
+                    ((poll_mode & poll_mode_write) ? POLLOUT : 0);
 }
 
 // mac/linux version
@@ -214,6 +274,90 @@ static PollMode poll_fds_mode(int sock, int index) {
   return poll_mode;
 }
 
+/////
+// Atomic operations, used by the thread-safe post functions, by the worker
+// threads, and by the shared-memory rings.
+
+#define atomic_load_ptr(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_store_ptr(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define atomic_xchg_ptr(ptr, val)  __atomic_exchange_n(ptr, val, \
+                                                       __ATOMIC_ACQ_REL)
+#define atomic_xchg_int(ptr, val)  __atomic_exchange_n(ptr, val, \
+                                                       __ATOMIC_ACQ_REL)
+#define atomic_store_int(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define atomic_add_int(ptr, val)   __atomic_add_fetch(ptr, val, \
+                                                      __ATOMIC_ACQ_REL)
+#define atomic_load_int(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_load_u64(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_store_u64(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define atomic_fence()             __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// This is set on the threads started by msg_use_workers.
+static __thread int is_worker_thread = 0;
+
+/////
+// This section is about the wakeup fd, which other threads use to interrupt
+// a poll call on the run loop thread.
+
+#ifdef __linux__
+
+#include <sys/eventfd.h>
+
+static int wakeup_fd = -1;
+
+// Returns the fd to poll on success, or -1 on error.
+// linux version
+static int open_wakeup_fd() {
+  wakeup_fd = eventfd(0, EFD_NONBLOCK);
+  return wakeup_fd;
+}
+
+// linux version
+static void signal_wakeup_fd() {
+  uint64_t one = 1;
+  ssize_t ret_val = write(wakeup_fd, &one, sizeof(one));
+  (void)ret_val;  // An error means the counter is already nonzero.
+}
+
+// linux version
+static void drain_wakeup_fd() {
+  uint64_t count;
+  ssize_t ret_val = read(wakeup_fd, &count, sizeof(count));
+  (void)ret_val;  // An error means there was nothing to drain.
+}
+
+#else
+
+static int wakeup_pipe[2] = {-1, -1};
+
+// Returns the fd to poll on success, or -1 on error.
+// mac version
+static int open_wakeup_fd() {
+  if (pipe(wakeup_pipe) == -1) return -1;
+  if (make_non_blocking(wakeup_pipe[0]) || make_non_blocking(wakeup_pipe[1])) {
+    return -1;
+  }
+  return wakeup_pipe[0];
+}
+
+// mac version
+static void signal_wakeup_fd() {
+  char byte = 1;
+  ssize_t ret_val = write(wakeup_pipe[1], &byte, 1);
+  (void)ret_val;  // An error means the pipe is full, so it's readable.
+}
+
+// mac version
+static void drain_wakeup_fd() {
+  char bytes[64];
+  while (read(wakeup_pipe[0], bytes, sizeof(bytes)) > 0);
+}
+
+#endif
+
+// End wakeup fd section.
+/////
+
 #else
 
 // Windows setup.
@@ -353,6 +497,35 @@ static int avoid_sigpipe(int sock) {
 
 #define send_flags 0
 
+#include <io.h>
+#include <sys/stat.h>
+
+#define dup_file   _dup
+#define close_file _close
+
+// Returns the size of the file, or -1 on error.
+// windows version
+static int64_t file_size(int fd) {
+  struct _stat64 file_stat;
+  if (_fstat64(fd, &file_stat) == -1) return -1;
+  return (int64_t)file_stat.st_size;
+}
+
+// Returns the number of bytes sent, or -1 on error.
+// windows version; there's no sendfile, so this copies through a buffer.
+static long send_file_bytes(int sock, int fd, int64_t offset,
+                            size_t num_bytes) {
+  char buffer[64 * 1024];
+  if (num_bytes > sizeof(buffer)) num_bytes = sizeof(buffer);
+  if (_lseeki64(fd, offset, SEEK_SET) == -1) return -1;
+  int num_read = _read(fd, buffer, (unsigned int)num_bytes);
+  if (num_read <= 0) {
+    set_errno(WSAEINVAL);
+    return -1;
+  }
+  return send(sock, buffer, num_read, send_flags);
+}
+
 // windows version
 static void set_conn_to_poll_mode(int index, PollMode poll_mode) {
   array__item_val(poll_fds.poll_modes, index, PollMode) = poll_mode;
@@ -361,6 +534,12 @@ static void set_conn_to_poll_mode(int index, PollMode poll_mode) {
 // windows version
 static int check_poll_fds(int timeout_in_ms) {
 
+  // select fails when given no sockets, so we simply wait out the timeout.
+  if (poll_fds.poll_modes->count == 0) {
+    if (timeout_in_ms > 0) Sleep(timeout_in_ms);
+    return 0;
+  }
+
   // Set up the fd_set data.
   FD_ZERO(&poll_fds.read_fds);
   FD_ZERO(&poll_fds.write_fds);
@@ -368,9 +547,8 @@ static int check_poll_fds(int timeout_in_ms) {
   array__for(PollMode *, poll_mode, poll_fds.poll_modes, i) {
     msg_Conn *conn = array__item_val(conns, i, msg_Conn *);
     FD_SET(conn->socket, &poll_fds.except_fds);
-    FD_SET(conn->socket, (*poll_mode == poll_mode_read ?
-                          &poll_fds.read_fds :
-                          &poll_fds.write_fds));
+    if (*poll_mode & poll_mode_read)  FD_SET(conn->socket, &poll_fds.read_fds);
+    if (*poll_mode & poll_mode_write) FD_SET(conn->socket, &poll_fds.write_fds);
   }
 
   // Set up the timeout and call select.
@@ -395,12 +573,64 @@ static PollMode poll_fds_mode(int sock, int index) {
   return poll_mode;
 }
 
+// windows versions
+#define atomic_load_ptr(ptr)       InterlockedCompareExchangePointer( \
+                                       (PVOID volatile *)(ptr), NULL, NULL)
+#define atomic_store_ptr(ptr, val) InterlockedExchangePointer( \
+                                       (PVOID volatile *)(ptr), val)
+#define atomic_xchg_ptr(ptr, val)  InterlockedExchangePointer( \
+                                       (PVOID volatile *)(ptr), val)
+#define atomic_xchg_int(ptr, val)  InterlockedExchange((LONG volatile *)(ptr), \
+                                                       val)
+#define atomic_store_int(ptr, val) InterlockedExchange((LONG volatile *)(ptr), \
+                                                       val)
+#define atomic_add_int(ptr, val)   (InterlockedExchangeAdd( \
+                                       (LONG volatile *)(ptr), val) + (val))
+
+// Worker threads are not yet supported on windows.
+#define is_worker_thread 0
+
+// On windows, the wakeup fd is a loopback udp socket connected to itself.
+static SOCKET wakeup_sock = INVALID_SOCKET;
+
+// Returns the socket to poll on success, or -1 on error.
+// windows version
+static int open_wakeup_fd() {
+  wakeup_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (wakeup_sock == INVALID_SOCKET) return -1;
+  struct sockaddr_in addr;
+  int addr_len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(wakeup_sock, (struct sockaddr *)&addr, addr_len) ||
+      getsockname(wakeup_sock, (struct sockaddr *)&addr, &addr_len) ||
+      connect(wakeup_sock, (struct sockaddr *)&addr, addr_len) ||
+      make_non_blocking((int)wakeup_sock)) {
+    return -1;
+  }
+  return (int)wakeup_sock;
+}
+
+// windows version
+static void signal_wakeup_fd() {
+  char byte = 1;
+  send(wakeup_sock, &byte, 1, 0);
+}
+
+// windows version
+static void drain_wakeup_fd() {
+  char bytes[64];
+  while (recv(wakeup_sock, bytes, sizeof(bytes), 0) > 0);
+}
+
 #endif
 
 // Windows has dependencies around the order of included header files making
 // the code simpler if we include msgbox_now here rather than before the
 // windows-specific section.
 #include "msgbox_now.h"
+#include "msgbox_lz.h"
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -452,8 +682,17 @@ static PollMode poll_fds_mode(int sock, int index) {
 
 static msg_Data msg_no_data = { .num_bytes = 0, .bytes = NULL };
 
+typedef struct ConnStatus ConnStatus;
+typedef struct Strand     Strand;
+
+static void delete_strand(Strand *strand);
+
+// The status field, when set, holds a reference to the remote peer's
+// ConnStatus so that make_call never has to look it up again; the reference
+// keeps the status alive even if the peer is dropped before the call is made.
 typedef struct {
   msg_Conn *conn;
+  ConnStatus *status;
   msg_Event event;
   msg_Data data;
   void *to_free;
@@ -464,6 +703,7 @@ typedef struct {
 #define no_set_name NULL
 
 static Array immediate_callbacks = NULL;
+static Array spare_callbacks     = NULL;  // Reused by msg_runloop.
 
 // Possible values for message_type.
 enum {
@@ -471,9 +711,20 @@ enum {
   msg_type_request,
   msg_type_reply,
   msg_type_heartbeat,
-  msg_type_close
+  msg_type_close,
+  msg_type_fragment,
+  msg_type_reliable,
+  msg_type_ack,
+  msg_type_packed,
+  msg_type_shm_setup,
+  msg_type_doorbell,
+  msg_type_hello
 };
 
+// This bit is set in the message_type of a one-way message, request, or reply
+// whose body is compressed; see Compression.
+#define msg_type_compressed 0x8000
+
 typedef struct {
   uint16_t message_type;
   uint16_t reply_id;
@@ -490,15 +741,28 @@ typedef struct {
 
 // Metadata is the preamble for a msg_Data buffer.
 // The non-header fields are used by listening udp sockets,
-// for which we must hold state across many remotes.
+// for which we must hold state across many remotes. The remote address
+// itself travels with the PendingCall's status.
 typedef struct {
-  void *  reply_context;
-  Address remote_address;
-  Header  header;
+  void *   reply_context;
+  uint32_t alloc_kind;    // Says how msg_delete_data frees the buffer.
+  uint32_t chunk_offset;  // Used by msg_message_chunk data; see msg_chunk_info.
+  Header   header;
 } Metadata;
 
 #define metadata_len (sizeof(Metadata))
 
+// The header must be right before the bytes of a msg_Data.
+typedef char metadata_ends_with_header[
+    offsetof(Metadata, header) + header_len == metadata_len ? 1 : -1];
+
+// Possible values for alloc_kind.
+enum {
+  alloc_kind_heap,
+  alloc_kind_small_block,
+  alloc_kind_arena
+};
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Connection status map.
@@ -507,7 +771,16 @@ Address *address_of_conn(msg_Conn *conn) {
   return (Address *)(&conn->remote_ip);
 }
 
+// A unix domain socket's address holds an id in place of an ip, and a port of
+// 0, which no inet peer has; see Local sockets.
+static int is_local_address(Address *address) {
+  return address->port == 0 && address->ip != 0;
+}
+
+static char *local_address_str(Address *address);
+
 char *address_as_str(Address *address) {
+  if (is_local_address(address)) return local_address_str(address);
   struct in_addr in;
   in.s_addr = address->ip;
   static char address_str[32];
@@ -541,53 +814,211 @@ int reply_id_eq(void *reply_id1, void *reply_id2) {
   return id1 == id2;
 }
 
-typedef struct {
-  double   last_seen_at;
-  Map      reply_contexts;  // Map reply_id -> reply_context.
+struct ConnStatus {
+  int64_t  last_seen_at;    // When we last heard anything from the peer.
+  int64_t  last_active_at;  // When the peer last sent us a message.
+  Map      pending_gets;    // Map reply_id -> timeout msg_Timer.
   void *   conn_context;    // Useful for listening udp conns.
   uint16_t next_reply_id;
   Address  remote_address;
 
-  // These overlap; waiting_buffer is a suffix of total_buffer.
-  msg_Data total_buffer;
-  msg_Data waiting_buffer;
-} ConnStatus;
+  // One reference is owned by conn_status; each PendingCall and msg_Timer
+  // that points to this status owns another, as does a scheduled strand.
+  // Calls made on worker threads release theirs, so this is atomic.
+  int      refcount;
+
+  // This is created when the first call for this peer goes to the workers.
+  Strand * strand;
+
+  // Udp peers are kept in the out_beats rotation, in next_beat_at order.
+  msg_Conn *  conn;           // The udp or mem conn this peer is reached
+                              // through.
+  int64_t     next_beat_at;
+  int         is_in_out_beats;
+  ConnStatus *beat_prev;
+  ConnStatus *beat_next;
+
+  // A tcp message being received. Its header is kept in the buffer's preamble,
+  // and the buffer grows as bytes arrive, up to the size in the header.
+  msg_Data in_buffer;     // num_bytes is the room allocated so far.
+  size_t   num_bytes_in;  // The number of body bytes received so far.
+  int      is_chunking;   // True when in_buffer holds a chunk of a message.
+
+  // A udp peer's in_buffer holds the fragmented message being reassembled.
+  uint16_t   frag_message_id;
+  uint16_t   frag_num_packets;
+  size_t     frag_slice_len;     // The length of every slice but the last.
+  uint8_t *  frag_packets_seen;  // A bitmap indexed by packet_id.
+  msg_Timer *frag_timer;         // Fires if the message takes too long.
+
+  // Tcp bytes the socket wasn't ready for, in out_bytes[out_start, out_end).
+  char *    out_bytes;
+  size_t    out_start;
+  size_t    out_end;
+  size_t    out_room;
+  msg_Conn *out_conn;       // The tcp conn they go to; NULL once dropped.
+  int       is_coalescing;  // Set by msg_set_coalescing.
+  int       is_flush_due;   // True while in flushes_due.
+  msg_Timer *close_timer;   // Set while msg_disconnect waits for the queue.
+
+  Array     file_sends;     // FileSend items waiting to be sent, in order.
+
+  // Zero-copy tcp sends whose buffers the kernel may still read.
+  Array     zc_sends;       // ZeroCopySend items, oldest first.
+  uint32_t  zc_next_id;     // The kernel's id for the next zero-copy send.
+  int       zc_state;       // One of the zc_state_* values.
+
+  // A coalescing udp peer's messages waiting to share a datagram. They start
+  // header_len bytes into pack_bytes, leaving room for the packed header.
+  char *    pack_bytes;
+  size_t    pack_len;       // The bytes of messages after the header room.
+  size_t    pack_room;
+  int       pack_count;
+
+  // Set by msg_set_watermarks; a high_watermark of 0 means no events.
+  size_t   high_watermark;
+  size_t   low_watermark;
+  int      is_send_blocked;
+
+  // The reliable channel with a udp peer; created on first use.
+  struct Reliable *reliable;
+
+  // Paces datagrams to a udp peer; created on first use when pacing is on.
+  struct Pacer *pacer;
+
+  // Injects faults into the path to a udp peer; see Fault injection.
+  struct Impairment *impairment;
+
+  // Set by msg_set_streaming; one-way messages that start after this is set
+  // arrive as msg_message_chunk events.
+  int      is_streaming;
+
+  // A shm:// peer is sent messages through rings in shared memory; see
+  // Shared-memory rings. is_shm is cleared if the rings can't be set up.
+  int             is_shm;
+  struct ShmLink *shm;  // NULL until the rings are set up.
+
+  // The status of the other end of a mem:// conn; see Memory conns.
+  ConnStatus *mem_peer;
+
+  // What the peer's hello says it supports; see Handshakes.
+  int      is_hello_sent;
+  int      has_hello;  // False until the peer's hello arrives.
+  uint16_t peer_version;
+  uint32_t peer_capabilities;
+
+  // Set by msg_set_compression; 0 means messages are sent as they are.
+  size_t               min_compressed_len;
+  msg_CompressionStats compression;
+};
 
-ConnStatus *new_conn_status(double now, Address *address) {
+ConnStatus *new_conn_status(int64_t now, Address *address) {
   ConnStatus *status     = dbgcheck__calloc(sizeof(ConnStatus), "ConnStatus");
   status->last_seen_at   = now;
-  status->reply_contexts = map__new(reply_id_hash, reply_id_eq);
+  status->last_active_at = now;
+  status->pending_gets   = map__new(reply_id_hash, reply_id_eq);
   status->next_reply_id  = 1;
   status->remote_address = *address;
+  status->refcount       = 1;
   return status;
 }
 
-static void new_conn_status_buffer(ConnStatus *status, Header *header) {
-  status->total_buffer = status->waiting_buffer =
-      msg_new_data_space(header->num_bytes);
-  memcpy(status->total_buffer.bytes - header_len, header, header_len);
+// Inbound tcp buffers start at this size, and double as bytes arrive, so that
+// a peer can't make us reserve a large message's memory without sending it.
+#define initial_in_buffer_len 4096
+
+static size_t max_message_size  = 0;  // Zero means no limit.
+static size_t inbound_limit     = 0;  // Zero means no limit.
+static size_t num_inbound_bytes = 0;  // Room held by partly received messages.
+
+static msg_Data new_inbound_data(size_t num_bytes);
+
+// Counts num_bytes more toward inbound_limit. Returns false, without counting
+// them, if they don't fit.
+static int reserve_inbound_bytes(size_t num_bytes) {
+  if (inbound_limit && num_inbound_bytes + num_bytes > inbound_limit) {
+    return false;
+  }
+  num_inbound_bytes += num_bytes;
+  return true;
+}
+
+// Returns false if inbound_limit leaves no room for the buffer.
+static int new_conn_status_buffer(ConnStatus *status, Header *header) {
+  size_t num_bytes = header->num_bytes;
+  if (num_bytes > initial_in_buffer_len) num_bytes = initial_in_buffer_len;
+  if (!reserve_inbound_bytes(num_bytes)) return false;
+  status->in_buffer    = new_inbound_data(num_bytes);
+  status->num_bytes_in = 0;
+  status->is_chunking  = false;
+  memcpy(status->in_buffer.bytes - header_len, header, header_len);
+  return true;
+}
+
+// Doubles the room in the buffer, up to the message size in its header.
+// Returns false if inbound_limit leaves no room for that, and -1 if there's no
+// memory for it; the buffer is unchanged in either case.
+static int grow_conn_status_buffer(ConnStatus *status) {
+  msg_Data *buffer    = &status->in_buffer;
+  Header   *header    = (Header *)(buffer->bytes - header_len);
+  size_t    num_bytes = buffer->num_bytes * 2;
+  if (num_bytes > header->num_bytes) num_bytes = header->num_bytes;
+  if (!reserve_inbound_bytes(num_bytes - buffer->num_bytes)) return false;
+
+  // Buffers this large come from msg_new_data_space, so realloc is safe.
+  char *block = realloc(buffer->bytes - metadata_len, metadata_len + num_bytes);
+  if (block == NULL) {
+    num_inbound_bytes -= num_bytes - buffer->num_bytes;
+    return -1;
+  }
+  buffer->bytes     = block + metadata_len;
+  buffer->num_bytes = num_bytes;
+  return true;
+}
+
+// Hands off the buffer of a fully received message.
+static msg_Data take_conn_status_buffer(ConnStatus *status) {
+  msg_Data data         = status->in_buffer;
+  num_inbound_bytes    -= data.num_bytes;
+  status->in_buffer     = (msg_Data) { .num_bytes = 0, .bytes = NULL };
+  status->num_bytes_in  = 0;
+  return data;
 }
 
 static void delete_conn_status_buffer(ConnStatus *status) {
-  msg_delete_data(status->total_buffer);
-  status->total_buffer = status->waiting_buffer =
-      (msg_Data) { .num_bytes = 0, .bytes = NULL };
+  msg_delete_data(take_conn_status_buffer(status));
 }
 
-static void delete_conn_status(void *status_v_ptr, void *context) {
-  ConnStatus *status = (ConnStatus *)status_v_ptr;
+static void delete_shm_link(struct ShmLink *link);
+
+static ConnStatus *retain_conn_status(ConnStatus *status) {
+  if (status) atomic_add_int(&status->refcount, 1);
+  return status;
+}
+
+static void release_conn_status(ConnStatus *status) {
+  if (status == NULL || atomic_add_int(&status->refcount, -1) > 0) return;
   // This should be empty since we need to give the user a chance to free all
   // contexts.
-  assert(status->reply_contexts->count == 0);
-  map__delete(status->reply_contexts);
-  // TODO Should we delete the ConnStatus itself here?
-  // If yes, do it. Otherwise leave a comment explaining why not.
+  assert(status->pending_gets->count == 0);
+  map__delete(status->pending_gets);
+  if (status->in_buffer.bytes) delete_conn_status_buffer(status);
+  if (status->strand) delete_strand(status->strand);
+  // Callbacks may hold messages in the rings until this final release.
+  if (status->shm) delete_shm_link(status->shm);
+  dbgcheck__free(status, "ConnStatus");
+}
+
+// This is the value releaser for conn_status. The status itself is freed once
+// every pending callback and timeout referring to it is done with it.
+static void delete_conn_status(void *status_v_ptr, void *context) {
+  release_conn_status((ConnStatus *)status_v_ptr);
 }
 
 // This maps Address -> ConnStatus.
 // The actual keys & values are pointers to those types,
-// and the releasers free them.
-// TODO Once heartbeats is added, let heartbeats own the ConnStatus objects.
+// and the releasers free them. The out_beats rotation only refers to statuses
+// in this map; a status leaves both at once.
 static Map conn_status = NULL;
 
 // Returns NULL if the given remote address has no associated status.
@@ -599,41 +1030,344 @@ ConnStatus *status_of_conn(msg_Conn *conn) {
 
 
 ///////////////////////////////////////////////////////////////////////////////
-//  Timeout functionality.
+//  Timer functionality.
 
-#define udp_timeout_sec 1
+#define get_timeout_ns (1 * ns_per_sec)
+
+// This is the loop's cached monotonic time; it's refreshed at the start of
+// each msg_runloop call and again after polling, so everything done within a
+// single loop iteration sees the same timestamp. Calls made outside the loop
+// that set a due time refresh it too; see fresh_loop_now.
+static int64_t loop_now = 0;
+
+// With the virtual clock, time only moves forward in msg_advance_clock calls,
+// so that a simulation's timeouts and timers fire at the same points in every
+// run, however long its steps take.
+static int     is_clock_virtual = false;
+static int64_t virtual_now      = 0;
+
+static int64_t clock_now() {
+  return is_clock_virtual ? virtual_now : now();
+}
+
+static void update_loop_now() {
+  loop_now = clock_now();
+}
+
+// This is positive while msg_runloop runs; it may be nested in a callback.
+static int runloop_depth = 0;
+
+// Returns loop_now for a new due time. Outside of msg_runloop, loop_now is as
+// old as the last loop iteration, so it's brought up to date first.
+static int64_t fresh_loop_now() {
+  if (runloop_depth == 0) update_loop_now();
+  return loop_now;
+}
+
+typedef void (*TimerFn)(msg_Timer *timer);
+
+// Both app timers and msg_get timeouts are msg_Timer objects kept in a single
+// min-heap ordered by due time. The msg_get fields are unused by app timers.
+struct msg_Timer {
+  int64_t  at;
+  int64_t  interval;    // Zero for one-shot timers.
+  int      heap_index;  // -1 when the timer is not in the heap.
+  int      is_firing;   // True from removal from the heap until it's done.
+  int      is_canceled;
+  TimerFn  fire;
+
+  msg_TimerCallback callback;
+  void *            context;   // The reply_context for msg_get timeouts.
+  msg_TimerStats    stats;
 
-typedef struct {
-  double      at;
   msg_Conn *  conn;
   ConnStatus *status;
   uint16_t    reply_id;
-} Timeout;
+};
+
+static Array timer_heap = NULL;  // msg_Timer * items; soonest is at index 0.
+static Array due_timers = NULL;  // msg_Timer * items; fired by run_due_timers.
+
+static msg_Timer *heap_item(int index) {
+  return array__item_val(timer_heap, index, msg_Timer *);
+}
+
+static void heap_set(int index, msg_Timer *timer) {
+  array__item_val(timer_heap, index, msg_Timer *) = timer;
+  timer->heap_index = index;
+}
+
+static void heap_sift_up(int index) {
+  msg_Timer *timer = heap_item(index);
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (heap_item(parent)->at <= timer->at) break;
+    heap_set(index, heap_item(parent));
+    index = parent;
+  }
+  heap_set(index, timer);
+}
+
+static void heap_sift_down(int index) {
+  msg_Timer *timer = heap_item(index);
+  int count = timer_heap->count;
+  while (true) {
+    int child = 2 * index + 1;
+    if (child >= count) break;
+    if (child + 1 < count && heap_item(child + 1)->at < heap_item(child)->at) {
+      child++;
+    }
+    if (timer->at <= heap_item(child)->at) break;
+    heap_set(index, heap_item(child));
+    index = child;
+  }
+  heap_set(index, timer);
+}
+
+static void heap_push(msg_Timer *timer) {
+  array__new_val(timer_heap, msg_Timer *) = timer;
+  heap_sift_up(timer_heap->count - 1);
+}
+
+static void heap_remove(msg_Timer *timer) {
+  int index = timer->heap_index;
+  msg_Timer *last = heap_item(timer_heap->count - 1);
+  timer_heap->count--;
+  timer->heap_index = -1;
+  if (last == timer) return;
+  heap_set(index, last);
+  heap_sift_up(index);
+  heap_sift_down(last->heap_index);
+}
+
+// This doesn't touch the heap, so worker threads may call it.
+static msg_Timer *alloc_timer(int64_t at, int64_t interval, TimerFn fire) {
+  msg_Timer *timer  = dbgcheck__calloc(sizeof(msg_Timer), "msg_Timer");
+  timer->at         = at;
+  timer->interval   = interval;
+  timer->heap_index = -1;
+  timer->fire       = fire;
+  return timer;
+}
+
+static msg_Timer *new_timer(int64_t at, int64_t interval, TimerFn fire) {
+  msg_Timer *timer = alloc_timer(at, interval, fire);
+  heap_push(timer);
+  return timer;
+}
+
+static void delete_timer(msg_Timer *timer) {
+  release_conn_status(timer->status);
+  dbgcheck__free(timer, "msg_Timer");
+}
+
+// Timers being fired are freed by run_due_timers, and timers added by a worker
+// whose post hasn't run yet are freed by run_posts, so we only mark those.
+static void cancel_timer(msg_Timer *timer) {
+  if (timer->is_firing || timer->heap_index == -1) {
+    timer->is_canceled = true;
+    return;
+  }
+  heap_remove(timer);
+  delete_timer(timer);
+}
+
+// Returns the poll timeout to use given the caller's timeout, so that we
+// wake up in time for the next due timer.
+static int timer_poll_timeout(int timeout_in_ms) {
+  if (timer_heap->count == 0) return timeout_in_ms;
+  int64_t wait_ns = heap_item(0)->at - clock_now();
+  if (wait_ns <= 0) return 0;
+  // Waiting won't bring a virtual time any closer, and a caller's timeout of
+  // -1 could wait forever, so the loop doesn't wait while timers are pending.
+  if (is_clock_virtual) return 0;
+  // Round up so we don't wake up just before the timer is due.
+  int64_t wait_ms = (wait_ns + msg_ms - 1) / msg_ms;
+  if (timeout_in_ms == -1 || wait_ms < timeout_in_ms) return (int)wait_ms;
+  return timeout_in_ms;
+}
+
+static void update_timer_stats(msg_Timer *timer) {
+  msg_TimerStats *stats = &timer->stats;
+  int64_t lateness = loop_now - timer->at;
+  if (timer->interval && stats->num_fires) {
+    int64_t drift = (loop_now - stats->last_fired_at) - timer->interval;
+    if (drift < 0) drift = -drift;
+    if (drift > stats->max_drift) stats->max_drift = drift;
+  }
+  stats->num_fires++;
+  stats->last_fired_at   = loop_now;
+  stats->last_lateness   = lateness;
+  stats->total_lateness += lateness;
+  if (lateness > stats->max_lateness) stats->max_lateness = lateness;
+}
+
+// Fires every timer that's due as of loop_now. Timers added by the callbacks
+// are not fired until the next pass, even if they're already due.
+static void run_due_timers() {
+  if (timer_heap->count == 0 || heap_item(0)->at > loop_now) return;
+
+  array__clear(due_timers);
+  while (timer_heap->count && heap_item(0)->at <= loop_now) {
+    msg_Timer *timer = heap_item(0);
+    heap_remove(timer);
+    timer->is_firing = true;
+    array__new_val(due_timers, msg_Timer *) = timer;
+  }
+
+  array__for(msg_Timer **, timer_ptr, due_timers, i) {
+    msg_Timer *timer = *timer_ptr;
+    if (!timer->is_canceled) {
+      update_timer_stats(timer);
+      timer->fire(timer);
+    }
+    timer->is_firing = false;
+    if (timer->is_canceled || timer->interval == 0) {
+      delete_timer(timer);
+      continue;
+    }
 
-static Array timeouts = NULL;  // Items have type Timeout.
+    // Periodic timers stay on a fixed grid so that lateness doesn't
+    // accumulate; ticks we're too late for are skipped and counted.
+    timer->at += timer->interval;
+    if (timer->at <= loop_now) {
+      int64_t num_skipped = (loop_now - timer->at) / timer->interval + 1;
+      timer->at += num_skipped * timer->interval;
+      timer->stats.num_skipped += num_skipped;
+    }
+    heap_push(timer);
+  }
+}
 
-#define make_timeout(a, c, s, r) \
-    ((Timeout){ .at = a, .conn = c, .status = s, .reply_id = r })
+static void get_timed_out(msg_Timer *timer);
 
-static void add_timeout(msg_Conn *conn, ConnStatus *status, uint16_t reply_id) {
+static msg_Timer *add_timeout(msg_Conn *conn, ConnStatus *status,
+                              uint16_t reply_id, void *reply_context) {
   // This is called from msg_get, which takes responsibility for making sure
   // status exists.
-  double timeout_at = now() + udp_timeout_sec;
-  array__new_val(timeouts, Timeout) = make_timeout(timeout_at, conn,
-                                                   status, reply_id);
+  msg_Timer *timer = new_timer(fresh_loop_now() + get_timeout_ns, 0,
+                               get_timed_out);
+  timer->context   = reply_context;
+  timer->conn      = conn;
+  timer->status    = retain_conn_status(status);
+  timer->reply_id  = reply_id;
+  return timer;
 }
 
-// Remove the given timeout if it can be found.
-static void remove_timeout(ConnStatus *status, uint16_t reply_id) {
-  array__for(Timeout *, timeout, timeouts, i) {
-    if (timeout->status != status || timeout->reply_id != reply_id) continue;
-    // At this point, we've found the given timeout.
-    array__remove_item(timeouts, timeout);
-    break;
+static void fail_get(msg_Timer *timer, const char *msg);
+
+// Cancel all msg_get timeouts for the given status; used when its conn goes
+// away, as the timeouts refer to a msg_Conn that may be freed. Each pending
+// msg_get still gets a msg_error with its reply_context, as a timed out one
+// would, so that the app can release the context.
+static void remove_timeouts_of_status(ConnStatus *status) {
+  map__for(pair, status->pending_gets) {
+    msg_Timer *timer = (msg_Timer *)pair->value;
+    fail_get(timer, timer->conn->protocol_type == msg_udp ?
+                    "udp get ended by a disconnect" :
+                    "tcp get ended by a disconnect");
+    cancel_timer(timer);
+  }
+  map__clear(status->pending_gets);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Small message blocks.
+//
+// Inbound messages of up to small_data_len bytes, which are most messages in
+// practice, use fixed-size blocks that are recycled through a free list on the
+// run loop thread. Steady small-message traffic then makes no heap calls. Each
+// block is its own allocation, so a block released on a worker thread, or
+// beyond max_free_small_blocks, simply goes back to the heap.
+
+#define small_data_len        64
+#define max_free_small_blocks 1024
+
+typedef union SmallBlock {
+  union SmallBlock *next;  // Used while the block is on the free list.
+  char              bytes[metadata_len + small_data_len];
+} SmallBlock;
+
+static SmallBlock *free_small_blocks     = NULL;
+static int         num_free_small_blocks = 0;
+
+// This is called by the run loop thread as it reads messages.
+static msg_Data new_inbound_data(size_t num_bytes) {
+  if (num_bytes > small_data_len) return msg_new_data_space(num_bytes);
+
+  SmallBlock *block = free_small_blocks;
+  if (block) {
+    free_small_blocks = block->next;
+    num_free_small_blocks--;
+  } else {
+    block = dbgcheck__malloc(sizeof(SmallBlock), "msg_Data bytes");
+  }
+  Metadata *metadata      = (Metadata *)block->bytes;
+  metadata->reply_context = NULL;
+  metadata->alloc_kind    = alloc_kind_small_block;
+  return (msg_Data) { .num_bytes = num_bytes,
+                      .bytes     = block->bytes + metadata_len };
+}
+
+static void delete_small_block(SmallBlock *block) {
+  if (is_worker_thread || num_free_small_blocks == max_free_small_blocks) {
+    dbgcheck__free(block, "msg_Data bytes");
+    return;
   }
+  block->next       = free_small_blocks;
+  free_small_blocks = block;
+  num_free_small_blocks++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Transient data.
+//
+// Error strings, connection_ready placeholders, and the other buffers msgbox
+// makes for its own callbacks rarely outlive the run loop iteration that made
+// them. They're carved from a bump-pointer arena that msg_runloop rewinds at
+// its end once none of them are in use; if the arena is full, or a buffer is
+// needed by a worker thread, it comes from the heap instead.
+
+#define arena_size (16 * 1024)
+
+static union {
+  char  bytes[arena_size];
+  void *align;  // Keeps each Metadata in the arena aligned.
+} arena;
+
+static size_t arena_used     = 0;
+static int    arena_num_live = 0;  // Updated atomically; workers free buffers.
+
+static msg_Data new_transient_data(size_t num_bytes) {
+  size_t size = (metadata_len + num_bytes + sizeof(void *) - 1) &
+                ~(sizeof(void *) - 1);
+  if (is_worker_thread || arena_used + size > arena_size) {
+    return msg_new_data_space(num_bytes);
+  }
+  Metadata *metadata      = (Metadata *)(arena.bytes + arena_used);
+  metadata->reply_context = NULL;
+  metadata->alloc_kind    = alloc_kind_arena;
+  arena_used += size;
+  atomic_add_int(&arena_num_live, 1);
+  return (msg_Data) { .num_bytes = num_bytes,
+                      .bytes     = (char *)metadata + metadata_len };
+}
+
+static msg_Data new_transient_str(const char *str) {
+  msg_Data data = new_transient_data(strlen(str) + 1);
+  memcpy(data.bytes, str, data.num_bytes);
+  return data;
+}
+
+// This is called by the run loop thread at the end of each iteration.
+static void rewind_arena() {
+  if (atomic_add_int(&arena_num_live, 0) == 0) arena_used = 0;
 }
 
 
+
 ///////////////////////////////////////////////////////////////////////////////
 //  Debugging functions.
 
@@ -652,84 +1386,493 @@ int net_allocs_for_class(int class) { return net_allocs[class]; }
 
 
 ///////////////////////////////////////////////////////////////////////////////
-//  Internal functions.
+//  Local sockets.
+//
+// unix:// and unixgram:// addresses name unix domain sockets, which msgbox
+// treats as tcp and udp conns, with a protocol_type of msg_tcp or msg_udp, so
+// that they have the same events. A local peer has no ip or port, so its
+// Address holds an id in the ip's place, with a port of 0. The id indexes
+// local_addrs, which holds the peer's socket address for sendto and for
+// address strings. A named address keeps its id while it's in use; each
+// unnamed one, as for an accepted unix:// conn, gets a new id.
+//
+// Ids are reference counted. Each local conn holds one, on its own path for a
+// listening conn and on its peer otherwise, and each status of a local peer
+// holds one. An id that's unused at the end of a run loop iteration is freed,
+// so that callbacks can still print the address of a peer that just left.
+//
+// A shm://name address is a unix:// address at a path made from the name, with
+// is_shm set on its LocalAddr, as is that of each conn it accepts. Its messages
+// go through shared memory; see Shared-memory rings.
+//
+// A mem://name address has an id with is_mem set, though it has no socket;
+// see Memory conns. Each conn that connects to it gets a private copy of its
+// id, which local_id_of never returns, so that many clients in one process
+// have statuses of their own.
 
-static void set_sockaddr_for_conn(struct sockaddr_in *sockaddr,
-                                  msg_Conn *conn) {
-  memset(sockaddr, 0, sock_in_size);
-  sockaddr->sin_family = AF_INET;
-  sockaddr->sin_port = htons(conn->remote_port);
-  sockaddr->sin_addr.s_addr = conn->remote_ip;
-}
+#ifndef _WIN32
 
-// Returns -1 on error; 0 on success, similar to a system call.
-static int send_all(int socket, msg_Data data) {
-  data.bytes     -= header_len;
-  data.num_bytes += header_len;
+typedef struct {
+  struct sockaddr_un sockaddr;
+  socklen_t          len;  // An unnamed address has no path bytes.
+  int                refcount;
+  int                is_shm;
+  int                is_mem;    // A mem:// address has no socket.
+  msg_Conn *         listener;  // The conn listening on a mem:// address.
+} LocalAddr;
+
+#define path_offset offsetof(struct sockaddr_un, sun_path)
+
+// The socket path of a shm:// address is this prefix followed by its name.
+#ifdef __linux__
+#define shm_path_prefix "@msgbox.shm."
+#else
+#define shm_path_prefix "/tmp/msgbox.shm."
+#endif
 
-  while (data.num_bytes > 0) {
-    long just_sent = send(socket, data.bytes, data.num_bytes, send_flags);
-    if (just_sent == -1 && get_errno() == err_would_block) continue;
-    if (just_sent == -1) return -1;
-    data.bytes     += just_sent;
-    data.num_bytes -= just_sent;
+static Array local_addrs    = NULL;  // LocalAddr * items; NULL when free.
+static Array free_local_ids = NULL;  // uint32_t items.
+static Array unused_ids     = NULL;  // uint32_t ids to check for freeing.
+static Map   local_ids      = NULL;  // LocalAddr * -> id, for named addresses.
+
+static int local_addr_hash(void *local_addr_vp) {
+  LocalAddr *local_addr = (LocalAddr *)local_addr_vp;
+  int hash = 0;
+  for (socklen_t i = 0; i < local_addr->len - path_offset; ++i) {
+    hash *= 234;
+    hash += local_addr->sockaddr.sun_path[i];
   }
+  return hash;
+}
 
-  return 0;
+static int local_addr_eq(void *local_addr1_vp, void *local_addr2_vp) {
+  LocalAddr *local_addr1 = (LocalAddr *)local_addr1_vp;
+  LocalAddr *local_addr2 = (LocalAddr *)local_addr2_vp;
+  return local_addr1->len    == local_addr2->len    &&
+         local_addr1->is_mem == local_addr2->is_mem &&
+         memcmp(local_addr1->sockaddr.sun_path, local_addr2->sockaddr.sun_path,
+                local_addr1->len - path_offset) == 0;
 }
 
-// Returns no_error (NULL) on success;
-// returns the name of the failing system call on error,
-// and get_errno() returns the error code.
-static char *send_data(msg_Conn *conn, msg_Data data) {
-  if (conn->protocol_type == msg_tcp) {
-    return send_all(conn->socket, data) ? "send" : no_error;
-  }
+static LocalAddr *local_addr_of_id(uint32_t id) {
+  if (local_addrs == NULL || id == 0 || id > local_addrs->count) return NULL;
+  return array__item_val(local_addrs, id - 1, LocalAddr *);
+}
 
-  // At this point we expect protocol_type to be udp.
-  if (conn->for_listening) {
-    struct sockaddr_in sockaddr;
-    set_sockaddr_for_conn(&sockaddr, conn);
-    long bytes_sent = sendto(conn->socket,
-        data.bytes - header_len, data.num_bytes + header_len, send_flags,
-        (struct sockaddr *)&sockaddr, sock_in_size);
-    if (bytes_sent == -1) return "sendto";
-  } else {
-    long bytes_sent = send(conn->socket,
-        data.bytes - header_len, data.num_bytes + header_len, send_flags);
-    if (bytes_sent == -1) return "send";
-  }
-  return no_error;
+static void retain_local_id(uint32_t id) {
+  local_addr_of_id(id)->refcount++;
 }
 
-static void array__remove_last(Array array) {
-  array__remove_item(array, array__item_ptr(array, array->count - 1));
+static int is_shm_address(Address *address) {
+  LocalAddr *local_addr = local_addr_of_id(address->ip);
+  return is_local_address(address) && local_addr && local_addr->is_shm;
 }
 
-// This releases array[index], sets array[index] = array[count - 1], and
-// shortens the array by 1. Effectively, it quickly removes an element.
-static void array__remove_and_fill(Array array, int index) {
-  void *elt = array__item_ptr(array, index);
-  void *last_elt = array__item_ptr(array, array->count - 1);
-  if (array->releaser) array->releaser(elt, NULL);
-  if (elt != last_elt) memcpy(elt, last_elt, array->item_size);
-  array->count--;
+static void mark_shm_address(Address *address) {
+  local_addr_of_id(address->ip)->is_shm = true;
 }
 
-static msg_Conn *new_connection(void *conn_context, msg_Callback callback) {
-  msg_Conn *conn = dbgcheck__malloc(sizeof(msg_Conn), "msg_Conn");
-  memset(conn, 0, sizeof(msg_Conn));
-  conn->conn_context = conn_context;
-  conn->callback = callback;
-  return conn;
+static int is_mem_address(Address *address) {
+  LocalAddr *local_addr = local_addr_of_id(address->ip);
+  return is_local_address(address) && local_addr && local_addr->is_mem;
 }
 
-static void address_releaser(void *address_vp, void *context) {
-  dbgcheck__free(address_vp, "Address");
+static void release_local_id(uint32_t id) {
+  LocalAddr *local_addr = local_addr_of_id(id);
+  if (local_addr && --local_addr->refcount == 0) {
+    array__new_val(unused_ids, uint32_t) = id;
+  }
 }
 
-static void init_if_needed() {
-  static int init_done = false;
+// This is called by the run loop thread at the end of each iteration.
+static void free_unused_local_ids() {
+  if (unused_ids == NULL) return;
+  array__for(uint32_t *, id, unused_ids, i) {
+    LocalAddr *local_addr = local_addr_of_id(*id);
+    // The id may have been retained again, or freed already.
+    if (local_addr == NULL || local_addr->refcount) continue;
+    // A private id's path may be the key of another id.
+    map__key_value *pair = map__get(local_ids, local_addr);
+    if (pair && (uint32_t)(intptr_t)pair->value == *id) {
+      map__unset(local_ids, local_addr);
+    }
+    dbgcheck__free(local_addr, "LocalAddr");
+    array__item_val(local_addrs, *id - 1, LocalAddr *) = NULL;
+    array__new_val(free_local_ids, uint32_t) = *id;
+  }
+  array__clear(unused_ids);
+}
+
+static void init_local_ids_if_needed() {
+  if (local_addrs) return;
+  local_addrs    = array__new(16, sizeof(LocalAddr *));
+  free_local_ids = array__new(16, sizeof(uint32_t));
+  unused_ids     = array__new(16, sizeof(uint32_t));
+  local_ids      = map__new(local_addr_hash, local_addr_eq);
+}
+
+// Adds a copy of the given address under a new private id, which isn't found
+// by local_id_of. The id is unused until the caller retains it.
+static uint32_t new_local_id(LocalAddr *model) {
+  init_local_ids_if_needed();
+  LocalAddr *local_addr = dbgcheck__malloc(sizeof(LocalAddr), "LocalAddr");
+  *local_addr          = *model;
+  local_addr->refcount = 0;
+  local_addr->listener = NULL;
+  uint32_t id;
+  if (free_local_ids->count) {
+    id = array__item_val(free_local_ids, free_local_ids->count - 1, uint32_t);
+    free_local_ids->count--;
+  } else {
+    array__new_val(local_addrs, LocalAddr *) = NULL;
+    id = local_addrs->count;
+  }
+  array__item_val(local_addrs, id - 1, LocalAddr *) = local_addr;
+  array__new_val(unused_ids, uint32_t) = id;
+  return id;
+}
+
+// Returns the id of the given address, adding it if it's new. New ids are
+// unused until the caller retains them.
+static uint32_t local_id_of(struct sockaddr_un *sockaddr, socklen_t len,
+                            int is_mem) {
+  init_local_ids_if_needed();
+  // The os may count a path's terminating null in len; abstract names on
+  // linux start with a null, and have none at the end.
+  if (len > path_offset && sockaddr->sun_path[0]) {
+    len = path_offset + strnlen(sockaddr->sun_path, len - path_offset);
+  }
+  LocalAddr needle = { .len = len, .is_mem = is_mem };
+  memcpy(&needle.sockaddr, sockaddr, len);
+  if (len <= path_offset) return new_local_id(&needle);
+
+  map__key_value *pair = map__get(local_ids, &needle);
+  if (pair) return (uint32_t)(intptr_t)pair->value;
+  uint32_t id = new_local_id(&needle);
+  map__set(local_ids, local_addr_of_id(id), (void *)(intptr_t)id);
+  return id;
+}
+
+// Returns the path of a local address, with a leading @ for an abstract name.
+static char *local_path_str(Address *address) {
+  static char path_str[sizeof(((struct sockaddr_un *)0)->sun_path) + 1];
+  LocalAddr *local_addr = local_addr_of_id(address->ip);
+  if (local_addr == NULL || local_addr->len <= path_offset) return "";
+  size_t path_len = local_addr->len - path_offset;
+  memcpy(path_str, local_addr->sockaddr.sun_path, path_len);
+  path_str[path_len] = '\0';
+  if (path_str[0] == '\0') path_str[0] = '@';
+  return path_str;
+}
+
+static char *local_address_str(Address *address) {
+  static char address_str[160];
+  char *scheme = address->protocol_type == msg_udp ? "unixgram" : "unix";
+  char *path   = local_path_str(address);
+  if (is_shm_address(address)) {
+    scheme = "shm";
+    if (*path) path += strlen(shm_path_prefix);
+  }
+  if (is_mem_address(address)) scheme = "mem";
+  snprintf(address_str, 160, "%s://%s", scheme, *path ? path : "(unnamed)");
+  return address_str;
+}
+
+// Returns no_error (NULL) on success, and sets the protocol_type, remote_ip,
+// and remote_port of the given conn. Returns an error string on error.
+static const char *parse_local_address(const char *address, msg_Conn *conn) {
+  static char err_msg[1024];
+  const char *path;
+  char shm_path[sizeof(((struct sockaddr_un *)0)->sun_path) + 1];
+  int is_shm = false, is_mem = false;
+  if (strncmp(address, "unix://", 7) == 0) {
+    conn->protocol_type = SOCK_STREAM;
+    path = address + 7;
+  } else if (strncmp(address, "unixgram://", 11) == 0) {
+    conn->protocol_type = SOCK_DGRAM;
+    path = address + 11;
+  } else if (strncmp(address, "shm://", 6) == 0) {
+    if (address[6] == '\0' || strchr(address + 6, '/')) {
+      snprintf(err_msg, 1024, "Failing due to bad shm name in address '%s'",
+               address);
+      return err_msg;
+    }
+    conn->protocol_type = SOCK_STREAM;
+    snprintf(shm_path, sizeof(shm_path), shm_path_prefix "%s", address + 6);
+    path   = shm_path;
+    is_shm = true;
+  } else if (strncmp(address, "mem://", 6) == 0) {
+    conn->protocol_type = SOCK_STREAM;
+    path   = address + 6;
+    is_mem = true;
+  } else {
+    snprintf(err_msg, 1024, "Failing due to unrecognized prefix: %s", address);
+    return err_msg;
+  }
+
+  struct sockaddr_un sockaddr;
+  size_t path_len = strlen(path);
+  if (path_len < 1 || path_len >= sizeof(sockaddr.sun_path)) {
+    snprintf(err_msg, 1024,
+             "Failing because path length=%zu; expected to be 1-%zu (in "
+             "address '%s')", path_len, sizeof(sockaddr.sun_path) - 1, address);
+    return err_msg;
+  }
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sun_family = AF_UNIX;
+  memcpy(sockaddr.sun_path, path, path_len);
+  // A leading @ names a linux abstract socket, which has no file.
+  if (path[0] == '@' && !is_mem) sockaddr.sun_path[0] = '\0';
+
+  conn->remote_ip   = local_id_of(&sockaddr, path_offset + path_len, is_mem);
+  conn->remote_port = 0;
+  if (is_shm) mark_shm_address(address_of_conn(conn));
+  return no_error;
+}
+
+// Binds the socket of a unixgram:// conn that connects, so that its peer can
+// reply. Returns -1 on error; 0 on success, similar to a system call.
+static int bind_local_client(int sock) {
+  struct sockaddr_un sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sun_family = AF_UNIX;
+#ifdef __linux__
+  // Binding with no path picks an unused abstract name.
+  return bind(sock, (struct sockaddr *)&sockaddr, sizeof(sa_family_t));
+#else
+  static int num_bound = 0;
+  snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "/tmp/msgbox.%d.%d",
+           getpid(), num_bound++);
+  unlink(sockaddr.sun_path);
+  return bind(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+#endif
+}
+
+// Releases the id of the path a local socket is bound to, and removes the
+// socket's file, if it has one. This is for listening conns, and for unixgram
+// conns that connect, which are bound by bind_local_client. Returns true iff
+// sock is a unix domain socket.
+static int unbind_local_socket(int sock) {
+  struct sockaddr_storage sockaddr;
+  socklen_t len = sizeof(sockaddr);
+  if (getsockname(sock, (struct sockaddr *)&sockaddr, &len) == -1) {
+    return false;
+  }
+  if (sockaddr.ss_family != AF_UNIX) return false;
+  if (len <= path_offset) return true;
+  struct sockaddr_un *local = (struct sockaddr_un *)&sockaddr;
+  if (local_ids) {
+    map__key_value *pair = map__get(local_ids, &(LocalAddr) {
+      .sockaddr = *local, .len = path_offset + (local->sun_path[0] ?
+          strnlen(local->sun_path, len - path_offset) : len - path_offset) });
+    if (pair) release_local_id((uint32_t)(intptr_t)pair->value);
+  }
+  if (local->sun_path[0]) unlink(local->sun_path);
+  return true;
+}
+
+// Removes a stale socket file at the path of a unix:// or unixgram:// address
+// about to be bound, for easier server restarts. Other files are left alone.
+static void remove_stale_socket(Address *address) {
+  LocalAddr *local_addr = local_addr_of_id(address->ip);
+  if (local_addr->sockaddr.sun_path[0] == '\0') return;
+  struct stat file_stat;
+  if (stat(local_addr->sockaddr.sun_path, &file_stat) == 0 &&
+      S_ISSOCK(file_stat.st_mode)) {
+    unlink(local_addr->sockaddr.sun_path);
+  }
+}
+
+#else
+
+// windows versions; windows has no unix domain sockets here.
+
+static void retain_local_id (uint32_t id) {}
+static void release_local_id(uint32_t id) {}
+static void free_unused_local_ids() {}
+
+static int  is_shm_address  (Address *address) { return false; }
+static void mark_shm_address(Address *address) {}
+static int  is_mem_address  (Address *address) { return false; }
+
+static char *local_path_str   (Address *address) { return ""; }
+static char *local_address_str(Address *address) { return ""; }
+
+static const char *parse_local_address(const char *address, msg_Conn *conn) {
+  static char err_msg[1024];
+  snprintf(err_msg, 1024, "Local addresses aren't supported on windows: %s",
+           address);
+  return err_msg;
+}
+
+static int  bind_local_client  (int sock)         { return 0; }
+static int  unbind_local_socket(int sock)         { return false; }
+static void remove_stale_socket(Address *address) {}
+
+#endif
+
+// Returns the size of the socket address written to sockaddr.
+static socklen_t sockaddr_of_address(Address *address,
+                                     struct sockaddr_storage *sockaddr) {
+  memset(sockaddr, 0, sizeof(*sockaddr));
+#ifndef _WIN32
+  if (is_local_address(address)) {
+    LocalAddr *local_addr = local_addr_of_id(address->ip);
+    // A freed id leaves an unnamed address, which sends will refuse.
+    sockaddr->ss_family = AF_UNIX;
+    if (local_addr == NULL) return path_offset;
+    memcpy(sockaddr, &local_addr->sockaddr, local_addr->len);
+    return local_addr->len;
+  }
+#endif
+  struct sockaddr_in *inet_addr = (struct sockaddr_in *)sockaddr;
+  inet_addr->sin_family      = AF_INET;
+  inet_addr->sin_port        = htons(address->port);
+  inet_addr->sin_addr.s_addr = address->ip;
+  return sock_in_size;
+}
+
+// Sets the conn's remote address from a socket address given by the os.
+static void set_remote_address(msg_Conn *conn,
+                               struct sockaddr_storage *sockaddr,
+                               socklen_t len) {
+#ifndef _WIN32
+  if (sockaddr->ss_family == AF_UNIX) {
+    conn->remote_ip   = local_id_of((struct sockaddr_un *)sockaddr, len,
+                                    false);
+    conn->remote_port = 0;
+    return;
+  }
+#endif
+  struct sockaddr_in *inet_addr = (struct sockaddr_in *)sockaddr;
+  conn->remote_ip   = inet_addr->sin_addr.s_addr;
+  conn->remote_port = ntohs(inet_addr->sin_port);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Internal functions.
+
+// Returns -1 on error; 0 on success, similar to a system call.
+static int send_all(int socket, msg_Data data) {
+  data.bytes     -= header_len;
+  data.num_bytes += header_len;
+
+  while (data.num_bytes > 0) {
+    long just_sent = send(socket, data.bytes, data.num_bytes, send_flags);
+    if (just_sent == -1 && get_errno() == err_would_block) continue;
+    if (just_sent == -1) return -1;
+    data.bytes     += just_sent;
+    data.num_bytes -= just_sent;
+  }
+
+  return 0;
+}
+
+// Sends a single udp datagram to the conn's remote address.
+// Returns values as send_data does.
+static size_t max_send_rate;
+static int    pace_datagram(msg_Conn *conn, char *bytes, size_t num_bytes);
+static int    is_impairment_used;
+static int    impair_datagram(msg_Conn *conn, char *bytes, size_t num_bytes);
+
+static char *send_datagram_to_socket(msg_Conn *conn, char *bytes,
+                                     size_t num_bytes) {
+  long  bytes_sent;
+  char *sys_call_name;
+  if (conn->for_listening) {
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sockaddr_of_address(address_of_conn(conn), &sockaddr);
+    bytes_sent    = sendto(conn->socket, bytes, num_bytes, send_flags,
+                           (struct sockaddr *)&sockaddr, len);
+    sys_call_name = "sendto";
+  } else {
+    bytes_sent    = send(conn->socket, bytes, num_bytes, send_flags);
+    sys_call_name = "send";
+  }
+  if (bytes_sent != -1) return no_error;
+  // A unixgram peer with a full receive queue refuses a datagram that udp
+  // would drop, so it's dropped here instead.
+  if (get_errno() == err_would_block &&
+      is_local_address(address_of_conn(conn))) {
+    return no_error;
+  }
+  return sys_call_name;
+}
+
+// This is where fault injection sees each datagram; see Fault injection.
+static char *send_datagram_now(msg_Conn *conn, char *bytes,
+                               size_t num_bytes) {
+  if (is_impairment_used && impair_datagram(conn, bytes, num_bytes)) {
+    return no_error;
+  }
+  return send_datagram_to_socket(conn, bytes, num_bytes);
+}
+
+static char *send_datagram(msg_Conn *conn, char *bytes, size_t num_bytes) {
+  if (max_send_rate && pace_datagram(conn, bytes, num_bytes)) return no_error;
+  return send_datagram_now(conn, bytes, num_bytes);
+}
+
+static size_t max_datagram_len;
+static size_t datagram_len_of(msg_Conn *conn);
+static char  *send_fragments(msg_Conn *conn, msg_Data data);
+static char  *send_tcp      (msg_Conn *conn, msg_Data data);
+static int    pack_message  (msg_Conn *conn, msg_Data data);
+
+static int is_packing_used = false;  // Set when a udp conn first coalesces.
+static int peer_can(ConnStatus *status, uint32_t capability);
+
+// Returns no_error (NULL) on success;
+// returns the name of the failing system call on error,
+// and get_errno() returns the error code.
+static char *send_data(msg_Conn *conn, msg_Data data) {
+  if (conn->protocol_type == msg_tcp) return send_tcp(conn, data);
+
+  // At this point we expect protocol_type to be udp.
+  if (is_packing_used && pack_message(conn, data)) return no_error;
+  if (data.num_bytes + header_len > datagram_len_of(conn)) {
+    ConnStatus *status = status_of_conn(conn);
+    if (status && !peer_can(status, msg_cap_fragments)) {
+      set_errno(EMSGSIZE);
+      return "send";
+    }
+    return send_fragments(conn, data);
+  }
+  return send_datagram(conn, data.bytes - header_len,
+                       data.num_bytes + header_len);
+}
+
+static void array__remove_last(Array array) {
+  array__remove_item(array, array__item_ptr(array, array->count - 1));
+}
+
+// This releases array[index], sets array[index] = array[count - 1], and
+// shortens the array by 1. Effectively, it quickly removes an element.
+static void array__remove_and_fill(Array array, int index) {
+  void *elt = array__item_ptr(array, index);
+  void *last_elt = array__item_ptr(array, array->count - 1);
+  if (array->releaser) array->releaser(elt, NULL);
+  if (elt != last_elt) memcpy(elt, last_elt, array->item_size);
+  array->count--;
+}
+
+static msg_Conn *new_connection(void *conn_context, msg_Callback callback) {
+  msg_Conn *conn = dbgcheck__malloc(sizeof(msg_Conn), "msg_Conn");
+  memset(conn, 0, sizeof(msg_Conn));
+  conn->conn_context = conn_context;
+  conn->callback = callback;
+  return conn;
+}
+
+static void address_releaser(void *address_vp, void *context) {
+  dbgcheck__free(address_vp, "Address");
+}
+
+static void open_wakeup_conn();
+
+static void init_if_needed() {
+  static int init_done = false;
   if (init_done) return;
 
   library_init;
@@ -737,13 +1880,17 @@ static void init_if_needed() {
   immediate_callbacks = array__new(16, sizeof(PendingCall));
   conns    = array__new(8, sizeof(msg_Conn *));
   removals = array__new(8, sizeof(int));
-  timeouts = array__new(8, sizeof(Timeout));
+  timer_heap = array__new(8, sizeof(msg_Timer *));
+  due_timers = array__new(8, sizeof(msg_Timer *));
   init_poll_fds();
+  open_wakeup_conn();
 
   conn_status = map__new(address_hash, address_eq);
   conn_status->key_releaser   = address_releaser;
   conn_status->value_releaser = delete_conn_status;
 
+  update_loop_now();
+
   init_done = true;
 }
 
@@ -751,6 +1898,7 @@ static void send_callback(msg_Conn *conn, msg_Event event, msg_Data data,
                           void *to_free, const char *set_name) {
   PendingCall pending_callback = {
     .conn = conn,
+    .status = NULL,
     .event = event,
     .data = { data.num_bytes, data.bytes },
     .to_free = to_free,
@@ -758,9 +1906,22 @@ static void send_callback(msg_Conn *conn, msg_Event event, msg_Data data,
   array__add_item_val(immediate_callbacks, pending_callback);
 }
 
+// This is send_callback for events associated with a known remote peer.
+// The call keeps a reference to status until it's made.
+static void send_status_callback(msg_Conn *conn, ConnStatus *status,
+                                 msg_Event event, msg_Data data,
+                                 void *to_free, const char *set_name) {
+  send_callback(conn, event, data, to_free, set_name);
+  PendingCall *call = array__item_ptr(immediate_callbacks,
+                                      immediate_callbacks->count - 1);
+  call->status = retain_conn_status(status);
+}
+
+static msg_Data new_transient_str(const char *str);
+
 static void send_callback_error(msg_Conn *conn, const char *msg,
                                 void *to_free, const char *set_name) {
-  send_callback(conn, msg_error, msg_new_data(msg), to_free, set_name);
+  send_callback(conn, msg_error, new_transient_str(msg), to_free, set_name);
 }
 
 static void send_callback_os_error(msg_Conn *conn, const char *msg,
@@ -770,43 +1931,75 @@ static void send_callback_os_error(msg_Conn *conn, const char *msg,
   send_callback_error(conn, err_msg, to_free, set_name);
 }
 
+static int  is_ring_data       (ConnStatus *status, msg_Data data);
+static void release_ring_record(Metadata *metadata);
+
+// Deletes a message received from the peer with the given status. A message
+// delivered in place from a shm:// ring only has its record marked done.
+static void delete_inbound_data(ConnStatus *status, msg_Data data) {
+  if (is_ring_data(status, data)) {
+    return release_ring_record((Metadata *)(data.bytes - metadata_len));
+  }
+  msg_delete_data(data);
+}
+
 static void make_call(PendingCall *call) {
   msg_Conn *   conn   = call->conn;
-  ConnStatus * status = NULL;  // We'll set this if needed in the udp case.
+  ConnStatus * status = call->status;  // Only used in the udp case.
 
   char *addr_str = "<uninitialized address>";
 
-  // Copy metadata from msg_Data/status to msg_Conn for udp messages.
-  if (conn->protocol_type == msg_udp && call->data.bytes) {
-    msg_Data data          = call->data;
-    Metadata *metadata     = (Metadata *)(data.bytes - metadata_len);
-    conn->reply_context    = metadata->reply_context;
-    *address_of_conn(conn) = metadata->remote_address;
-    status                 = status_of_conn(conn);
+  // Copy metadata from msg_Data/status to msg_Conn. Several messages may be
+  // read before any are handled, so we can't rely on values set in the conn
+  // while reading.
+  if (call->data.bytes) {
+    Metadata *metadata  = (Metadata *)(call->data.bytes - metadata_len);
+    conn->reply_context = metadata->reply_context;
+  }
+  if (conn->protocol_type == msg_udp && status) {
+    *address_of_conn(conn) = status->remote_address;
+  }
+
+  // Several requests may be read before any of them are handled, so each
+  // request's reply_id is restored from its header.
+  conn->reply_id = 0;
+  if (call->event == msg_request) {
+    Metadata *metadata = (Metadata *)(call->data.bytes - metadata_len);
+    conn->reply_id     = metadata->header.reply_id;
+  }
+
+  // A listening udp conn is shared by many peers, and a conn seen by a worker
+  // thread is a copy, so in those cases the peer's status holds the
+  // conn_context.
+  int context_is_in_status = status && (conn->protocol_type == msg_udp ||
+                                        is_worker_thread);
 
+  if (conn->protocol_type == msg_udp && (status || call->data.bytes)) {
     if (verbosity >= 3) {
-      addr_str = address_as_str(&metadata->remote_address);
+      addr_str = address_as_str(address_of_conn(conn));
     }
 
     // Unless this is a msg_error, we expect a udp callback to have a status.
     assert(call->event == msg_error || status);
-    if (status) {
-      if (verbosity >= 3) {
-        printf("<pid %d> restoring conn_context=%p for address %s "
-               "(status=%p)\n",
-               getpid(), status->conn_context, addr_str, status);
-      }
-      conn->conn_context = status->conn_context;
-    } else if (verbosity >= 3) {
+    if (status == NULL && verbosity >= 3) {
       printf("<pid %d> no status to restore conn_context from; address=%s\n",
           getpid(), addr_str);
     }
   }
+  if (context_is_in_status) {
+    if (verbosity >= 3) {
+      printf("<pid %d> restoring conn_context=%p for address %s "
+             "(status=%p)\n",
+             getpid(), status->conn_context, addr_str, status);
+    }
+    conn->conn_context = status->conn_context;
+  }
 
   conn->callback(conn, call->event, call->data);
 
-  // Save the user's conn_context in case they changed it.
-  if (conn->protocol_type == msg_udp && status) {
+  // Save the user's conn_context in case they changed it. A tcp conn keeps its
+  // status up to date so that workers may be started at any time.
+  if (status) {
     status->conn_context = conn->conn_context;
     if (verbosity >= 3) {
       printf("<pid %d> saving conn_context=%p for address %s (status=%p)\n",
@@ -814,8 +2007,38 @@ static void make_call(PendingCall *call) {
     }
   }
 
-  if (call->data.bytes) msg_delete_data(call->data);
+  if (call->data.bytes) delete_inbound_data(status, call->data);
   if (call->to_free) dbgcheck__free(call->to_free, call->set_name);
+  release_conn_status(status);
+}
+
+// Sends a msg_error with the given message and the reply_context of the
+// msg_get whose timeout is timer.
+static void fail_get(msg_Timer *timer, const char *msg) {
+  ConnStatus *status = timer->status;
+  msg_Conn *  conn   = timer->conn;
+  conn->reply_context = timer->context;
+
+  // Set up metadata as it overrides data in conn within make_call.
+  msg_Data data = new_transient_str(msg);
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  metadata->reply_context = conn->reply_context;
+
+  send_status_callback(conn, status, msg_error, data,
+                       free_nothing, no_set_name);
+}
+
+// This is the fire function for msg_get timeouts.
+static void get_timed_out(msg_Timer *timer) {
+  // Remove the pending status information and inform the user of the timeout.
+  map__unset(timer->status->pending_gets, (void *)(intptr_t)timer->reply_id);
+  fail_get(timer, timer->conn->protocol_type == msg_tcp ? "tcp get timed out" :
+                                                          "udp get timed out");
+}
+
+// This is the fire function for timers added with msg_add_timer.
+static void app_timer_fired(msg_Timer *timer) {
+  timer->callback(timer, timer->context);
 }
 
 // Returns no_error (NULL) on success, and sets the protocol_type,
@@ -828,6 +2051,13 @@ static const char *parse_address_str(const char *address, msg_Conn *conn) {
   // TODO once v1 functionality is done, see if I can
   // encapsulate the error pattern into a one-liner; eg with a macro.
 
+  // unix://, unixgram://, shm://, and mem:// addresses hold a path rather than
+  // an ip and port.
+  if (strncmp(address, "unix", 4) == 0 || strncmp(address, "shm://", 6) == 0 ||
+      strncmp(address, "mem://", 6) == 0) {
+    return parse_local_address(address, conn);
+  }
+
   // Parse the protocol type; either tcp or udp.
   const char *tcp_prefix = "tcp://";
   const char *udp_prefix = "udp://";
@@ -915,30 +2145,86 @@ static void remove_conn_at(int index) {
   remove_from_poll_fds(index);
 }
 
+static void join_out_beats (ConnStatus *status, msg_Conn *conn);
+static void leave_out_beats(ConnStatus *status);
+
+// Drops the given peer from conn_status and the out_beats rotation.
+// The caller must own a reference to status if it's still needed.
+static void end_reassembly(ConnStatus *status);
+static void end_reliable  (ConnStatus *status);
+static void end_pacer     (ConnStatus *status);
+static void end_impairment(ConnStatus *status);
+static void end_outbound  (ConnStatus *status);
+static void end_shm       (ConnStatus *status);
+static void end_mem       (ConnStatus *status);
+
+static void drop_status(ConnStatus *status) {
+  // Free any partial message now, as the final release may be on a worker.
+  end_reassembly(status);
+  end_reliable(status);
+  end_pacer(status);
+  end_impairment(status);
+  end_outbound(status);
+  end_shm(status);
+  end_mem(status);
+  remove_timeouts_of_status(status);
+  leave_out_beats(status);
+  if (is_local_address(&status->remote_address)) {
+    release_local_id(status->remote_address.ip);
+  }
+  map__unset(conn_status, &status->remote_address);
+}
+
+// Drops every peer reached through conn, which is a udp conn about to be
+// closed. This scans conn_status, so it costs O(peers), but only when a udp
+// socket is closed.
+static void drop_statuses_of_conn(msg_Conn *conn) {
+  Array dropped = array__new(8, sizeof(ConnStatus *));
+  map__for(pair, conn_status) {
+    ConnStatus *status = (ConnStatus *)pair->value;
+    if (status->conn == conn) array__new_val(dropped, ConnStatus *) = status;
+  }
+  array__for(ConnStatus **, status, dropped, i) drop_status(*status);
+  array__delete(dropped);
+}
+
 // Drops the conn from conn_status and sends the given event, which
 // should be one of msg_connection_{closed,lost}.
 static void local_disconnect(msg_Conn *conn, msg_Event event) {
-  Address *address = (Address *)(&conn->remote_ip);
-  map__unset(conn_status, address);
+  ConnStatus *status = status_of_conn(conn);
+  if (status) {
+    // The callback below keeps status alive after we drop it here.
+    retain_conn_status(status);
+    drop_status(status);
+  }
 
   // A listening udp conn is a special case as it lives until an unlisten call.
   int is_listening_udp = (conn->for_listening &&
                           conn->protocol_type == msg_udp);
 
+  // No other peer may keep a pointer to a closed udp conn.
+  if (conn->protocol_type == msg_udp && !is_listening_udp) {
+    drop_statuses_of_conn(conn);
+  }
+
   void *to_free = is_listening_udp ? NULL : conn;
   const char *set_name = is_listening_udp ? NULL : "msg_Conn";
-  send_callback(conn, event, msg_no_data, to_free, set_name);
+  send_status_callback(conn, status, event, msg_no_data, to_free, set_name);
+  release_conn_status(status);
 
   if (is_listening_udp) return;
 
+  if (is_local_address(address_of_conn(conn))) {
+    release_local_id(conn->remote_ip);
+    if (conn->protocol_type == msg_udp) unbind_local_socket(conn->socket);
+  }
+  if (conn->socket == -1) return;  // A mem:// conn has no socket.
   closesocket(conn->socket);
   array__add_item_val(removals, conn->index);
 }
 
-// Reads the header of a message.
-// For udp packets, the next recv will still include the header.
-// For tcp packets, the next recv will be just after the header.
-// Returns true on success; false on failure.
+// Reads the header of a tcp message; the next recv will be just after the
+// header. Returns true on success; false on failure.
 static int read_header(int sock, msg_Conn *conn, Header *header) {
   // A (char *) header pointer works for all versions of recv, which take
   // either char * or void *.
@@ -954,19 +2240,15 @@ static int read_header(int sock, msg_Conn *conn, Header *header) {
     return false;
   }
   
-  // We ignore err_win_msg_size; it only tells us that we didn't get the full
-  // udp message.
-  if (bytes_recvd == -1 && get_errno() != err_win_msg_size) {
+  if (bytes_recvd == -1) {
     if (get_errno() == err_would_block) return false;
     send_callback_os_error(conn, "recv", free_nothing, no_set_name);
     return false;
   }
   
-  // Mark the header as read in the tcp case.
-  if (conn->protocol_type == msg_tcp) {
-    int default_options = 0;
-    recv(sock, (char *)header, header_len, default_options);
-  }
+  // Mark the header as read.
+  int default_options = 0;
+  recv(sock, (char *)header, header_len, default_options);
 
   // Convert each field from network to host byte ordering.
   header->message_type = ntohs(header->message_type);
@@ -986,7 +2268,14 @@ static int read_header(int sock, msg_Conn *conn, Header *header) {
       "msg_type_request",
       "msg_type_reply",
       "msg_type_heartbeat",
-      "msg_type_close"
+      "msg_type_close",
+      "msg_type_fragment",
+      "msg_type_reliable",
+      "msg_type_ack",
+      "msg_type_packed",
+      "msg_type_shm_setup",
+      "msg_type_doorbell",
+      "msg_type_hello"
     };
     printf("pid %d: Read in a header: type=%s #bytes=%d\n",
            getpid(),
@@ -997,6 +2286,13 @@ static int read_header(int sock, msg_Conn *conn, Header *header) {
   return true;
 }
 
+static void start_shm     (msg_Conn *conn, ConnStatus *status);
+static int  read_shm_setup(msg_Conn *conn, ConnStatus *status);
+static int  drain_shm     (msg_Conn *conn, ConnStatus *status);
+static void push_shm_queue(msg_Conn *conn, ConnStatus *status);
+static void start_default_impairment(ConnStatus *status);
+static void start_handshake(msg_Conn *conn, ConnStatus *status);
+
 // This creates a new ConnStatus struct if none exists for the remote address.
 static ConnStatus *remote_address_seen(msg_Conn *conn) {
 
@@ -1004,7 +2300,7 @@ static ConnStatus *remote_address_seen(msg_Conn *conn) {
 
   if (status == NULL) {
     // It's a new remote address; set up a new owned Address.
-    status = new_conn_status(0.0, address_of_conn(conn));  // TODO set to now.
+    status = new_conn_status(loop_now, address_of_conn(conn));
 
     status->conn_context = conn->conn_context;
 
@@ -1012,42 +2308,229 @@ static ConnStatus *remote_address_seen(msg_Conn *conn) {
     *address = *address_of_conn(conn);
 
     map__set(conn_status, address, status);
+    if (is_local_address(address)) retain_local_id(address->ip);
+    if (is_shm_address(address)) start_shm(conn, status);
 
-    // Send in the correct remote address with the callback.
-    msg_Data data = msg_new_data_space(0);
-    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->remote_address = *address;
+    if (conn->protocol_type == msg_udp) {
+      join_out_beats(status, conn);
+      start_default_impairment(status);
+    }
 
-    send_callback(conn, msg_connection_ready, data, free_nothing, no_set_name);
+    // The status sends in the correct remote address with the callback.
+    msg_Data data = new_transient_data(0);
+    send_status_callback(conn, status, msg_connection_ready, data,
+                         free_nothing, no_set_name);
+    start_handshake(conn, status);
   }
 
-  // TODO Update the timing data for this remote address.
+  status->last_seen_at = loop_now;
 
   return status;
 }
 
-// Returns true when the entire message is received;
+// Receives bytes into status->in_buffer until it holds num_bytes of them.
+// Returns true when the buffer holds num_bytes bytes;
 // returns false when more data remains but no error occurred;
 // returns -1 when there was an error - the caller must respond to it;
-// returns -2 when a message was interrupted by a connection close.
-static int continue_recv(msg_Conn *conn, ConnStatus *status) {
+// returns -2 when a message was interrupted by a connection close;
+// returns -3 when inbound_limit leaves no room for the rest of the message;
+// returns -4 when there's no memory for the rest of the message.
+static int continue_recv(msg_Conn *conn, ConnStatus *status, size_t num_bytes) {
   int sock = conn->socket;
-  msg_Data *buffer = &status->waiting_buffer;
+  msg_Data *buffer = &status->in_buffer;
+  // A recv of 0 bytes would look like a close, so skip it for empty bodies.
+  while (status->num_bytes_in < num_bytes) {
+    if (status->num_bytes_in == buffer->num_bytes) {
+      int is_grown = grow_conn_status_buffer(status);
+      if (is_grown == false) return -3;
+      if (is_grown == -1)    return -4;
+    }
+    int default_options = 0;
+    long bytes_in = recv(sock, buffer->bytes + status->num_bytes_in,
+                         buffer->num_bytes - status->num_bytes_in,
+                         default_options);
+    if (bytes_in == 0 || (bytes_in == -1 && get_errno() == err_conn_reset)) {
+      local_disconnect(conn, msg_connection_lost);
+      return -2;
+    }
+    if (bytes_in == -1) {
+      // More data is pending.
+      if (get_errno() == err_would_block) return false;
+      // This is an error we must report; treat the current data as lost.
+      return -1;
+    }
+    status->num_bytes_in += bytes_in;
+  }
+  return true;
+}
+
+// Streamed messages are received into buffers of at most this many bytes.
+#define stream_chunk_len (64 * 1024)
+
+// Sets up the buffer for the chunk of a streamed message starting at offset.
+// Returns false if inbound_limit leaves no room for it.
+static int new_chunk_buffer(ConnStatus *status, Header *header, size_t offset) {
+  size_t num_bytes = header->num_bytes - offset;
+  if (num_bytes > stream_chunk_len) num_bytes = stream_chunk_len;
+  if (!reserve_inbound_bytes(num_bytes)) return false;
+  status->in_buffer    = new_inbound_data(num_bytes);
+  status->num_bytes_in = 0;
+  status->is_chunking  = true;
+  Metadata *metadata     = (Metadata *)(status->in_buffer.bytes - metadata_len);
+  metadata->header       = *header;
+  metadata->chunk_offset = (uint32_t)offset;
+  return true;
+}
+
+// Receives more of a streamed message, sending each run of received bytes to
+// the callback as a msg_message_chunk event, so that the whole message is
+// never held at once. Returns values as continue_recv does, except that true
+// means that the entire message was received and sent on.
+static int continue_stream(msg_Conn *conn, ConnStatus *status) {
+  while (true) {
+    int ret_val = continue_recv(conn, status, status->in_buffer.num_bytes);
+    if (ret_val < 0) return ret_val;
+    if (ret_val == false && status->num_bytes_in == 0) return false;
+
+    size_t   num_bytes = status->num_bytes_in;
+    msg_Data chunk     = take_conn_status_buffer(status);
+    chunk.num_bytes    = num_bytes;
+
+    Metadata *metadata      = (Metadata *)(chunk.bytes - metadata_len);
+    Header    header        = metadata->header;
+    size_t    next_offset   = metadata->chunk_offset + num_bytes;
+    metadata->reply_context = NULL;
+
+    status->last_active_at = loop_now;
+    conn->reply_id         = 0;
+    conn->reply_context    = NULL;
+    send_status_callback(conn, status, msg_message_chunk, chunk,
+                         free_nothing, no_set_name);
+
+    if (next_offset == header.num_bytes) return true;
+    if (!new_chunk_buffer(status, &header, next_offset)) return -3;
+    if (ret_val == false) return false;
+  }
+}
+
+// Reports an inbound message that msgbox won't hold, and closes the tcp conn
+// it was arriving on, as the rest of its stream can't be read past it.
+static void refuse_tcp_message(msg_Conn *conn, const char *err_msg) {
+  send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  local_disconnect(conn, msg_connection_closed);
+}
+
+static const char *too_big_err_msg =
+    "Incoming message is larger than the max message size";
+static const char *inbound_limit_err_msg =
+    "Incoming messages exceed the inbound buffer limit";
+static const char *out_of_memory_err_msg =
+    "Out of memory for an incoming message";
+
+// Each udp datagram is read whole into this buffer, in a single call, since
+// we don't know its size until we've seen its header. Only the run loop thread
+// reads from sockets.
+#define max_udp_len 65536
+static char udp_scratch[max_udp_len];
+
+// The largest datagram that fits in an ipv4 udp packet.
+#define max_datagram_limit 65507
+
+// Reads the next udp datagram into udp_scratch, and sets the conn's remote
+// address to the sender's. Returns true on success, with header set in host
+// byte order; returns false on failure or if there was nothing to read.
+static int read_datagram(int sock, msg_Conn *conn, Header *header) {
+  struct sockaddr_storage remote_sockaddr;
+  socklen_t remote_sockaddr_size = sizeof(remote_sockaddr);
   int default_options = 0;
-  long bytes_in = recv(sock, buffer->bytes, buffer->num_bytes, default_options);
-  if (bytes_in == 0 || (bytes_in == -1 && get_errno() == err_conn_reset)) {
-    local_disconnect(conn, msg_connection_lost);
-    return -2;
+  long bytes_recvd = recvfrom(sock, udp_scratch, max_udp_len, default_options,
+                              (struct sockaddr *)&remote_sockaddr,
+                              &remote_sockaddr_size);
+
+  if (bytes_recvd == -1) {
+    if (get_errno() == err_would_block) return false;
+    if (get_errno() == err_conn_reset) {
+      local_disconnect(conn, msg_connection_lost);
+      return false;
+    }
+    send_callback_os_error(conn, "recvfrom", free_nothing, no_set_name);
+    return false;
+  }
+
+  set_remote_address(conn, &remote_sockaddr, remote_sockaddr_size);
+  if (is_local_address(address_of_conn(conn)) && *local_path_str(
+          address_of_conn(conn)) == '\0') {
+    send_callback_error(conn, "Dropped a datagram from an unnamed local socket",
+                        free_nothing, no_set_name);
+    return false;
+  }
+
+  memcpy(header, udp_scratch, bytes_recvd < header_len ? 0 : header_len);
+  header->message_type = ntohs(header->message_type);
+  header->reply_id     = ntohs(header->reply_id);
+  header->num_bytes    = ntohl(header->num_bytes);
+
+  if (bytes_recvd < header_len ||
+      bytes_recvd - header_len < header->num_bytes) {
+    send_callback_error(conn, "Received a truncated udp message",
+                        free_nothing, no_set_name);
+    return false;
+  }
+
+  conn->reply_id = header->reply_id;
+  return true;
+}
+
+static int  add_fragment (msg_Conn *conn, Header *header, msg_Data *data);
+static void read_reliable(msg_Conn *conn, Header *header, char *body);
+static void read_packed  (msg_Conn *conn, char *bytes, size_t num_bytes);
+static int  drops_inbound(msg_Conn *conn);
+static void read_hello   (msg_Conn *conn, ConnStatus *status, char *body,
+                          size_t num_bytes);
+static int  decompress   (msg_Conn *conn, ConnStatus *status, msg_Data *data);
+
+// Sends the callback for a fully received message from the peer with the
+// given status. The message's host-order header must be in data's preamble.
+// Returns false if the message is a reply that doesn't match a msg_get.
+static int send_message_callback(msg_Conn *conn, ConnStatus *status,
+                                 msg_Event event, msg_Data data) {
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  Header *  header   = &metadata->header;
+  if (header->message_type & msg_type_compressed) {
+    if (!decompress(conn, status, &data)) return false;
+    metadata = (Metadata *)(data.bytes - metadata_len);
+    header   = &metadata->header;
+  }
+  metadata->reply_context = NULL;  // reply_context is set for replies below.
+
+  status->last_active_at = loop_now;
+
+  // Look up a reply_context if it's a reply.
+  if (header->message_type == msg_type_reply) {
+    void *reply_id_key = (void *)(intptr_t)header->reply_id;
+    map__key_value *pair = map__get(status->pending_gets, reply_id_key);
+    if (pair == NULL) {
+      // The data may be from any allocator, so it's deleted here rather than
+      // freed by the callback.
+      delete_inbound_data(status, data);
+      send_status_callback(conn, status, msg_error,
+                           new_transient_str("Unrecognized reply_id"),
+                           free_nothing, no_set_name);
+      return false;
+    }
+    msg_Timer *timer = (msg_Timer *)pair->value;
+    conn->reply_context = timer->context;
+    metadata->reply_context = timer->context;
+    map__unset(status->pending_gets, reply_id_key);
+    cancel_timer(timer);
+    // Clear reply_id so a nested msg_send isn't interpreted as a reply itself.
+    conn->reply_id = 0;
+  } else {
+    conn->reply_context = NULL;
   }
-  if (bytes_in == -1) {
-    if (get_errno() == err_would_block) return false;  // More data is pending.
-    // This is an error we must report; treat the current data as lost.
-    return -1;
-  } 
 
-  buffer->bytes     += bytes_in;
-  buffer->num_bytes -= bytes_in;
-  return buffer->num_bytes == 0;
+  send_status_callback(conn, status, event, data, free_nothing, no_set_name);
+  return true;
 }
 
 // Returns true iff the caller may immediately call this again with the same
@@ -1060,8 +2543,8 @@ static int read_from_socket(int sock, msg_Conn *conn) {
   }
   ConnStatus *status = NULL;
   Header *header = NULL;
-  Metadata *metadata = NULL;
   msg_Data data;
+  int is_reassembled = false;
 
   // Read in any tcp data.
   if (conn->protocol_type == msg_tcp) {
@@ -1069,7 +2552,7 @@ static int read_from_socket(int sock, msg_Conn *conn) {
     if (conn->for_listening) {
 
       // Accept a new incoming connection.
-      struct sockaddr_in remote_addr;
+      struct sockaddr_storage remote_addr;
       socklen_t addr_len = sizeof(remote_addr);
       int new_sock = accept(conn->socket,
                             (struct sockaddr *)&remote_addr, &addr_len);
@@ -1093,9 +2576,15 @@ static int read_from_socket(int sock, msg_Conn *conn) {
       msg_Conn *new_conn      = new_connection(conn->conn_context,
                                                conn->callback);
       new_conn->socket        = new_sock;
-      new_conn->remote_ip     = remote_addr.sin_addr.s_addr;
-      new_conn->remote_port   = ntohs(remote_addr.sin_port);
+      set_remote_address(new_conn, &remote_addr, addr_len);
       new_conn->protocol_type = conn->protocol_type;
+      if (is_local_address(address_of_conn(new_conn))) {
+        retain_local_id(new_conn->remote_ip);
+        // An accepted conn's address is unnamed, so it's unique to the conn.
+        if (is_shm_address(address_of_conn(conn))) {
+          mark_shm_address(address_of_conn(new_conn));
+        }
+      }
       new_conn->index         = conns->count;
       array__add_item_val(conns, new_conn);
 
@@ -1107,44 +2596,97 @@ static int read_from_socket(int sock, msg_Conn *conn) {
     }
 
     status = remote_address_seen(conn);
-    if (status->waiting_buffer.num_bytes == 0) {
+    if (status->is_shm && status->shm == NULL) {
+      return read_shm_setup(conn, status);
+    }
+    if (status->in_buffer.bytes == NULL) {
 
       // Begin a new recv.
       header = alloca(sizeof(Header));
       if (!read_header(sock, conn, header)) return false;
+      // Ring messages were sent before anything now in the socket.
+      if (status->shm && !drain_shm(conn, status)) return false;
+      if (header->message_type == msg_type_doorbell) {
+        if (status->shm) push_shm_queue(conn, status);
+        return true;
+      }
       if (header->message_type == msg_type_close) {
         local_disconnect(conn, msg_connection_closed);
         return false;
       }
-      new_conn_status_buffer(status, header);
-    } else {
-
-      // Load header from the buffer we'll continue.
-      header = (Header *)(status->total_buffer.bytes - header_len);
-    }
-    int ret_val = continue_recv(conn, status);
-    if (ret_val == -2) return false;  // The message was interrupted by a close.
+      // A streamed message is never held whole, so it may be any size.
+      int is_streamed = status->is_streaming &&
+                        header->message_type == msg_type_one_way;
+      if (!is_streamed && max_message_size &&
+          header->num_bytes > max_message_size) {
+        refuse_tcp_message(conn, too_big_err_msg);
+        return false;
+      }
+      int is_ready = is_streamed ? new_chunk_buffer(status, header, 0) :
+                                   new_conn_status_buffer(status, header);
+      if (!is_ready) {
+        refuse_tcp_message(conn, inbound_limit_err_msg);
+        return false;
+      }
+    }
+
+    int ret_val;
+    if (status->is_chunking) {
+      ret_val = continue_stream(conn, status);
+      if (ret_val == true) return true;
+    } else {
+      header  = (Header *)(status->in_buffer.bytes - header_len);
+      ret_val = continue_recv(conn, status, header->num_bytes);
+    }
+    if (ret_val == -3) {
+      refuse_tcp_message(conn, inbound_limit_err_msg);
+      return false;
+    }
+    if (ret_val == -4) {
+      refuse_tcp_message(conn, out_of_memory_err_msg);
+      return false;
+    }
+    if (ret_val == -2) return false;  // The message was interrupted by a close.
     if (ret_val == -1) {
       send_callback_os_error(conn, "recv", free_nothing, no_set_name);
       delete_conn_status_buffer(status);
       return false;
     }
     if (ret_val == false) return false;  // It will finish later.
-    data = status->total_buffer;
+    data   = take_conn_status_buffer(status);
+    header = (Header *)(data.bytes - header_len);
 
     if (0) {
       printf("After continue_recv, data has ");
       print_bytes(data.bytes, data.num_bytes);
     }
 
-    status->total_buffer = status->waiting_buffer =
-        (msg_Data) { .num_bytes = 0, .bytes = NULL };
-
   } else {
 
-    // New udp message: read the header.
+    // New udp message: read the whole datagram.
     header = alloca(sizeof(Header));
-    if (!read_header(sock, conn, header)) return false;
+    if (!read_datagram(sock, conn, header)) return false;
+    if (is_impairment_used && drops_inbound(conn)) return true;
+    if (max_message_size && header->num_bytes > max_message_size) {
+      send_callback_error(conn, too_big_err_msg, free_nothing, no_set_name);
+      return true;  // The datagram is dropped; the next one may be fine.
+    }
+    if (header->message_type == msg_type_fragment) {
+      // Wait for the rest of the message unless this fragment completed it.
+      if (!add_fragment(conn, header, &data)) return true;
+      is_reassembled = true;
+    }
+    if (header->message_type == msg_type_reliable ||
+        header->message_type == msg_type_ack) {
+      char *body = is_reassembled ? data.bytes : udp_scratch + header_len;
+      read_reliable(conn, header, body);
+      if (is_reassembled) msg_delete_data(data);
+      return true;
+    }
+    if (header->message_type == msg_type_packed) {
+      read_packed(conn, udp_scratch + header_len, header->num_bytes);
+      return true;
+    }
   }
 
   if (verbosity >= 2) {  // Debug code.
@@ -1153,7 +2695,14 @@ static int read_from_socket(int sock, msg_Conn *conn) {
       "msg_type_request",
       "msg_type_reply",
       "msg_type_heartbeat",
-      "msg_type_close"
+      "msg_type_close",
+      "msg_type_fragment",
+      "msg_type_reliable",
+      "msg_type_ack",
+      "msg_type_packed",
+      "msg_type_shm_setup",
+      "msg_type_doorbell",
+      "msg_type_hello"
     };
     if (header->message_type < (sizeof(msg_type_str) / sizeof(char *))) {
       printf("Received message of type '%s'.\n",
@@ -1164,9 +2713,10 @@ static int read_from_socket(int sock, msg_Conn *conn) {
     }
   }
 
-  // Set up the appropriate reaction event.
+  // Set up the appropriate reaction event. A compressed body is expanded by
+  // send_message_callback.
   msg_Event event;
-  switch (header->message_type) {
+  switch (header->message_type & ~msg_type_compressed) {
     case msg_type_one_way:
       event = msg_message;
       // Avoid confusion about whether or not this is a reply.
@@ -1179,29 +2729,45 @@ static int read_from_socket(int sock, msg_Conn *conn) {
       event = msg_reply;
       break;
     case msg_type_heartbeat:
-      assert(0);
-      break;
+      // A heartbeat has no callback; it only marks the peer as seen.
+      if (conn->protocol_type == msg_tcp) {
+        msg_delete_data(data);
+      } else {
+        remote_address_seen(conn);
+      }
+      return true;
     case msg_type_close:
       if (conn->protocol_type == msg_tcp) msg_delete_data(data);
       local_disconnect(conn, msg_connection_closed);
       return false;
+    case msg_type_hello:
+      if (conn->protocol_type == msg_tcp) {
+        read_hello(conn, status, data.bytes, data.num_bytes);
+        msg_delete_data(data);
+      } else {
+        char *body = is_reassembled ? data.bytes : udp_scratch + header_len;
+        read_hello(conn, remote_address_seen(conn), body, header->num_bytes);
+        if (is_reassembled) msg_delete_data(data);
+      }
+      return true;
+    default:
+      // A type from a later version is dropped; see Handshakes.
+      if (conn->protocol_type == msg_tcp || is_reassembled) {
+        msg_delete_data(data);
+      }
+      return true;
   }
 
   // Read in any udp data.
   if (conn->protocol_type == msg_udp) {
-    data = msg_new_data_space(header->num_bytes);
-    struct sockaddr_in remote_sockaddr;
-    socklen_t remote_sockaddr_size = sock_in_size;
-    int default_options = 0;
-    long bytes_recvd = recvfrom(sock, data.bytes - header_len,
-        data.num_bytes + header_len, default_options,
-        (struct sockaddr *)&remote_sockaddr, &remote_sockaddr_size);
-
-    if (bytes_recvd == -1) {
-      send_callback_os_error(conn, "recvfrom", free_nothing, no_set_name);
-      return false;
+    if (!is_reassembled) {
+      data = new_inbound_data(header->num_bytes);
+      memcpy(data.bytes, udp_scratch + header_len, data.num_bytes);
     }
 
+    // Keep the host-order header, as make_call reads reply_id from it.
+    *(Header *)(data.bytes - header_len) = *header;
+
     // We don't save the current conn_context because the user may have
     // reasonably changed the remote address without changing the conn_context
     // in order to send a message from the same socket - specifically, this is
@@ -1210,54 +2776,36 @@ static int read_from_socket(int sock, msg_Conn *conn) {
     // address.
 
     // Save this data's status with the data itself, since this is udp.
-    conn->remote_ip = remote_sockaddr.sin_addr.s_addr;
-    conn->remote_port = ntohs(remote_sockaddr.sin_port);
+    // read_datagram set the conn's remote address to the sender's.
     status = remote_address_seen(conn);
 
-    metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->reply_context = NULL;  // reply_context is set for replies below.
-    metadata->remote_address = *address_of_conn(conn);
-  }
-
-  // Look up a reply_context if it's a reply.
-  if (header->message_type == msg_type_reply) {
-    void *reply_id_key = (void *)(intptr_t)header->reply_id;
-    map__key_value *pair = map__get(status->reply_contexts, reply_id_key);
-    if (pair == NULL) {
-      send_callback_error(
-          conn,
-          "Unrecognized reply_id",
-          data.bytes - metadata_len,  // Pointer to free.
-          "msg_Data bytes");          // Set name for dbgcheck free.
-      return false;
-    }
-    remove_timeout(status, header->reply_id);
-    conn->reply_context = pair->value;
-    if (metadata) metadata->reply_context = pair->value;  // The udp case.
-    map__unset(status->reply_contexts, reply_id_key);
-    // Clear reply_id so a nested msg_send isn't interpreted as a reply itself.
-    conn->reply_id = 0;
-  } else {
-    conn->reply_context = NULL;
   }
 
-  send_callback(conn, event, data, free_nothing, no_set_name);
-  return true;
+  return send_message_callback(conn, status, event, data);
 }
 
 // Sets up sockaddr based on address. If an error occurs, the error callback
-// is scheduled.  Returns true on success. conn and its polling socket are
-// added to the conns and poll_fds data structures on success.
-static int setup_sockaddr(struct sockaddr_in *sockaddr,
-                          const char *address, msg_Conn *conn) {
+// is scheduled.  Returns the size of sockaddr on success, and 0 on failure.
+// conn and its polling socket are added to the conns and poll_fds data
+// structures on success.
+static socklen_t setup_sockaddr(struct sockaddr_storage *sockaddr,
+                                const char *address, msg_Conn *conn) {
   const char *err_msg = parse_address_str(address, conn);
   if (err_msg) {
     send_callback_error(conn, err_msg, conn, "msg_Conn");
     return false;
   }
 
+  // A mem:// conn has no socket, and isn't polled.
+  if (is_mem_address(address_of_conn(conn))) {
+    conn->socket = -1;
+    conn->index  = -1;
+    return sockaddr_of_address(address_of_conn(conn), sockaddr);
+  }
+
   int use_default_protocol = 0;
-  int sock = socket(AF_INET, conn->protocol_type, use_default_protocol);
+  int family = is_local_address(address_of_conn(conn)) ? AF_UNIX : AF_INET;
+  int sock = socket(family, conn->protocol_type, use_default_protocol);
   if (sock == -1) {
     send_callback_os_error(conn, "socket", conn, "msg_Conn");
     return false;
@@ -1270,85 +2818,3147 @@ static int setup_sockaddr(struct sockaddr_in *sockaddr,
 
   add_to_poll_fds(sock, poll_mode_read);
 
-  // Initialize the sockaddr_in struct.
-  memset(sockaddr, 0, sock_in_size);
-  sockaddr->sin_family = AF_INET;
-  sockaddr->sin_port = htons(conn->remote_port);
-  sockaddr->sin_addr.s_addr = conn->remote_ip;
+  return sockaddr_of_address(address_of_conn(conn), sockaddr);
+}
+
+static void open_mem(msg_Conn *conn, int for_listening);
+
+typedef int (ms_call_conv *SocketOpener)(socket_t,
+                                         const struct sockaddr *,
+                                         socklen_t);
+
+static void open_socket(const char *address, void *conn_context,
+    msg_Callback callback, int for_listening) {
+  init_if_needed();
+
+  msg_Conn *conn = new_connection(conn_context, callback);
+  conn->for_listening = for_listening;
+  struct sockaddr_storage *sockaddr = alloca(sizeof(*sockaddr));
+  socklen_t sockaddr_len = setup_sockaddr(sockaddr, address, conn);
+  if (sockaddr_len == 0) {
+    return;  // Error; setup_sockaddr now owns conn.
+  }
+  if (is_mem_address(address_of_conn(conn))) {
+    return open_mem(conn, for_listening);
+  }
+  int is_local = is_local_address(address_of_conn(conn));
+
+  // Make the socket non-blocking so a connect call won't block.
+  const char *failing_fn = make_non_blocking(conn->socket);
+  if (failing_fn) {
+    send_callback_os_error(conn, failing_fn, conn, "msg_Conn");
+    return remove_last_polling_conn();
+  }
+
+  // A connecting unixgram conn needs a name of its own to get replies.
+  if (is_local && !for_listening && conn->protocol_type == msg_udp &&
+      bind_local_client(conn->socket) == -1) {
+    send_callback_os_error(conn, "bind", conn, "msg_Conn");
+    return remove_last_polling_conn();
+  }
+  if (is_local && for_listening) remove_stale_socket(address_of_conn(conn));
+
+  // On tcp, turn on SO_REUSEADDR for easier server restarts.
+  if (conn->protocol_type == msg_tcp && !is_local) {
+    int optval = 1;
+    // Send (char *)&optval as windows takes a char*; mac/linux takes a void*.
+    setsockopt(conn->socket, SOL_SOCKET, SO_REUSEADDR,
+               (char *)&optval, sizeof(optval));
+  }
+
+  char *sys_call_name = for_listening ? "bind" : "connect";
+  SocketOpener sys_open_sock = for_listening ? bind : connect;
+  int ret_val = sys_open_sock(conn->socket,
+                              (struct sockaddr *)sockaddr,
+                              sockaddr_len);
+  if (ret_val == -1) {
+    int in_progress = (get_errno() == err_in_progress ||
+                       get_errno() == err_would_block);
+    if (!for_listening && conn->protocol_type == msg_tcp && in_progress) {
+      if (is_local) retain_local_id(conn->remote_ip);
+      // Being in progress is ok in this case; we'll send
+      // msg_connection_ready later.
+      set_conn_to_poll_mode(conns->count - 1, poll_mode_write);
+      return;
+    }
+    send_callback_os_error(conn, sys_call_name, conn, "msg_Conn");
+    return remove_last_polling_conn();
+  }
+
+  if (for_listening) {
+    if (conn->protocol_type == msg_tcp) {
+      ret_val = listen(conn->socket, SOMAXCONN);
+      if (ret_val == -1) {
+        send_callback_os_error(conn, "listen", conn, "msg_Conn");
+        return remove_last_polling_conn();
+      }
+    }
+    if (is_local) retain_local_id(conn->remote_ip);
+    send_callback(conn, msg_listening, msg_no_data, free_nothing, no_set_name);
+  } else {
+    if (is_local) retain_local_id(conn->remote_ip);
+    remote_address_seen(conn);  // Sends the msg_connection_ready event.
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Outbound buffering.
+//
+// A tcp send sends what the socket will take and queues the rest in the peer's
+// out_bytes, and the conn polls for writability until the queue has drained.
+// A udp peer's outbound bytes are the datagrams waiting in its pacing queue.
+// Crossing a peer's high watermark sends msg_send_blocked, and falling back to
+// its low watermark afterwards sends msg_send_drained.
+//
+// A coalescing tcp peer's sends are always queued, and the queue is sent with
+// one send call at the end of the run loop iteration, or at a msg_flush call.
+//
+// The body of a msg_send_file message is sent from the file with sendfile, so
+// it's never in out_bytes. Each FileSend in a peer's file_sends notes how many
+// queued bytes go out before its own; bytes queued after the last file go out
+// after it.
+//
+// A msg_disconnect call doesn't wait for a queue that the socket won't take. It
+// sends what it can, and the rest goes out as the socket becomes writable, for
+// up to close_timeout; the conn is closed once the queue is empty, or when the
+// time is up, whichever comes first. In the meantime, the conn is polled only
+// for writability, takes no new sends, and gets no events.
+
+#define close_timeout (5 * ns_per_sec)
+
+typedef struct {
+  int     fd;            // A dup of the caller's fd, closed once sent.
+  int64_t offset;        // The file offset of the next byte to send.
+  size_t  num_left;
+  size_t  bytes_before;  // Queued bytes that go out ahead of this file's.
+} FileSend;
+
+static Array flushes_due = NULL;  // ConnStatus * items, each retained.
+
+static int has_queued_outbound(ConnStatus *status) {
+  return status->out_start < status->out_end ||
+         (status->file_sends && status->file_sends->count);
+}
+
+static void add_flush_due(ConnStatus *status) {
+  if (status->is_flush_due) return;
+  status->is_flush_due = true;
+  if (flushes_due == NULL) flushes_due = array__new(8, sizeof(ConnStatus *));
+  array__new_val(flushes_due, ConnStatus *) = retain_conn_status(status);
+}
+
+static size_t num_outbound_bytes(ConnStatus *status);
+
+static void check_watermarks(msg_Conn *conn, ConnStatus *status) {
+  if (status->high_watermark == 0) return;
+  size_t num_bytes = num_outbound_bytes(status);
+  msg_Event event;
+  if (!status->is_send_blocked && num_bytes > status->high_watermark) {
+    event = msg_send_blocked;
+  } else if (status->is_send_blocked && num_bytes <= status->low_watermark) {
+    event = msg_send_drained;
+  } else {
+    return;
+  }
+  status->is_send_blocked = (event == msg_send_blocked);
+  send_status_callback(conn, status, event, new_transient_data(0),
+                       free_nothing, no_set_name);
+}
+
+static void end_zerocopy(ConnStatus *status);
+
+static void drop_file_sends(ConnStatus *status) {
+  if (status->file_sends == NULL) return;
+  array__for(FileSend *, file, status->file_sends, i) close_file(file->fd);
+  array__clear(status->file_sends);
+}
+
+static void end_outbound(ConnStatus *status) {
+  if (status->close_timer) cancel_timer(status->close_timer);
+  status->close_timer = NULL;
+  end_zerocopy(status);
+  drop_file_sends(status);
+  if (status->file_sends) array__delete(status->file_sends);
+  status->file_sends = NULL;
+  free(status->out_bytes);  // It's from realloc; see queue_outbound.
+  status->out_bytes = NULL;
+  status->out_conn  = NULL;
+  if (status->pack_bytes) dbgcheck__free(status->pack_bytes, "pack_bytes");
+  status->pack_bytes = NULL;
+  status->pack_len   = status->pack_room = status->pack_count = 0;
+  status->out_start = status->out_end = status->out_room = 0;
+}
+
+// Adds bytes to the end of the queue. Returns the name of the failed call, with
+// errno set, if there's no memory for them; otherwise returns no_error.
+static char *queue_outbound(ConnStatus *status, char *bytes,
+                            size_t num_bytes) {
+  // Slide the queued bytes to the front before growing the buffer.
+  size_t num_queued = status->out_end - status->out_start;
+  if (status->out_start && status->out_end + num_bytes > status->out_room) {
+    memmove(status->out_bytes, status->out_bytes + status->out_start,
+            num_queued);
+    status->out_start = 0;
+    status->out_end   = num_queued;
+  }
+  if (status->out_end + num_bytes > status->out_room) {
+    size_t room = status->out_room ? status->out_room : 4096;
+    while (room < status->out_end + num_bytes) room *= 2;
+    char *out_bytes = realloc(status->out_bytes, room);
+    if (out_bytes == NULL) {
+      set_errno(ENOMEM);
+      return "realloc";
+    }
+    status->out_bytes = out_bytes;
+    status->out_room  = room;
+  }
+  memcpy(status->out_bytes + status->out_end, bytes, num_bytes);
+  status->out_end += num_bytes;
+  return no_error;
+}
+
+// Sends as much of bytes as the socket takes now, and returns the number sent,
+// or -1 on error.
+static long send_some(int sock, char *bytes, size_t num_bytes) {
+  size_t num_sent = 0;
+  while (num_sent < num_bytes) {
+    long just_sent = send(sock, bytes + num_sent, num_bytes - num_sent,
+                          send_flags);
+    if (just_sent == -1 && get_errno() == err_would_block) break;
+    if (just_sent == -1) return -1;
+    num_sent += just_sent;
+  }
+  return (long)num_sent;
+}
+
+static char *send_shm(msg_Conn *conn, ConnStatus *status, msg_Data data);
+static char *send_mem(msg_Conn *conn, ConnStatus *status, msg_Data data);
+
+static char *send_tcp(msg_Conn *conn, msg_Data data) {
+  ConnStatus *status = status_of_conn(conn);
+  // Until a connect completes, there's no status and nowhere to queue.
+  if (status == NULL) return send_all(conn->socket, data) ? "send" : no_error;
+  if (status->close_timer) return no_error;  // The conn is closing.
+  if (status->is_shm)   return send_shm(conn, status, data);
+  if (status->mem_peer) return send_mem(conn, status, data);
+
+  char * bytes     = data.bytes     - header_len;
+  size_t num_bytes = data.num_bytes + header_len;
+  long   num_sent  = 0;
+
+  // Bytes can't pass the queue, so only an empty queue may send directly.
+  if (!has_queued_outbound(status) && !status->is_coalescing) {
+    num_sent = send_some(conn->socket, bytes, num_bytes);
+    if (num_sent == -1) return "send";
+    if (num_sent == num_bytes) return no_error;
+    set_conn_to_poll_mode(conn->index, poll_mode_read | poll_mode_write);
+  }
+  char *failed_sys_call = queue_outbound(status, bytes + num_sent,
+                                         num_bytes - num_sent);
+  if (failed_sys_call) return failed_sys_call;
+  status->out_conn = conn;
+  if (status->is_coalescing) add_flush_due(status);
+  check_watermarks(conn, status);
+  return no_error;
+}
+
+// Sends the file bytes the socket takes now, and returns the number sent, or -1
+// on error.
+static long send_file_some(int sock, FileSend *file) {
+  size_t num_sent = 0;
+  while (file->num_left) {
+    long just_sent = send_file_bytes(sock, file->fd, file->offset,
+                                     file->num_left);
+    if (just_sent == -1 && get_errno() == err_would_block) break;
+    if (just_sent == -1) return -1;
+    file->offset   += just_sent;
+    file->num_left -= just_sent;
+    num_sent       += just_sent;
+  }
+  return (long)num_sent;
+}
+
+// Sends the queued bytes and files the socket takes now, in order. Returns
+// no_error (NULL) on success, or the name of the failing system call.
+static char *send_queued_some(msg_Conn *conn, ConnStatus *status) {
+  while (true) {
+    FileSend *file = NULL;
+    if (status->file_sends && status->file_sends->count) {
+      file = (FileSend *)array__item_ptr(status->file_sends, 0);
+    }
+    size_t num_bytes = file ? file->bytes_before
+                            : status->out_end - status->out_start;
+    if (num_bytes) {
+      long num_sent = send_some(conn->socket,
+                                status->out_bytes + status->out_start,
+                                num_bytes);
+      if (num_sent == -1) return "send";
+      status->out_start += num_sent;
+      if (file) file->bytes_before -= num_sent;
+      if (num_sent < num_bytes) return no_error;
+    }
+    if (file == NULL) return no_error;
+    if (send_file_some(conn->socket, file) == -1) return "sendfile";
+    if (file->num_left) return no_error;
+    close_file(file->fd);
+    array__remove_item(status->file_sends, file);
+  }
+}
+
+// Sends what the socket takes of the queue of a conn that msg_disconnect is
+// closing, and closes the conn if that's all of it. A shm:// conn's queue goes
+// over the socket, as it would at the close. Send errors aren't reported, as
+// the app is done with the conn.
+static void send_closing_outbound(msg_Conn *conn, ConnStatus *status) {
+  char *failed_sys_call = send_queued_some(conn, status);
+  if (failed_sys_call || !has_queued_outbound(status)) {
+    local_disconnect(conn, msg_connection_closed);
+  }
+}
+
+// This is called by the run loop when a conn with queued bytes is writable.
+static void send_queued_outbound(msg_Conn *conn, ConnStatus *status) {
+  if (status->close_timer) return send_closing_outbound(conn, status);
+  // A shm:// peer's queue goes to its ring once it's set up.
+  if (status->is_shm) {
+    if (status->shm) push_shm_queue(conn, status);
+    return;
+  }
+  char *failed_sys_call = send_queued_some(conn, status);
+  if (failed_sys_call) {
+    // The peer is gone, or its stream is broken; the read side will see the
+    // close.
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+    status->out_start = status->out_end;
+    drop_file_sends(status);
+  }
+  if (!has_queued_outbound(status)) {
+    status->out_start = status->out_end = 0;
+    set_conn_to_poll_mode(conn->index, poll_mode_read);
+  }
+  check_watermarks(conn, status);
+}
+
+// Sends the queued bytes the socket takes now, and waits for writability if
+// any are left.
+static void send_outbound_now(msg_Conn *conn, ConnStatus *status) {
+  if (!has_queued_outbound(status)) return;
+  send_queued_outbound(conn, status);
+  if (has_queued_outbound(status)) {
+    set_conn_to_poll_mode(conn->index, poll_mode_read | poll_mode_write);
+  }
+}
+
+static void send_pack(ConnStatus *status);
+
+// This is called by the run loop thread at the end of each iteration.
+static void send_due_flushes() {
+  if (flushes_due == NULL) return;
+  array__for(ConnStatus **, status_ptr, flushes_due, i) {
+    ConnStatus *status   = *status_ptr;
+    status->is_flush_due = false;
+    if (status->out_conn) send_outbound_now(status->out_conn, status);
+    send_pack(status);
+    release_conn_status(status);
+  }
+  array__clear(flushes_due);
+}
+
+static void close_timed_out(msg_Timer *timer) {
+  timer->status->close_timer = NULL;  // The timer is deleted after this call.
+  local_disconnect(timer->conn, msg_connection_closed);
+}
+
+// This is called by msg_disconnect for a tcp conn. It sends what the socket
+// takes of the queue now. If that's not all of it, the conn starts closing,
+// and this returns true; otherwise, the caller closes the conn.
+static int start_closing(msg_Conn *conn, ConnStatus *status) {
+  if (!has_queued_outbound(status))       return false;
+  if (send_queued_some(conn, status))     return false;
+  if (!has_queued_outbound(status))       return false;
+  msg_Timer *timer = new_timer(clock_now() + close_timeout, 0,
+                               close_timed_out);
+  timer->conn         = conn;
+  timer->status       = retain_conn_status(status);
+  status->close_timer = timer;
+  set_conn_to_poll_mode(conn->index, poll_mode_write);
+  return true;
+}
+
+// Queues the body of a msg_send_file message, whose header has just been
+// sent or queued, and sends what the socket takes now.
+static void queue_file_send(msg_Conn *conn, ConnStatus *status, int fd,
+                            int64_t offset, size_t num_bytes) {
+  if (status->file_sends == NULL) {
+    status->file_sends = array__new(4, sizeof(FileSend));
+  }
+  size_t bytes_before = status->out_end - status->out_start;
+  array__for(FileSend *, file, status->file_sends, i) {
+    bytes_before -= file->bytes_before;
+  }
+  array__new_val(status->file_sends, FileSend) = (FileSend) {
+    .fd = fd, .offset = offset, .num_left = num_bytes,
+    .bytes_before = bytes_before };
+  status->out_conn = conn;
+  if (status->is_coalescing) add_flush_due(status);
+  else                       send_outbound_now(conn, status);
+  check_watermarks(conn, status);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Zero-copy sends.
+//
+// msg_send_zerocopy owns its data. Where the os supports MSG_ZEROCOPY, a large
+// tcp message is sent with it, so the kernel reads the message's pages in
+// place instead of copying them, and the data is kept in the peer's zc_sends
+// until the kernel reports through the socket's error queue that it's done.
+// The kernel numbers a socket's zero-copy send calls from 0, and reports
+// ranges of finished ids; completions arrive in order for tcp.
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define has_zerocopy 1
+#else
+#define has_zerocopy 0
+#endif
+
+// Smaller messages are cheaper to copy than to pin and track.
+#define zerocopy_min_len (16 * 1024)
+
+// Values for ConnStatus.zc_state.
+enum {
+  zc_state_untried,
+  zc_state_on,
+  zc_state_off   // The socket refused it, or the kernel copied anyway.
+};
+
+typedef struct {
+  msg_Data data;
+  uint32_t last_id;  // The id of the last send call that sent its bytes.
+} ZeroCopySend;
+
+static size_t num_zerocopy_bytes = 0;  // Held for the kernel, for all peers.
+
+static void release_zerocopy_sends(ConnStatus *status, uint32_t done_id) {
+  int num_done = 0;
+  array__for(ZeroCopySend *, zc_send, status->zc_sends, i) {
+    if ((int32_t)(zc_send->last_id - done_id) > 0) break;
+    num_zerocopy_bytes -= zc_send->data.num_bytes;
+    msg_delete_data(zc_send->data);
+    num_done++;
+  }
+  Array sends = status->zc_sends;
+  memmove(sends->items, sends->items + num_done * sends->item_size,
+          (sends->count - num_done) * sends->item_size);
+  sends->count -= num_done;
+}
+
+static void end_zerocopy(ConnStatus *status) {
+  if (status->zc_sends == NULL) return;
+  // The conn is gone, so nothing is left to send from these.
+  release_zerocopy_sends(status, status->zc_next_id - 1);
+  array__delete(status->zc_sends);
+  status->zc_sends = NULL;
+}
+
+#if has_zerocopy
+
+static int can_zerocopy(msg_Conn *conn, ConnStatus *status) {
+  if (status->zc_state == zc_state_untried) {
+    int one = 1;
+    int ret = setsockopt(conn->socket, SOL_SOCKET, SO_ZEROCOPY,
+                         &one, sizeof(one));
+    status->zc_state = (ret == 0) ? zc_state_on : zc_state_off;
+  }
+  return status->zc_state == zc_state_on;
+}
+
+// This is called by the run loop when a conn's socket reports an error, which
+// is how zero-copy completions are announced.
+static void read_zerocopy_completions(msg_Conn *conn, ConnStatus *status) {
+  while (status->zc_sends && status->zc_sends->count) {
+    char control[128];
+    struct msghdr msg = { .msg_control    = control,
+                          .msg_controllen = sizeof(control) };
+    if (recvmsg(conn->socket, &msg, MSG_ERRQUEUE) == -1) return;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      struct sock_extended_err *err = (void *)CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+        continue;
+      }
+      // A copied send gains nothing, so later sends skip the bookkeeping.
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        status->zc_state = zc_state_off;
+      }
+      release_zerocopy_sends(status, err->ee_data);  // The last finished id.
+    }
+  }
+}
+
+// Returns false if data wasn't sent with MSG_ZEROCOPY, in which case the
+// caller still owns it.
+static int send_zerocopy(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  if (data.num_bytes < zerocopy_min_len)        return false;
+  if (has_queued_outbound(status))              return false;
+  if (!can_zerocopy(conn, status))              return false;
+
+  char * bytes     = data.bytes     - header_len;
+  size_t num_bytes = data.num_bytes + header_len;
+  size_t num_sent  = 0;
+  int    num_calls = 0;
+  while (num_sent < num_bytes) {
+    long just_sent = send(conn->socket, bytes + num_sent,
+                          num_bytes - num_sent, send_flags | MSG_ZEROCOPY);
+    // ENOBUFS means the socket's limit on pinned pages was reached.
+    if (just_sent == -1 &&
+        (get_errno() == err_would_block || get_errno() == ENOBUFS)) {
+      break;
+    }
+    if (just_sent == -1) {
+      send_callback_os_error(conn, "send", free_nothing, no_set_name);
+      break;
+    }
+    num_sent += just_sent;
+    num_calls++;
+  }
+  if (num_calls == 0) return false;
+
+  status->zc_next_id += num_calls;
+  if (status->zc_sends == NULL) {
+    status->zc_sends = array__new(8, sizeof(ZeroCopySend));
+  }
+  array__new_val(status->zc_sends, ZeroCopySend) = (ZeroCopySend) {
+    .data = data, .last_id = status->zc_next_id - 1 };
+  num_zerocopy_bytes += data.num_bytes;
+
+  // The rest waits in the queue like any unsent tcp bytes.
+  if (num_sent < num_bytes) {
+    set_conn_to_poll_mode(conn->index, poll_mode_read | poll_mode_write);
+    if (queue_outbound(status, bytes + num_sent, num_bytes - num_sent)) {
+      send_callback_os_error(conn, "realloc", free_nothing, no_set_name);
+    }
+    status->out_conn = conn;
+    check_watermarks(conn, status);
+  }
+  return true;
+}
+
+#else
+
+static void read_zerocopy_completions(msg_Conn *conn, ConnStatus *status) {}
+
+static int send_zerocopy(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  return false;
+}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Handshakes.
+//
+// The message header has no version or flags, so wire features are negotiated
+// per peer instead. With handshakes on, each new status sends the peer a hello
+// holding our protocol version and capability bits, just after its
+// msg_connection_ready event. A peer that gets a hello records it and, if it
+// hasn't sent one, answers with its own, whether or not its handshakes are on,
+// so that either end may start one.
+//
+// Features that older peers may lack are used only when the peer's hello lists
+// them; a peer with no hello yet is assumed to be a msgbox peer with all of
+// them, as before handshakes. Messages of unknown types are dropped, so that
+// later versions can add types without breaking this one.
+
+#define protocol_version 1
+
+// The capabilities of this msgbox.
+#define our_capabilities (msg_cap_fragments | msg_cap_reliable | \
+                          msg_cap_packing   | msg_cap_compression)
+
+// The body of a msg_type_hello message, in network byte order.
+typedef struct {
+  uint16_t version;
+  uint16_t reserved;      // Zero for now.
+  uint32_t capabilities;  // msg_cap_* bits.
+} Hello;
+
+static int is_handshake_on = false;
+
+static void send_hello(msg_Conn *conn, ConnStatus *status) {
+  msg_Data data = new_transient_data(sizeof(Hello));
+  *(Hello *)data.bytes = (Hello) {
+    .version      = htons(protocol_version),
+    .capabilities = htonl(our_capabilities) };
+  set_header(data, msg_type_hello, 0, (uint32_t)data.num_bytes);
+  status->is_hello_sent = true;
+
+  // A listening udp conn sends to its latest peer, which may not be this one.
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  char *failed_sys_call  = send_data(conn, data);
+  *address_of_conn(conn) = saved_address;
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+  msg_delete_data(data);
+}
+
+// This is called for each new status. Mem conns send theirs from open_mem,
+// once their statuses are linked.
+static void start_handshake(msg_Conn *conn, ConnStatus *status) {
+  if (is_handshake_on && !is_mem_address(&status->remote_address)) {
+    send_hello(conn, status);
+  }
+}
+
+static void read_hello(msg_Conn *conn, ConnStatus *status, char *body,
+                       size_t num_bytes) {
+  // Later versions may add fields after these.
+  if (num_bytes < sizeof(Hello)) return;
+  Hello hello;
+  memcpy(&hello, body, sizeof(hello));
+  status->peer_version      = ntohs(hello.version);
+  status->peer_capabilities = ntohl(hello.capabilities);
+  status->has_hello         = true;
+  if (!status->is_hello_sent) send_hello(conn, status);
+}
+
+// Returns true unless the peer's hello says it lacks the capability.
+static int peer_can(ConnStatus *status, uint32_t capability) {
+  return !status->has_hello || (status->peer_capabilities & capability);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Compression.
+//
+// After msg_set_compression, a one-way message, request, or reply to the peer
+// with a body of at least min_compressed_len bytes is compressed with the LZ
+// codec in msgbox_lz.h. It's sent with msg_type_compressed set in its type, and
+// a body that's the original length, as a network-order uint32_t, followed by
+// the compressed bytes. A body that doesn't shrink is sent as it is, and the
+// codec gives up on it as soon as it's clear it won't.
+//
+// The receiver expands the body in send_message_callback, which every
+// transport's messages go through, so the app only sees the original. Each
+// status counts the bytes and nanoseconds spent both ways in a
+// msg_CompressionStats, as does total_compression_stats.
+//
+// Mem conns never compress, as they have no bytes on the wire to save. A peer
+// whose hello lacks msg_cap_compression isn't sent compressed messages.
+
+#define compressed_prefix_len sizeof(uint32_t)
+
+static msg_CompressionStats total_compression_stats;
+static int is_compression_used = false;  // Set at the first compressing conn.
+
+// Adds to a stat both in the status's stats and in the totals.
+#define add_compression_stat(status, field, amount) \
+  ((status)->compression.field += (amount),         \
+   total_compression_stats.field += (amount))
+
+// Returns a compressed copy of data, whose header is set, or msg_no_data if the
+// copy isn't smaller than data.
+static msg_Data compress_data(ConnStatus *status, msg_Data data) {
+  if (data.num_bytes <= compressed_prefix_len + 1) return msg_no_data;
+
+  int64_t started_at = now();
+  msg_Data compressed = new_transient_data(data.num_bytes - 1);
+  size_t num_bytes = lz_compress(data.bytes, data.num_bytes,
+                                 compressed.bytes + compressed_prefix_len,
+                                 compressed.num_bytes - compressed_prefix_len);
+  add_compression_stat(status, compress_time, now() - started_at);
+  if (num_bytes == 0) {
+    msg_delete_data(compressed);
+    add_compression_stat(status, num_incompressible, 1);
+    return msg_no_data;
+  }
+
+  uint32_t original_len = htonl((uint32_t)data.num_bytes);
+  memcpy(compressed.bytes, &original_len, compressed_prefix_len);
+  compressed.num_bytes = compressed_prefix_len + num_bytes;
+  Header *header = (Header *)(data.bytes - header_len);
+  set_header(compressed, ntohs(header->message_type) | msg_type_compressed,
+             ntohs(header->reply_id), (uint32_t)compressed.num_bytes);
+
+  add_compression_stat(status, num_compressed,   1);
+  add_compression_stat(status, num_bytes_before, data.num_bytes);
+  add_compression_stat(status, num_bytes_after,  compressed.num_bytes);
+  return compressed;
+}
+
+// Sends data, whose header is set, as send_data does, compressing it first if
+// msg_set_compression asked for that for its peer.
+static char *send_compressible(msg_Conn *conn, msg_Data data) {
+  if (!is_compression_used) return send_data(conn, data);
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || status->min_compressed_len == 0 ||
+      data.num_bytes < status->min_compressed_len || status->mem_peer ||
+      !peer_can(status, msg_cap_compression)) {
+    return send_data(conn, data);
+  }
+  msg_Data compressed = compress_data(status, data);
+  if (compressed.bytes == NULL) return send_data(conn, data);
+  char *failed_sys_call = send_data(conn, compressed);
+  msg_delete_data(compressed);
+  return failed_sys_call;
+}
+
+// Replaces *data, a message with a compressed body and a host-order header,
+// with its expanded copy, and deletes the original. Returns NULL on success,
+// or an error message, leaving *data as it was.
+static const char *expand_data(ConnStatus *status, msg_Data *data) {
+  const char *malformed_err_msg = "Received a malformed compressed message";
+  if (data->num_bytes < compressed_prefix_len) return malformed_err_msg;
+  size_t   block_len = data->num_bytes - compressed_prefix_len;
+  uint32_t num_bytes;
+  memcpy(&num_bytes, data->bytes, compressed_prefix_len);
+  num_bytes = ntohl(num_bytes);
+  // No block expands past lz_max_ratio times its length, so a peer can't make
+  // us reserve much more memory than it sent.
+  if (num_bytes > block_len * lz_max_ratio) return malformed_err_msg;
+  if (max_message_size && num_bytes > max_message_size) return too_big_err_msg;
+
+  int64_t  started_at = now();
+  msg_Data expanded   = new_inbound_data(num_bytes);
+  int is_ok = lz_decompress(data->bytes + compressed_prefix_len, block_len,
+                            expanded.bytes, expanded.num_bytes);
+  add_compression_stat(status, decompress_time, now() - started_at);
+  if (!is_ok) {
+    msg_delete_data(expanded);
+    return malformed_err_msg;
+  }
+  add_compression_stat(status, num_decompressed, 1);
+
+  Metadata *metadata     = (Metadata *)(expanded.bytes - metadata_len);
+  metadata->chunk_offset = 0;
+  metadata->header       = *(Header *)(data->bytes - header_len);
+  metadata->header.message_type &= ~msg_type_compressed;
+  metadata->header.num_bytes     = num_bytes;
+  delete_inbound_data(status, *data);
+  *data = expanded;
+  return NULL;
+}
+
+// Expands *data as expand_data does. On error, this deletes *data, sends a
+// msg_error, and returns false.
+static int decompress(msg_Conn *conn, ConnStatus *status, msg_Data *data) {
+  const char *err_msg = expand_data(status, data);
+  if (err_msg == NULL) return true;
+  delete_inbound_data(status, *data);
+  send_status_callback(conn, status, msg_error, new_transient_str(err_msg),
+                       free_nothing, no_set_name);
+  return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Shared-memory rings.
+//
+// A shm:// conn is a unix:// conn whose messages go through a region of shared
+// memory holding a single-producer, single-consumer ring for each direction.
+// The side that connects creates the region and passes its fd to the accepting
+// side in a setup message. After that, the socket carries only doorbells, the
+// close, and any messages still queued at the close.
+//
+// A record is a RingRecord followed by the message body, so a message is
+// delivered in place: its Metadata is in the record, and delete_inbound_data
+// marks the record done instead of freeing it. As the peer can write to the
+// ring at any time, nothing in it is trusted: each record's len and num_bytes
+// are checked as it's read, a conn whose peer breaks them is closed, and a
+// buffer is known to be in a ring by its address rather than by an alloc_kind
+// the peer could change. At the end of each run loop iteration, the consumer
+// moves the ring's tail past done records, so that a record's room is reused
+// only once its callback has returned. A record that wouldn't fit before the
+// end of the ring starts the ring over, after a len of 0 that tells the
+// consumer to skip ahead.
+//
+// A consumer that has read every record sets consumer_waiting, and a producer
+// that finds no room sets producer_waiting. The other side clears the flag and
+// sends a doorbell message when it adds a record or frees room, so the socket's
+// poll wakes up the run loop. Each side reads its ring before handling anything
+// from the socket, which keeps ring messages ahead of those sent at the close.
+//
+// The accepting side queues its messages in out_bytes until the setup message
+// arrives. If the region can't be created, the setup message has no fd, and
+// both sides use the socket as they would for unix://.
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+
+#define shm_ring_len (1024 * 1024)  // The room for records in each direction.
+
+// One direction's ring. Each side writes only its own cache line.
+typedef struct {
+  uint64_t head;              // Bytes ever written; set by the producer.
+  int32_t  producer_waiting;
+  char     producer_pad[52];
+  uint64_t tail;              // Bytes ever released; set by the consumer.
+  int32_t  consumer_waiting;
+  char     consumer_pad[52];
+} Ring;
+
+// This is followed by the message body; len is padded to a multiple of 8.
+typedef struct {
+  uint32_t len;
+  int32_t  is_done;
+  Metadata metadata;
+} RingRecord;
+
+#define shm_region_len (2 * sizeof(Ring) + 2 * shm_ring_len)
+
+// The side that connects produces into ring 0, and consumes ring 1.
+typedef struct ShmLink {
+  char *    region;
+  Ring *    out;
+  char *    out_records;
+  Ring *    in;
+  char *    in_records;
+  uint64_t  read_at;  // Where the next record to deliver starts.
+  msg_Conn *conn;
+} ShmLink;
+
+static Array shm_statuses = NULL;  // ConnStatus * items with rings, retained.
+
+#ifdef __linux__
+
+// Returns the fd of a new, empty region, or -1 on error.
+// linux version
+static int new_shm_fd() {
+  return memfd_create("msgbox.shm", MFD_CLOEXEC);
+}
+
+#else
+
+// Returns the fd of a new, empty region, or -1 on error.
+// mac version
+static int new_shm_fd() {
+  static int num_made = 0;
+  char name[32];
+  snprintf(name, 32, "/msgbox.%d.%d", getpid(), num_made++);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd != -1) shm_unlink(name);  // The fd keeps the region alive.
+  return fd;
+}
+
+#endif
+
+// Maps the region of fd, and gives status the rings in it. Returns false on
+// error.
+static int start_shm_link(msg_Conn *conn, ConnStatus *status, int fd,
+                          int is_creator) {
+  char *region = mmap(NULL, shm_region_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+  if (region == MAP_FAILED) return false;
+  Ring *rings   = (Ring *)region;
+  char *records = region + 2 * sizeof(Ring);
+  int   out     = is_creator ? 0 : 1;
+  // A new region is zeroed; each consumer starts out waiting for a doorbell.
+  if (is_creator) rings[0].consumer_waiting = rings[1].consumer_waiting = 1;
+
+  ShmLink *link     = dbgcheck__calloc(sizeof(ShmLink), "ShmLink");
+  link->region      = region;
+  link->out         = &rings[out];
+  link->out_records = records + out * shm_ring_len;
+  link->in          = &rings[1 - out];
+  link->in_records  = records + (1 - out) * shm_ring_len;
+  link->conn        = conn;
+  status->shm       = link;
+  if (shm_statuses == NULL) shm_statuses = array__new(8, sizeof(ConnStatus *));
+  array__new_val(shm_statuses, ConnStatus *) = retain_conn_status(status);
+  return true;
+}
+
+// This is called at the final release of the link's status.
+static void delete_shm_link(ShmLink *link) {
+  munmap(link->region, shm_region_len);
+  dbgcheck__free(link, "ShmLink");
+}
+
+static void end_shm(ConnStatus *status) {
+  if (status->shm == NULL) return;
+  array__for(ConnStatus **, status_ptr, shm_statuses, i) {
+    if (*status_ptr != status) continue;
+    array__remove_item(shm_statuses, status_ptr);
+    release_conn_status(status);
+    break;
+  }
+}
+
+// Sends the setup message, with fd attached unless it's -1. Returns -1 on
+// error; 0 on success, similar to a system call.
+static int send_shm_setup(int sock, int fd) {
+  Header header = { .message_type = htons(msg_type_shm_setup) };
+  struct iovec  iov = { .iov_base = &header, .iov_len = header_len };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd != -1) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, send_flags) == header_len ? 0 : -1;
+}
+
+// This is called when a shm:// conn gets its status. A conn that connected
+// sets up the region now; an accepted conn, whose address is unnamed, waits
+// for its peer's setup message.
+static void start_shm(msg_Conn *conn, ConnStatus *status) {
+  status->is_shm = true;
+  if (*local_path_str(address_of_conn(conn)) == '\0') return;
+
+  int fd = new_shm_fd();
+  if (fd != -1 && (ftruncate(fd, shm_region_len) == -1 ||
+                   !start_shm_link(conn, status, fd, true))) {
+    close(fd);
+    fd = -1;
+  }
+  status->is_shm = (fd != -1);
+  if (send_shm_setup(conn->socket, fd) == -1) {
+    send_callback_os_error(conn, "sendmsg", free_nothing, no_set_name);
+  }
+  if (fd != -1) close(fd);  // The mapping outlives the fd.
+}
+
+static void push_shm_queue(msg_Conn *conn, ConnStatus *status);
+
+// Reads the setup message of a conn accepted by a shm:// listener. Returns
+// values as read_from_socket does.
+static int read_shm_setup(msg_Conn *conn, ConnStatus *status) {
+  Header        header;
+  struct iovec  iov = { .iov_base = &header, .iov_len = header_len };
+  char          control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control,
+                        .msg_controllen = sizeof(control) };
+  long bytes_recvd = recvmsg(conn->socket, &msg, 0);
+  if (bytes_recvd == 0 ||
+      (bytes_recvd == -1 && get_errno() == err_conn_reset)) {
+    local_disconnect(conn, msg_connection_lost);
+    return false;
+  }
+  if (bytes_recvd == -1) {
+    if (get_errno() == err_would_block) return false;
+    send_callback_os_error(conn, "recvmsg", free_nothing, no_set_name);
+    return false;
+  }
+
+  int fd = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  int is_setup = (bytes_recvd == header_len &&
+                  ntohs(header.message_type) == msg_type_shm_setup);
+  // Without a region, the peer uses the socket as a unix:// conn does.
+  if (is_setup && fd == -1) {
+    status->is_shm = false;
+    send_outbound_now(conn, status);
+    return true;
+  }
+  int is_linked = (is_setup && file_size(fd) == shm_region_len &&
+                   start_shm_link(conn, status, fd, false));
+  if (fd != -1) close(fd);  // The mapping outlives the fd.
+  if (!is_linked) {
+    send_callback_error(conn, "Couldn't set up the rings of a shm conn",
+                        free_nothing, no_set_name);
+    local_disconnect(conn, msg_connection_lost);
+    return false;
+  }
+  push_shm_queue(conn, status);
+  return true;
+}
+
+// Sends a doorbell if the other side has asked for one with the given flag.
+static void ring_doorbell(ShmLink *link, int32_t *is_waiting) {
+  // Make our ring update visible before we read the flag; the other side sets
+  // the flag before it checks the ring again.
+  atomic_fence();
+  if (!atomic_load_int(is_waiting) || !atomic_xchg_int(is_waiting, 0)) return;
+  msg_Data data = new_transient_data(0);
+  set_header(data, msg_type_doorbell, 0, 0);
+  // A failure means the peer is gone, which the read side will see.
+  send_all(link->conn->socket, data);
+  msg_delete_data(data);
+}
+
+// Writes a message, which starts with its network-order header, into the ring
+// as a record. Returns false if there's no room for it yet.
+static int push_shm_record(ShmLink *link, char *bytes, size_t num_bytes) {
+  size_t   body_len = num_bytes - header_len;
+  uint64_t len      = (sizeof(RingRecord) + body_len + 7) & ~(uint64_t)7;
+  uint64_t head     = link->out->head;
+  size_t   pos      = head % shm_ring_len;
+  uint64_t skip     = (pos + len > shm_ring_len) ? shm_ring_len - pos : 0;
+  if (head + skip + len - atomic_load_u64(&link->out->tail) > shm_ring_len) {
+    return false;
+  }
+  if (skip) {
+    ((RingRecord *)(link->out_records + pos))->len = 0;
+    head += skip;
+    pos   = 0;
+  }
+  RingRecord *record = (RingRecord *)(link->out_records + pos);
+  Header *    header = (Header *)bytes;
+  record->len     = (uint32_t)len;
+  record->is_done = false;
+  record->metadata.header = (Header) {
+    .message_type = ntohs(header->message_type),
+    .reply_id     = ntohs(header->reply_id),
+    .num_bytes    = ntohl(header->num_bytes) };
+  memcpy(record + 1, bytes + header_len, body_len);
+  atomic_store_u64(&link->out->head, head + len);
+  return true;
+}
+
+// Moves queued messages into the ring while they fit, and asks for a doorbell
+// when there's room for the rest.
+static void push_shm_queue(msg_Conn *conn, ConnStatus *status) {
+  ShmLink *link       = status->shm;
+  int      num_pushed = 0;
+  while (status->out_start < status->out_end) {
+    char * bytes     = status->out_bytes + status->out_start;
+    size_t num_bytes = header_len + ntohl(((Header *)bytes)->num_bytes);
+    if (push_shm_record(link, bytes, num_bytes)) {
+      status->out_start += num_bytes;
+      num_pushed++;
+      continue;
+    }
+    // Check again after setting the flag, as the consumer may have made room
+    // before it could see the flag.
+    if (atomic_load_int(&link->out->producer_waiting)) break;
+    atomic_store_int(&link->out->producer_waiting, 1);
+    atomic_fence();
+  }
+  if (status->out_start == status->out_end) {
+    status->out_start = status->out_end = 0;
+  }
+  if (num_pushed) ring_doorbell(link, &link->out->consumer_waiting);
+  check_watermarks(conn, status);
+}
+
+// Sends a message to a shm:// peer. Returns values as send_data does.
+static char *send_shm(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  char * bytes     = data.bytes     - header_len;
+  size_t num_bytes = data.num_bytes + header_len;
+  Header *header   = (Header *)bytes;
+
+  // The close goes over the socket, after the queued messages. Those that
+  // don't fit in the ring go over the socket too, as the peer reads its ring
+  // before each socket message.
+  if (ntohs(header->message_type) == msg_type_close) {
+    if (status->shm) push_shm_queue(conn, status);
+    while (status->out_start < status->out_end) {
+      long num_sent = send_some(conn->socket,
+                                status->out_bytes + status->out_start,
+                                status->out_end - status->out_start);
+      if (num_sent == -1) return "send";
+      status->out_start += num_sent;
+    }
+    return send_all(conn->socket, data) ? "send" : no_error;
+  }
+
+  // A record must fit in half the ring, so that one always fits after a skip.
+  if (sizeof(RingRecord) + data.num_bytes > shm_ring_len / 2) {
+    set_errno(EMSGSIZE);
+    return "send";
+  }
+  // Messages can't pass the queue, so only an empty queue may push directly.
+  status->out_conn = conn;
+  if (status->shm && !has_queued_outbound(status) &&
+      push_shm_record(status->shm, bytes, num_bytes)) {
+    ring_doorbell(status->shm, &status->shm->out->consumer_waiting);
+    return no_error;
+  }
+  char *failed_sys_call = queue_outbound(status, bytes, num_bytes);
+  if (failed_sys_call) return failed_sys_call;
+  if (status->shm) push_shm_queue(conn, status);
+  else             check_watermarks(conn, status);
+  return no_error;
+}
+
+static int  send_message_callback(msg_Conn *conn, ConnStatus *status,
+                                  msg_Event event, msg_Data data);
+
+// The record's num_bytes has been checked and is passed in, as the peer may
+// change the copy in the ring.
+static void deliver_shm_record(msg_Conn *conn, ConnStatus *status,
+                               RingRecord *record, uint32_t num_bytes) {
+  Metadata *metadata     = &record->metadata;
+  Header *  header       = &metadata->header;
+  metadata->chunk_offset = 0;
+  msg_Data data = { .num_bytes = num_bytes, .bytes = (char *)(record + 1) };
+  if (header->message_type == msg_type_hello) {
+    read_hello(conn, status, data.bytes, data.num_bytes);
+    release_ring_record(metadata);
+    return;
+  }
+  int message_type = header->message_type & ~msg_type_compressed;
+  msg_Event event  = msg_message;
+  if (message_type == msg_type_request) event = msg_request;
+  if (message_type == msg_type_reply)   event = msg_reply;
+  conn->reply_id = (event == msg_message) ? 0 : header->reply_id;
+  send_message_callback(conn, status, event, data);
+}
+
+static const char *bad_ring_err_msg = "Received a malformed shm:// record";
+
+// Moves link->read_at, which is before head, past its record. Sets *record to
+// the record to deliver, with its checked num_bytes in *num_bytes, or to NULL
+// if it's a skip to the start of the ring. Returns false if the record is
+// malformed. Each field is read only once, as the peer may change it.
+static int read_shm_record(ShmLink *link, uint64_t head, RingRecord **record,
+                           uint32_t *num_bytes) {
+  size_t pos = link->read_at % shm_ring_len;
+  *record    = (RingRecord *)(link->in_records + pos);
+  uint64_t len = (*record)->len;
+  if (len == 0) {
+    *record = NULL;
+    len     = shm_ring_len - pos;
+  } else if (len < sizeof(RingRecord) || len % 8 || len > shm_ring_len - pos) {
+    return false;
+  }
+  if (len > head - link->read_at) return false;
+  link->read_at += len;
+  if (*record == NULL) return true;
+  *num_bytes = (*record)->metadata.header.num_bytes;
+  return *num_bytes <= len - sizeof(RingRecord);
+}
+
+// Delivers every record in the inbound ring, then asks for a doorbell for the
+// next one. Returns false if the ring is malformed, in which case the conn
+// has been closed.
+static int drain_shm(msg_Conn *conn, ConnStatus *status) {
+  ShmLink *link = status->shm;
+  Ring *   ring = link->in;
+  do {
+    uint64_t head  = atomic_load_u64(&ring->head);
+    int      is_ok = (head >= link->read_at);
+    while (is_ok && link->read_at < head) {
+      RingRecord *record;
+      uint32_t    num_bytes;
+      is_ok = read_shm_record(link, head, &record, &num_bytes);
+      if (is_ok && record) deliver_shm_record(conn, status, record, num_bytes);
+    }
+    if (!is_ok) {
+      send_callback_error(conn, bad_ring_err_msg, free_nothing, no_set_name);
+      local_disconnect(conn, msg_connection_closed);
+      return false;
+    }
+    // Check again after setting the flag, as the producer may have added a
+    // record before it could see the flag.
+    atomic_store_int(&ring->consumer_waiting, 1);
+    atomic_fence();
+  } while (atomic_load_u64(&ring->head) != link->read_at);
+  return true;
+}
+
+// Returns true iff data was delivered in place from the inbound ring of the
+// peer with the given status.
+static int is_ring_data(ConnStatus *status, msg_Data data) {
+  if (status == NULL || status->shm == NULL) return false;
+  char *records = status->shm->in_records;
+  return data.bytes >= records && data.bytes < records + shm_ring_len;
+}
+
+// This is called by msg_delete_data on a message delivered from a ring.
+static void release_ring_record(Metadata *metadata) {
+  RingRecord *record = (RingRecord *)((char *)metadata -
+                                      offsetof(RingRecord, metadata));
+  atomic_store_int(&record->is_done, 1);
+}
+
+// Moves the tail of each inbound ring past the records whose callbacks are
+// done. This is called by the run loop thread at the end of each iteration.
+static void release_shm_records() {
+  if (shm_statuses == NULL) return;
+  array__for(ConnStatus **, status_ptr, shm_statuses, i) {
+    ShmLink *link = (*status_ptr)->shm;
+    Ring *   ring = link->in;
+    uint64_t tail = ring->tail;
+    while (tail < link->read_at) {
+      size_t      pos    = tail % shm_ring_len;
+      RingRecord *record = (RingRecord *)(link->in_records + pos);
+      uint64_t    len    = record->len;
+      // A len the peer changed since the record was read stops the tail.
+      if (len == 0) len = shm_ring_len - pos;
+      else if (!atomic_load_int(&record->is_done)) break;
+      if (len > link->read_at - tail) break;
+      tail += len;
+    }
+    if (tail == ring->tail) continue;
+    atomic_store_u64(&ring->tail, tail);
+    ring_doorbell(link, &ring->producer_waiting);
+  }
+}
+
+// Sends a range of a file to a shm:// or mem:// peer, which doesn't read its
+// messages from a socket, so the range is read into a message first.
+static void send_file_as_message(msg_Conn *conn, int fd, int64_t offset,
+                                 size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  ssize_t bytes_read = pread(fd, data.bytes, num_bytes, (off_t)offset);
+  if (bytes_read == (ssize_t)num_bytes) {
+    msg_send(conn, data);
+  } else {
+    if (bytes_read != -1) set_errno(EIO);  // The file ended early.
+    send_callback_os_error(conn, "pread", free_nothing, no_set_name);
+  }
+  msg_delete_data(data);
+}
+
+#else
+
+// windows versions; shm:// addresses aren't supported there.
+
+static void delete_shm_link(struct ShmLink *link)                  {}
+static void end_shm        (ConnStatus *status)                    {}
+static void start_shm      (msg_Conn *conn, ConnStatus *status)    {}
+static int  read_shm_setup (msg_Conn *conn, ConnStatus *status)    {
+  return false;
+}
+static void push_shm_queue (msg_Conn *conn, ConnStatus *status)    {}
+static int  drain_shm      (msg_Conn *conn, ConnStatus *status)    {
+  return true;
+}
+static int  is_ring_data   (ConnStatus *status, msg_Data data)     {
+  return false;
+}
+static void release_ring_record(Metadata *metadata)                {}
+static void release_shm_records()                                  {}
+
+static char *send_shm(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  return "send";
+}
+
+static void send_file_as_message(msg_Conn *conn, int fd, int64_t offset,
+                                 size_t num_bytes) {}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Memory conns.
+//
+// A mem://name address acts like a tcp address, but both ends are in this
+// process, and there are no sockets: a conn that connects is paired with a new
+// conn of the listener's, and each message is copied straight into the other
+// end's callback queue. Each end's status points to the other's, and a close
+// disconnects both. These conns are for simulating many peers in one process,
+// as with the virtual clock in the Timer section, so that a run depends only
+// on the order of the app's calls.
+//
+// The conns have a socket of -1, and aren't in conns or poll_fds, so that
+// thousands of them add nothing to each poll call. The listener is found
+// through the LocalAddr of the name; a connect with no listener is refused.
+
+#ifndef _WIN32
+
+static void open_mem(msg_Conn *conn, int for_listening) {
+  LocalAddr *local_addr = local_addr_of_id(conn->remote_ip);
+
+  if (for_listening) {
+    if (local_addr->listener) {
+      set_errno(EADDRINUSE);
+      return send_callback_os_error(conn, "bind", conn, "msg_Conn");
+    }
+    local_addr->listener = conn;
+    retain_local_id(conn->remote_ip);
+    send_callback(conn, msg_listening, msg_no_data, free_nothing, no_set_name);
+    return;
+  }
+
+  msg_Conn *listener = local_addr->listener;
+  if (listener == NULL) {
+    set_errno(err_conn_refused);
+    return send_callback_os_error(conn, "connect", conn, "msg_Conn");
+  }
+
+  // Each client gets a private id, so that it has a status of its own.
+  conn->remote_ip = new_local_id(local_addr);
+  retain_local_id(conn->remote_ip);
+
+  msg_Conn *new_conn      = new_connection(listener->conn_context,
+                                           listener->callback);
+  LocalAddr unnamed       = { .sockaddr.sun_family = AF_UNIX,
+                              .len = path_offset, .is_mem = true };
+  new_conn->socket        = -1;
+  new_conn->index         = -1;
+  new_conn->remote_ip     = new_local_id(&unnamed);
+  new_conn->protocol_type = msg_tcp;
+  retain_local_id(new_conn->remote_ip);
+
+  // These send msg_connection_ready, the server's first, as on tcp.
+  ConnStatus *server_status = remote_address_seen(new_conn);
+  ConnStatus *client_status = remote_address_seen(conn);
+  server_status->conn     = new_conn;
+  client_status->conn     = conn;
+  server_status->mem_peer = client_status;
+  client_status->mem_peer = server_status;
+  if (is_handshake_on) send_hello(conn, client_status);
+}
+
+static void unlisten_mem(msg_Conn *conn) {
+  local_addr_of_id(conn->remote_ip)->listener = NULL;
+}
+
+static void end_mem(ConnStatus *status) {
+  if (status->mem_peer == NULL) return;
+  status->mem_peer->mem_peer = NULL;
+  status->mem_peer           = NULL;
+}
+
+// Sends a message to a mem:// peer. Returns values as send_data does.
+static char *send_mem(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  ConnStatus *peer_status = status->mem_peer;
+  msg_Conn *  peer        = peer_status->conn;
+  Header *    header      = (Header *)(data.bytes - header_len);
+  uint16_t    msg_type    = ntohs(header->message_type);
+
+  if (msg_type == msg_type_close) {
+    local_disconnect(peer, msg_connection_closed);
+    return no_error;
+  }
+  if (msg_type == msg_type_hello) {
+    read_hello(peer, peer_status, data.bytes, data.num_bytes);
+    return no_error;
+  }
+
+  msg_Data copy = new_inbound_data(data.num_bytes);
+  memcpy(copy.bytes, data.bytes, data.num_bytes);
+  Metadata *metadata     = (Metadata *)(copy.bytes - metadata_len);
+  metadata->chunk_offset = 0;
+  metadata->header       = (Header) {
+    .message_type = msg_type,
+    .reply_id     = ntohs(header->reply_id),
+    .num_bytes    = (uint32_t)data.num_bytes };
+
+  msg_Event event = msg_message;
+  if (msg_type == msg_type_request) event = msg_request;
+  if (msg_type == msg_type_reply)   event = msg_reply;
+  peer->reply_id = (event == msg_message) ? 0 : metadata->header.reply_id;
+  peer_status->last_seen_at = loop_now;
+  send_message_callback(peer, peer_status, event, copy);
+  return no_error;
+}
+
+#else
+
+// windows versions; mem:// addresses aren't supported there.
+
+static void open_mem    (msg_Conn *conn, int for_listening) {}
+static void unlisten_mem(msg_Conn *conn)                    {}
+static void end_mem     (ConnStatus *status)                {}
+
+static char *send_mem(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  return "send";
+}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  UDP packing.
+//
+// A coalescing udp peer's one-way messages, requests, and replies are packed
+// into one msg_type_packed datagram, whose body is the messages with their
+// headers, back to back, up to max_datagram_len bytes. The pack is sent when
+// the next message wouldn't fit, at the end of the run loop iteration, or at a
+// msg_flush call. A pack of one message is sent as that message alone.
+
+// Sends the peer's packed messages.
+static void send_pack(ConnStatus *status) {
+  if (status->pack_count == 0) return;
+  char * bytes     = status->pack_bytes + header_len;
+  size_t num_bytes = status->pack_len;
+  if (status->pack_count > 1) {
+    bytes     -= header_len;
+    num_bytes += header_len;
+    *(Header *)bytes = (Header) {
+      .message_type = htons(msg_type_packed),
+      .reply_id     = 0,
+      .num_bytes    = htonl((uint32_t)status->pack_len) };
+  }
+  status->pack_len   = 0;
+  status->pack_count = 0;
+
+  msg_Conn *conn = status->conn;
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  char *failed_sys_call  = send_datagram(conn, bytes, num_bytes);
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+  *address_of_conn(conn) = saved_address;
+}
+
+// Returns true if data, whose header is set, was packed; false if it's to be
+// sent on its own.
+static int pack_message(msg_Conn *conn, msg_Data data) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || !status->is_coalescing || status->conn == NULL ||
+      !peer_can(status, msg_cap_packing)) {
+    return false;
+  }
+  Header *header   = (Header *)(data.bytes - header_len);
+  int message_type = ntohs(header->message_type) & ~msg_type_compressed;
+  if (message_type != msg_type_one_way &&
+      message_type != msg_type_request &&
+      message_type != msg_type_reply) {
+    return false;
+  }
+
+  size_t framed_len = header_len + data.num_bytes;
+  if (header_len + framed_len > max_datagram_len) {
+    // It's too big to share a datagram; keep it in order behind the pack.
+    send_pack(status);
+    return false;
+  }
+  if (header_len + status->pack_len + framed_len > max_datagram_len) {
+    send_pack(status);
+  }
+  if (status->pack_room < max_datagram_len) {
+    if (status->pack_bytes) dbgcheck__free(status->pack_bytes, "pack_bytes");
+    status->pack_bytes = dbgcheck__malloc(max_datagram_len, "pack_bytes");
+    status->pack_room  = max_datagram_len;
+  }
+  memcpy(status->pack_bytes + header_len + status->pack_len,
+         (char *)header, framed_len);
+  status->pack_len += framed_len;
+  status->pack_count++;
+  add_flush_due(status);
+  return true;
+}
+
+// Delivers each message in the body of a msg_type_packed datagram.
+static void read_packed(msg_Conn *conn, char *bytes, size_t num_bytes) {
+  ConnStatus *status = remote_address_seen(conn);
+  while (num_bytes >= header_len) {
+    Header header;
+    memcpy(&header, bytes, header_len);
+    header.message_type = ntohs(header.message_type);
+    header.reply_id     = ntohs(header.reply_id);
+    header.num_bytes    = ntohl(header.num_bytes);
+    if (header.num_bytes > num_bytes - header_len) {
+      send_callback_error(conn, "Received a truncated udp message",
+                          free_nothing, no_set_name);
+      return;
+    }
+    char *body = bytes + header_len;
+    bytes     += header_len + header.num_bytes;
+    num_bytes -= header_len + header.num_bytes;
+
+    msg_Event event;
+    int message_type = header.message_type & ~msg_type_compressed;
+    if      (message_type == msg_type_one_way) event = msg_message;
+    else if (message_type == msg_type_request) event = msg_request;
+    else if (message_type == msg_type_reply)   event = msg_reply;
+    else continue;
+    if (max_message_size && header.num_bytes > max_message_size) {
+      send_callback_error(conn, too_big_err_msg, free_nothing, no_set_name);
+      continue;
+    }
+
+    msg_Data data = new_inbound_data(header.num_bytes);
+    memcpy(data.bytes, body, data.num_bytes);
+    *(Header *)(data.bytes - header_len) = header;
+    conn->reply_id = (event == msg_message) ? 0 : header.reply_id;
+    send_message_callback(conn, status, event, data);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  UDP fragmentation.
+//
+// A udp message that doesn't fit in a datagram of max_datagram_len bytes is
+// sent as a series of msg_type_fragment datagrams. Each fragment's body is a
+// FragmentHeader followed by a slice of the message, and every slice but the
+// last has the same length, so the receiver can place each fragment by its
+// packet_id alone. A udp peer's status reassembles one message at a time; a
+// message that's superseded by a newer one, or that's incomplete after
+// reassembly_timeout, is dropped and counted in num_reassembly_failures.
+//
+// The first fragment accepted for a message sets its type, reply_id, size,
+// number of packets, and slice length; later fragments that disagree with any
+// of them are dropped, so the accepted slices never overlap or leave gaps.
+
+typedef struct {
+  uint16_t message_type;  // The type of the whole message.
+  uint16_t message_id;    // Tells apart the messages a sender fragments.
+  uint16_t packet_id;     // This fragment's index within the message.
+  uint16_t num_packets;
+  uint32_t num_bytes;     // The size of the whole message.
+} FragmentHeader;
+
+#define fragment_header_len (sizeof(FragmentHeader))
+
+// This bounds the memory a peer may tie up with a single message.
+#define max_reassembly_len (1024 * 1024)
+
+#define default_max_datagram_len   1400
+#define default_reassembly_timeout (1 * ns_per_sec)
+
+static size_t   max_datagram_len        = default_max_datagram_len;
+static int64_t  reassembly_timeout      = default_reassembly_timeout;
+static uint64_t num_reassembly_failures = 0;
+static uint16_t next_message_id         = 0;
+
+static char fragment_scratch[max_datagram_limit];
+
+// Sends data, whose header is set, as fragments. Returns values as send_data
+// does.
+// Unix datagrams never cross a network, so local peers get datagrams as large
+// as a receiving msgbox reads.
+static size_t datagram_len_of(msg_Conn *conn) {
+  if (is_local_address(address_of_conn(conn))) return max_datagram_limit;
+  return max_datagram_len;
+}
+
+static char *send_fragments(msg_Conn *conn, msg_Data data) {
+  Header *header    = (Header *)(data.bytes - header_len);
+  size_t  slice_len = datagram_len_of(conn) - header_len - fragment_header_len;
+  size_t  num_packets = (data.num_bytes + slice_len - 1) / slice_len;
+  if (num_packets > UINT16_MAX) {
+    send_callback_error(conn, "Message is too large to send over udp",
+                        free_nothing, no_set_name);
+    return no_error;
+  }
+
+  FragmentHeader frag = {
+    .message_type = header->message_type,  // Already in network byte order.
+    .message_id   = htons(next_message_id++),
+    .num_packets  = htons((uint16_t)num_packets),
+    .num_bytes    = htonl((uint32_t)data.num_bytes) };
+
+  for (size_t i = 0; i < num_packets; ++i) {
+    size_t offset    = i * slice_len;
+    size_t num_bytes = data.num_bytes - offset;
+    if (num_bytes > slice_len) num_bytes = slice_len;
+
+    Header outer = {
+      .message_type = htons(msg_type_fragment),
+      .reply_id     = header->reply_id,
+      .num_bytes    = htonl((uint32_t)(fragment_header_len + num_bytes)) };
+    frag.packet_id = htons((uint16_t)i);
+
+    char *bytes = fragment_scratch;
+    memcpy(bytes, &outer, header_len);
+    memcpy(bytes + header_len, &frag, fragment_header_len);
+    memcpy(bytes + header_len + fragment_header_len, data.bytes + offset,
+           num_bytes);
+    char *failed_sys_call = send_datagram(conn, bytes, header_len +
+                                          fragment_header_len + num_bytes);
+    if (failed_sys_call) return failed_sys_call;
+  }
+  return no_error;
+}
+
+// Frees any message being reassembled, along with its bookkeeping. The
+// caller counts the failure if this drops a message.
+static void end_reassembly(ConnStatus *status) {
+  if (status->in_buffer.bytes) delete_conn_status_buffer(status);
+  if (status->frag_packets_seen) {
+    dbgcheck__free(status->frag_packets_seen, "frag_packets_seen");
+    status->frag_packets_seen = NULL;
+  }
+  if (status->frag_timer) {
+    cancel_timer(status->frag_timer);
+    status->frag_timer = NULL;
+  }
+}
+
+static void reassembly_timed_out(msg_Timer *timer) {
+  ConnStatus *status = timer->status;
+  status->frag_timer = NULL;  // The timer is deleted after this call.
+  end_reassembly(status);
+  num_reassembly_failures++;
+}
+
+// Returns the length of every slice but the last of the message that frag
+// belongs to, as implied by frag and the num_bytes of its own slice, or 0 if
+// frag doesn't agree with itself.
+static size_t implied_slice_len(FragmentHeader *frag, size_t num_bytes) {
+  if (frag->packet_id >= frag->num_packets || num_bytes == 0) return 0;
+  size_t num_full = frag->num_packets - 1;  // The slices before the last.
+  if (frag->packet_id < num_full) {
+    // The last slice must have between 1 and num_bytes bytes.
+    if ((uint64_t)num_full * num_bytes >= frag->num_bytes) return 0;
+    if (frag->num_bytes - num_full * num_bytes > num_bytes) return 0;
+    return num_bytes;
+  }
+  if (num_bytes > frag->num_bytes) return 0;
+  if (num_full == 0) return num_bytes == frag->num_bytes ? num_bytes : 0;
+  size_t num_before = frag->num_bytes - num_bytes;
+  if (num_before % num_full || num_bytes > num_before / num_full) return 0;
+  return num_before / num_full;
+}
+
+// Sets up status to reassemble the message frag belongs to. Returns false if
+// msgbox won't hold the message.
+static int start_reassembly(msg_Conn *conn, ConnStatus *status,
+                            FragmentHeader *frag, uint16_t reply_id,
+                            size_t slice_len) {
+  int message_type = frag->message_type & ~msg_type_compressed;
+  int is_valid = (message_type == msg_type_one_way ||
+                  message_type == msg_type_request ||
+                  message_type == msg_type_reply   ||
+                  message_type == msg_type_reliable) &&
+                 frag->num_packets > 0;
+  if (!is_valid) return false;
+
+  int is_too_big = frag->num_bytes > max_reassembly_len ||
+                   (max_message_size && frag->num_bytes > max_message_size);
+  if (is_too_big || !reserve_inbound_bytes(frag->num_bytes)) {
+    // Report a refused message once, rather than once per fragment.
+    if (frag->packet_id == 0) {
+      num_reassembly_failures++;
+      send_callback_error(conn, is_too_big ? too_big_err_msg :
+                                             inbound_limit_err_msg,
+                          free_nothing, no_set_name);
+    }
+    return false;
+  }
+
+  status->in_buffer    = new_inbound_data(frag->num_bytes);
+  status->num_bytes_in = 0;
+  status->is_chunking  = false;
+  *(Header *)(status->in_buffer.bytes - header_len) = (Header) {
+    .message_type = frag->message_type,
+    .reply_id     = reply_id,
+    .num_bytes    = frag->num_bytes };
+
+  status->frag_message_id   = frag->message_id;
+  status->frag_num_packets  = frag->num_packets;
+  status->frag_slice_len    = slice_len;
+  status->frag_packets_seen = dbgcheck__calloc((frag->num_packets + 7) / 8,
+                                               "frag_packets_seen");
+  status->frag_timer = new_timer(fresh_loop_now() + reassembly_timeout, 0,
+                                 reassembly_timed_out);
+  status->frag_timer->status = retain_conn_status(status);
+  return true;
+}
+
+// Adds the fragment in udp_scratch, whose outer header is given, to the
+// sender's message. Returns true if that completes the message, in which case
+// data is set to the message and header to its header. Otherwise the fragment
+// is kept or dropped, and false is returned.
+static int add_fragment(msg_Conn *conn, Header *header, msg_Data *data) {
+  ConnStatus *status = remote_address_seen(conn);
+  if (header->num_bytes < fragment_header_len) return false;
+
+  FragmentHeader frag;
+  memcpy(&frag, udp_scratch + header_len, fragment_header_len);
+  frag.message_type = ntohs(frag.message_type);
+  frag.message_id   = ntohs(frag.message_id);
+  frag.packet_id    = ntohs(frag.packet_id);
+  frag.num_packets  = ntohs(frag.num_packets);
+  frag.num_bytes    = ntohl(frag.num_bytes);
+  char * bytes     = udp_scratch + header_len + fragment_header_len;
+  size_t num_bytes = header->num_bytes - fragment_header_len;
+  size_t slice_len = implied_slice_len(&frag, num_bytes);
+  if (slice_len == 0) return false;
+
+  // A fragment of a newer message ends the one being reassembled.
+  if (status->in_buffer.bytes && status->frag_message_id != frag.message_id) {
+    end_reassembly(status);
+    num_reassembly_failures++;
+  }
+  if (status->in_buffer.bytes == NULL &&
+      !start_reassembly(conn, status, &frag, header->reply_id, slice_len)) {
+    return false;
+  }
+
+  // Drop fragments that don't match the message or that we already have.
+  Header *msg_header = (Header *)(status->in_buffer.bytes - header_len);
+  int is_valid = frag.num_packets  == status->frag_num_packets &&
+                 frag.num_bytes    == msg_header->num_bytes &&
+                 slice_len         == status->frag_slice_len &&
+                 frag.message_type == msg_header->message_type &&
+                 header->reply_id  == msg_header->reply_id;
+  if (!is_valid) return false;
+  size_t offset = (size_t)frag.packet_id * slice_len;
+  uint8_t *seen = &status->frag_packets_seen[frag.packet_id / 8];
+  uint8_t  bit  = 1 << (frag.packet_id % 8);
+  if (*seen & bit) return false;
+  *seen |= bit;
+
+  memcpy(status->in_buffer.bytes + offset, bytes, num_bytes);
+  status->num_bytes_in += num_bytes;
+  if (status->num_bytes_in < msg_header->num_bytes) return false;
+
+  *header = *msg_header;
+  *data   = take_conn_status_buffer(status);
+  end_reassembly(status);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Reliable udp.
+//
+// msg_send_reliable sends a msg_type_reliable datagram whose body is a
+// ReliableHeader followed by the message. Each peer's reliable messages are
+// numbered in one sequence, and each side acks what it has received as a
+// cumulative ack plus a bitfield of the reliable_window seqs after it. Acks
+// ride along on outgoing reliable messages; any ack that hasn't by the end of
+// a run loop iteration goes out in a msg_type_ack datagram.
+//
+// A sent message is resent when three later messages have been acked, or when
+// it's been unacked for its retransmission timeout, which is derived from the
+// peer's smoothed rtt as in tcp and backs off with each resend. A peer that
+// doesn't ack a message within max_reliable_sends sends is lost. At most
+// reliable_window messages are in flight; later ones wait their turn.
+//
+// Unordered messages are delivered as they arrive. An ordered message waits
+// until every earlier reliable message has arrived, so a loss only holds back
+// ordered messages, and unreliable traffic is never held back.
+
+#define reliable_window    64
+#define max_reliable_sends 10
+#define fast_resend_gap    3
+
+#define initial_rto (200 * msg_ms)
+#define min_rto     (10 * msg_ms)
+#define max_rto     (2 * ns_per_sec)
+
+// Values for ReliableHeader.flags.
+enum {
+  reliable_flag_ordered = 1
+};
+
+typedef struct {
+  uint16_t message_type;  // The type of the message carried.
+  uint16_t seq;
+  uint16_t flags;
+  uint16_t ack;           // The sender has received every seq before ack.
+  uint32_t ack_bits[2];   // Bit i is set when seq ack + i has been received.
+} ReliableHeader;
+
+#define reliable_header_len (sizeof(ReliableHeader))
+
+typedef struct {
+  msg_Data datagram;   // A ReliableHeader followed by the message.
+  uint16_t seq;
+  int      num_sends;  // Zero while the message waits for the window.
+  int      was_fast_resent;
+  int64_t  sent_at;
+  int64_t  resend_at;
+} OutMessage;
+
+typedef struct {
+  uint16_t seq;
+  msg_Data data;       // Its host-order header is in the preamble.
+} HeldMessage;
+
+typedef struct Reliable {
+  // Sending.
+  uint16_t   next_seq;
+  Array      out_messages;  // OutMessage items in seq order.
+  msg_Timer *resend_timer;
+  int64_t    srtt;          // Zero until the first rtt sample.
+  int64_t    rttvar;
+  int64_t    rto;
+
+  // Receiving.
+  uint16_t   recv_next;     // The first seq not yet received.
+  uint64_t   recv_bits;     // Bit i is set when recv_next + i was received.
+  Array      held;          // HeldMessage items; ordered ones behind a gap.
+  int        is_ack_due;
+} Reliable;
+
+static Array acks_due = NULL;  // ConnStatus * items, each retained.
+
+static void lose_peer(ConnStatus *status);
+static void note_acked_bytes(ConnStatus *status, size_t num_bytes);
+static void note_loss       (ConnStatus *status);
+
+static Reliable *reliable_of(ConnStatus *status) {
+  if (status->reliable) return status->reliable;
+  Reliable *rel     = dbgcheck__calloc(sizeof(Reliable), "Reliable");
+  rel->out_messages = array__new(8, sizeof(OutMessage));
+  rel->held         = array__new(8, sizeof(HeldMessage));
+  rel->rto          = initial_rto;
+  status->reliable  = rel;
+  return rel;
+}
+
+static void end_reliable(ConnStatus *status) {
+  Reliable *rel = status->reliable;
+  if (rel == NULL) return;
+  if (rel->resend_timer) cancel_timer(rel->resend_timer);
+  array__for(OutMessage *, out, rel->out_messages, i) {
+    msg_delete_data(out->datagram);
+  }
+  array__for(HeldMessage *, held, rel->held, i) msg_delete_data(held->data);
+  array__delete(rel->out_messages);
+  array__delete(rel->held);
+  dbgcheck__free(rel, "Reliable");
+  status->reliable = NULL;
+}
+
+static void set_ack_fields(Reliable *rel, ReliableHeader *rh) {
+  rh->ack         = htons(rel->recv_next);
+  rh->ack_bits[0] = htonl((uint32_t)rel->recv_bits);
+  rh->ack_bits[1] = htonl((uint32_t)(rel->recv_bits >> 32));
+  rel->is_ack_due = false;
+}
+
+// Sends data, whose header is set, to the peer of the given udp status.
+static char *send_to_peer(ConnStatus *status, msg_Data data) {
+  msg_Conn *conn = status->conn;
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  char *failed_sys_call  = send_data(conn, data);
+  *address_of_conn(conn) = saved_address;
+  return failed_sys_call;
+}
+
+static void send_out_message(ConnStatus *status, OutMessage *out) {
+  Reliable *rel = status->reliable;
+  set_ack_fields(rel, (ReliableHeader *)out->datagram.bytes);
+
+  char *failed_sys_call = send_to_peer(status, out->datagram);
+  // A failed resend is not reported; the peer will be lost if it's gone.
+  if (failed_sys_call && out->num_sends == 0) {
+    send_callback_os_error(status->conn, failed_sys_call,
+                           free_nothing, no_set_name);
+  }
+
+  if (out->num_sends) note_loss(status);
+  int backoff    = out->num_sends < 5 ? out->num_sends : 5;
+  int64_t rto    = rel->rto << backoff;
+  out->num_sends++;
+  out->sent_at   = loop_now;
+  out->resend_at = loop_now + (rto < max_rto ? rto : max_rto);
+}
+
+static void resend_due(msg_Timer *timer);
+
+static void schedule_resend(ConnStatus *status) {
+  Reliable *rel = status->reliable;
+  if (rel->resend_timer) cancel_timer(rel->resend_timer);
+  rel->resend_timer = NULL;
+
+  int64_t resend_at = 0;
+  array__for(OutMessage *, out, rel->out_messages, i) {
+    if (out->num_sends == 0) break;  // Later messages haven't been sent yet.
+    if (resend_at == 0 || out->resend_at < resend_at) {
+      resend_at = out->resend_at;
+    }
+  }
+  if (resend_at == 0) return;
+  rel->resend_timer = new_timer(resend_at, 0, resend_due);
+  rel->resend_timer->status = retain_conn_status(status);
+}
+
+// Sends the waiting messages that fit in the window.
+static void send_waiting_messages(ConnStatus *status) {
+  Reliable *rel = status->reliable;
+  if (rel->out_messages->count == 0) return;
+  OutMessage *first = array__item_ptr(rel->out_messages, 0);
+  uint16_t first_seq = first->seq;
+  array__for(OutMessage *, out, rel->out_messages, i) {
+    if ((uint16_t)(out->seq - first_seq) >= reliable_window) break;
+    if (out->num_sends == 0) send_out_message(status, out);
+  }
+}
+
+static void resend_due(msg_Timer *timer) {
+  ConnStatus *status = timer->status;
+  Reliable *  rel    = status->reliable;
+  rel->resend_timer  = NULL;  // The timer is deleted after this call.
+
+  array__for(OutMessage *, out, rel->out_messages, i) {
+    if (out->num_sends == 0) break;
+    if (out->resend_at > loop_now) continue;
+    if (out->num_sends == max_reliable_sends) return lose_peer(status);
+    send_out_message(status, out);
+  }
+  schedule_resend(status);
+}
+
+static void update_rtt(Reliable *rel, int64_t rtt) {
+  if (rel->srtt == 0) {
+    rel->srtt   = rtt;
+    rel->rttvar = rtt / 2;
+  } else {
+    int64_t delta = rtt > rel->srtt ? rtt - rel->srtt : rel->srtt - rtt;
+    rel->rttvar   = (3 * rel->rttvar + delta) / 4;
+    rel->srtt     = (7 * rel->srtt + rtt) / 8;
+  }
+  rel->rto = rel->srtt + 4 * rel->rttvar;
+  if (rel->rto < min_rto) rel->rto = min_rto;
+  if (rel->rto > max_rto) rel->rto = max_rto;
+}
+
+static int is_acked(uint16_t seq, uint16_t ack, uint64_t ack_bits) {
+  uint16_t offset = seq - ack;
+  if (offset >= 0x8000) return true;  // seq is before ack.
+  return offset < reliable_window && ((ack_bits >> offset) & 1);
+}
+
+static void handle_ack(ConnStatus *status, uint16_t ack, uint64_t ack_bits) {
+  Reliable *rel = status->reliable;
+
+  // The newest seq this ack covers.
+  uint16_t newest = ack - 1;
+  for (int i = reliable_window - 1; i > 0; --i) {
+    if ((ack_bits >> i) & 1) {
+      newest = ack + i;
+      break;
+    }
+  }
+
+  int i = 0;
+  while (i < rel->out_messages->count) {
+    OutMessage *out = array__item_ptr(rel->out_messages, i);
+    if (out->num_sends == 0) break;
+    if (is_acked(out->seq, ack, ack_bits)) {
+      // Only a message sent once gives an unambiguous rtt sample.
+      if (out->num_sends == 1) update_rtt(rel, loop_now - out->sent_at);
+      note_acked_bytes(status, out->datagram.num_bytes);
+      msg_delete_data(out->datagram);
+      array__remove_item(rel->out_messages, out);
+      continue;
+    }
+    uint16_t gap = newest - out->seq;
+    if (gap >= fast_resend_gap && gap < 0x8000 && !out->was_fast_resent) {
+      send_out_message(status, out);
+      out->was_fast_resent = true;
+    }
+    i++;
+  }
+  send_waiting_messages(status);
+  schedule_resend(status);
+}
+
+static void mark_ack_due(ConnStatus *status) {
+  Reliable *rel = status->reliable;
+  if (rel->is_ack_due) return;
+  rel->is_ack_due = true;
+  if (acks_due == NULL) acks_due = array__new(8, sizeof(ConnStatus *));
+  array__new_val(acks_due, ConnStatus *) = retain_conn_status(status);
+}
+
+// This is called by the run loop thread at the end of each iteration.
+static void send_due_acks() {
+  if (acks_due == NULL) return;
+  array__for(ConnStatus **, status_ptr, acks_due, i) {
+    ConnStatus *status = *status_ptr;
+    Reliable *  rel    = status->reliable;
+    if (rel && rel->is_ack_due) {
+      char buffer[metadata_len + reliable_header_len];
+      msg_Data data = { .num_bytes = reliable_header_len,
+                        .bytes     = buffer + metadata_len };
+      ReliableHeader *rh = (ReliableHeader *)data.bytes;
+      memset(rh, 0, reliable_header_len);
+      set_ack_fields(rel, rh);
+      set_header(data, msg_type_ack, 0, reliable_header_len);
+      send_to_peer(status, data);
+    }
+    release_conn_status(status);
+  }
+  array__clear(acks_due);
+}
+
+static void deliver_reliable(msg_Conn *conn, ConnStatus *status,
+                             msg_Data data) {
+  Header *header = (Header *)(data.bytes - header_len);
+  msg_Event event = msg_message;
+  conn->reply_id  = 0;
+  if (header->message_type == msg_type_reply) {
+    event          = msg_reply;
+    conn->reply_id = header->reply_id;
+  }
+  send_message_callback(conn, status, event, data);
+}
+
+// Delivers, in seq order, the held messages that no longer wait for a gap.
+static void deliver_held_messages(msg_Conn *conn, ConnStatus *status) {
+  Reliable *rel = status->reliable;
+  while (true) {
+    HeldMessage *next = NULL;
+    array__for(HeldMessage *, held, rel->held, i) {
+      if ((uint16_t)(held->seq - rel->recv_next) < 0x8000) continue;
+      if (next == NULL || (uint16_t)(held->seq - next->seq) >= 0x8000) {
+        next = held;
+      }
+    }
+    if (next == NULL) return;
+    msg_Data data = next->data;
+    array__remove_item(rel->held, next);
+    deliver_reliable(conn, status, data);
+  }
+}
+
+// Handles a msg_type_reliable or msg_type_ack datagram whose body is given.
+static void read_reliable(msg_Conn *conn, Header *header, char *body) {
+  ConnStatus *status = remote_address_seen(conn);
+  if (header->num_bytes < reliable_header_len) return;
+  Reliable *rel = reliable_of(status);
+
+  ReliableHeader rh;
+  memcpy(&rh, body, reliable_header_len);
+  uint64_t ack_bits = ((uint64_t)ntohl(rh.ack_bits[1]) << 32) |
+                      ntohl(rh.ack_bits[0]);
+  handle_ack(status, ntohs(rh.ack), ack_bits);
+  if (header->message_type == msg_type_ack) return;
+
+  // Every reliable message is acked, even a duplicate, as the ack of the
+  // original may have been lost.
+  uint16_t seq    = ntohs(rh.seq);
+  uint16_t offset = seq - rel->recv_next;
+  mark_ack_due(status);
+  if (offset >= reliable_window)             return;  // Already received.
+  if ((rel->recv_bits >> offset) & 1)        return;  // Already received.
+  rel->recv_bits |= (uint64_t)1 << offset;
+
+  msg_Data data = new_inbound_data(header->num_bytes - reliable_header_len);
+  memcpy(data.bytes, body + reliable_header_len, data.num_bytes);
+  *(Header *)(data.bytes - header_len) = (Header) {
+    .message_type = ntohs(rh.message_type),
+    .reply_id     = header->reply_id,
+    .num_bytes    = (uint32_t)data.num_bytes };
+
+  int is_ordered = ntohs(rh.flags) & reliable_flag_ordered;
+  if (is_ordered && offset > 0) {
+    array__new_val(rel->held, HeldMessage) =
+        (HeldMessage) { .seq = seq, .data = data };
+  } else {
+    deliver_reliable(conn, status, data);
+  }
+
+  while (rel->recv_bits & 1) {
+    rel->recv_bits >>= 1;
+    rel->recv_next++;
+  }
+  deliver_held_messages(conn, status);
+}
+
+static void send_reliable(msg_Conn *conn, msg_Data data, int is_ordered) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "No known connection with %s",
+             address_as_str(address_of_conn(conn)));
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  Reliable *rel = reliable_of(status);
+
+  OutMessage out = { .seq = rel->next_seq++ };
+  out.datagram   = msg_new_data_space(reliable_header_len + data.num_bytes);
+  ReliableHeader *rh = (ReliableHeader *)out.datagram.bytes;
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  *rh = (ReliableHeader) {
+    .message_type = htons(msg_type),
+    .seq          = htons(out.seq),
+    .flags        = htons(is_ordered ? reliable_flag_ordered : 0) };
+  memcpy(out.datagram.bytes + reliable_header_len, data.bytes, data.num_bytes);
+  set_header(out.datagram, msg_type_reliable, conn->reply_id,
+             (uint32_t)out.datagram.num_bytes);
+
+  array__new_val(rel->out_messages, OutMessage) = out;
+  send_waiting_messages(status);
+  schedule_resend(status);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Pacing and congestion control.
+//
+// When max_send_rate is set, each udp peer gets a token bucket that datagrams
+// to it draw from. A datagram is sent at once while the bucket isn't in debt,
+// and otherwise waits in the peer's queue for a timer that sends it when the
+// bucket has refilled. The bucket holds at most pace_burst_time of sending,
+// so a burst leaves at the peer's rate instead of all at once.
+//
+// A peer's rate starts at max_send_rate, and reliable messages adjust it as
+// in tcp's AIMD: a resend halves it, at most once per round trip, and acked
+// bytes raise it by about one max_datagram_len per round trip each round
+// trip. Peers that only get unreliable messages give no feedback, so they're
+// paced at max_send_rate.
+
+#define pace_burst_time  (2 * msg_ms)
+#define min_send_rate    (16 * 1024)      // In bytes per second.
+#define max_paced_bytes  (1024 * 1024)    // Queued per peer before dropping.
+
+typedef struct {
+  char * bytes;
+  size_t num_bytes;
+} PacedDatagram;
+
+typedef struct Pacer {
+  double     send_rate;    // In bytes per second.
+  double     tokens;       // In bytes; negative while in debt.
+  int64_t    refilled_at;
+  int64_t    last_cut_at;  // When a loss last cut send_rate.
+  Array      queue;        // PacedDatagram items, oldest first.
+  size_t     num_queued_bytes;
+  msg_Timer *timer;        // Due when the queue's head may be sent.
+} Pacer;
+
+static size_t   max_send_rate    = 0;  // Zero means no pacing.
+static size_t   num_paced_bytes  = 0;  // Queued across all peers.
+static uint64_t num_pacing_drops = 0;
+
+static Pacer *pacer_of(ConnStatus *status) {
+  if (status->pacer) return status->pacer;
+  Pacer *pacer       = dbgcheck__calloc(sizeof(Pacer), "Pacer");
+  pacer->send_rate   = max_send_rate;
+  pacer->refilled_at = fresh_loop_now();
+  pacer->queue       = array__new(8, sizeof(PacedDatagram));
+  status->pacer      = pacer;
+  return pacer;
+}
+
+static void end_pacer(ConnStatus *status) {
+  Pacer *pacer = status->pacer;
+  if (pacer == NULL) return;
+  if (pacer->timer) cancel_timer(pacer->timer);
+  array__for(PacedDatagram *, paced, pacer->queue, i) {
+    dbgcheck__free(paced->bytes, "PacedDatagram bytes");
+  }
+  num_paced_bytes -= pacer->num_queued_bytes;
+  array__delete(pacer->queue);
+  dbgcheck__free(pacer, "Pacer");
+  status->pacer = NULL;
+}
+
+static void refill(Pacer *pacer) {
+  fresh_loop_now();
+  double burst   = pacer->send_rate * pace_burst_time / ns_per_sec;
+  pacer->tokens += pacer->send_rate * (loop_now - pacer->refilled_at) /
+                   ns_per_sec;
+  if (pacer->tokens > burst) pacer->tokens = burst;
+  pacer->refilled_at = loop_now;
+}
+
+static void pace_due(msg_Timer *timer);
+
+static void schedule_pace_timer(ConnStatus *status) {
+  Pacer *pacer = status->pacer;
+  if (pacer->timer || pacer->queue->count == 0) return;
+  int64_t wait = (int64_t)(-pacer->tokens * ns_per_sec / pacer->send_rate);
+  pacer->timer = new_timer(fresh_loop_now() + (wait > 0 ? wait : 0), 0,
+                           pace_due);
+  pacer->timer->status = retain_conn_status(status);
+}
+
+// Sends queued datagrams while the bucket allows it, or all of them if pacing
+// has been turned off.
+static void send_queued(ConnStatus *status) {
+  Pacer *pacer = status->pacer;
+  refill(pacer);
+  msg_Conn *conn = status->conn;
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  int num_sent = 0;
+  array__for(PacedDatagram *, paced, pacer->queue, i) {
+    if (max_send_rate && pacer->tokens < 0) break;
+    // A failed send is not reported; udp may drop the datagram anyway.
+    send_datagram_now(conn, paced->bytes, paced->num_bytes);
+    pacer->tokens           -= paced->num_bytes;
+    pacer->num_queued_bytes -= paced->num_bytes;
+    num_paced_bytes         -= paced->num_bytes;
+    dbgcheck__free(paced->bytes, "PacedDatagram bytes");
+    num_sent++;
+  }
+  *address_of_conn(conn) = saved_address;
+  // Shift the unsent datagrams to the front.
+  Array queue = pacer->queue;
+  memmove(queue->items, (char *)queue->items + num_sent * queue->item_size,
+          (queue->count - num_sent) * queue->item_size);
+  queue->count -= num_sent;
+  schedule_pace_timer(status);
+  check_watermarks(conn, status);
+}
+
+static void pace_due(msg_Timer *timer) {
+  ConnStatus *status   = timer->status;
+  status->pacer->timer = NULL;  // The timer is deleted after this call.
+  send_queued(status);
+}
+
+// Returns true if the datagram was queued or dropped for pacing; false if it
+// may be sent now, in which case it's been counted against the bucket.
+static int pace_datagram(msg_Conn *conn, char *bytes, size_t num_bytes) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || status->conn == NULL) return false;
+  Pacer *pacer = pacer_of(status);
+
+  if (pacer->queue->count == 0) {
+    refill(pacer);
+    if (pacer->tokens >= 0) {
+      pacer->tokens -= num_bytes;
+      return false;
+    }
+  }
+
+  if (pacer->num_queued_bytes + num_bytes > max_paced_bytes) {
+    num_pacing_drops++;
+    return true;
+  }
+  PacedDatagram paced = { .num_bytes = num_bytes };
+  paced.bytes = dbgcheck__malloc(num_bytes, "PacedDatagram bytes");
+  memcpy(paced.bytes, bytes, num_bytes);
+  array__new_val(pacer->queue, PacedDatagram) = paced;
+  pacer->num_queued_bytes += num_bytes;
+  num_paced_bytes         += num_bytes;
+  schedule_pace_timer(status);
+  check_watermarks(conn, status);
+  return true;
+}
+
+static int64_t rtt_of(ConnStatus *status) {
+  Reliable *rel = status->reliable;
+  return rel && rel->srtt ? rel->srtt : initial_rto;
+}
+
+static void note_acked_bytes(ConnStatus *status, size_t num_bytes) {
+  if (max_send_rate == 0) return;
+  Pacer *pacer = pacer_of(status);
+  // This adds max_datagram_len / rtt to the rate for each rtt of acks.
+  double rtt = (double)rtt_of(status) / ns_per_sec;
+  pacer->send_rate += max_datagram_len * num_bytes /
+                      (pacer->send_rate * rtt * rtt);
+  if (pacer->send_rate > max_send_rate) pacer->send_rate = max_send_rate;
+}
+
+static void note_loss(ConnStatus *status) {
+  if (max_send_rate == 0) return;
+  Pacer *pacer = pacer_of(status);
+  // Losses within a round trip are taken to be from the same congestion.
+  if (loop_now - pacer->last_cut_at < rtt_of(status)) return;
+  pacer->last_cut_at = loop_now;
+  pacer->send_rate  /= 2;
+  if (pacer->send_rate < min_send_rate) pacer->send_rate = min_send_rate;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Fault injection.
+//
+// msg_set_impairment makes the path to a udp peer act like a bad network, for
+// testing. Each datagram sent to the peer, after pacing, may be dropped or
+// duplicated, and each copy that's kept leaves once it's due: after the time
+// it waits behind earlier datagrams on a link capped at max_rate, if there is
+// a cap, plus the delay and a random jitter. Copies that aren't due yet wait
+// in the peer's queue, in due-time order, for a timer, so jitter can reorder
+// datagrams as it does on a real network. As in netem, a datagram picked for
+// reordering skips the delay and jitter, so it passes those queued ahead of
+// it. Datagrams received from the peer may be dropped, too.
+//
+// The random choices come from a generator per peer, seeded from the settings,
+// so a run that sends the same datagrams in the same order makes the same
+// choices. Impairing conn NULL impairs every udp peer, including those seen
+// later; each of those peers gets the seed plus the number impaired before it.
+
+#define max_impaired_bytes (1024 * 1024)  // Queued per peer before dropping.
+
+typedef struct {
+  int64_t due_at;
+  char *  bytes;
+  size_t  num_bytes;
+} DelayedDatagram;
+
+typedef struct Impairment {
+  msg_Impairment      settings;
+  uint64_t            random_state;
+  int64_t             link_free_at;  // When a capped link is next idle.
+  Array               queue;         // DelayedDatagram items, by due_at.
+  msg_Timer *         timer;         // Due when the queue's head is due.
+  msg_ImpairmentStats stats;
+} Impairment;
+
+static int                 is_impairment_used   = false;
+static int                 is_default_impaired  = false;
+static msg_Impairment      default_impairment;
+static uint64_t            num_default_impaired = 0;
+static msg_ImpairmentStats total_impairment_stats;
+
+// Counts an event for a peer and in the totals.
+#define count_impairment(impairment, field) \
+  ((impairment)->stats.field++, total_impairment_stats.field++)
+
+// This is splitmix64, which is small, fast, and fine for picking faults.
+static uint64_t next_random(Impairment *impairment) {
+  uint64_t z = (impairment->random_state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Returns true with probability rate. A rate of 0 draws no random number, so
+// turning on one kind of fault doesn't change the choices for the others.
+static int happens(Impairment *impairment, double rate) {
+  if (rate <= 0) return false;
+  return (next_random(impairment) >> 11) * 0x1.0p-53 < rate;
+}
+
+static int is_impairing(msg_Impairment *settings) {
+  return settings->loss_rate > 0 || settings->inbound_loss_rate > 0 ||
+         settings->duplicate_rate > 0 || settings->reorder_rate > 0 ||
+         settings->delay > 0 || settings->jitter > 0 || settings->max_rate;
+}
+
+static void send_due_datagrams(ConnStatus *status, int is_ending);
+
+static void end_impairment(ConnStatus *status) {
+  Impairment *impairment = status->impairment;
+  if (impairment == NULL) return;
+  if (impairment->timer) cancel_timer(impairment->timer);
+  array__for(DelayedDatagram *, delayed, impairment->queue, i) {
+    dbgcheck__free(delayed->bytes, "DelayedDatagram bytes");
+  }
+  total_impairment_stats.num_queued_bytes -= impairment->stats.num_queued_bytes;
+  array__delete(impairment->queue);
+  dbgcheck__free(impairment, "Impairment");
+  status->impairment = NULL;
+}
+
+// Sets the impairment of a udp peer. Datagrams already queued are sent at
+// once if the new settings don't impair anything.
+static void set_impairment(ConnStatus *status, msg_Impairment settings,
+                           uint64_t seed) {
+  Impairment *impairment = status->impairment;
+  if (!is_impairing(&settings)) {
+    if (impairment) send_due_datagrams(status, true);
+    return end_impairment(status);
+  }
+  is_impairment_used = true;
+  if (impairment == NULL) {
+    impairment        = dbgcheck__calloc(sizeof(Impairment), "Impairment");
+    impairment->queue = array__new(8, sizeof(DelayedDatagram));
+    status->impairment = impairment;
+  }
+  impairment->settings     = settings;
+  impairment->random_state = seed;
+}
+
+// This is called for each new udp peer.
+static void start_default_impairment(ConnStatus *status) {
+  if (!is_default_impaired) return;
+  uint64_t seed = default_impairment.seed + num_default_impaired++;
+  set_impairment(status, default_impairment, seed);
+}
+
+static void impairment_due(msg_Timer *timer);
+
+static void schedule_impairment_timer(ConnStatus *status) {
+  Impairment *impairment = status->impairment;
+  if (impairment->queue->count == 0) return;
+  DelayedDatagram *first = array__item_ptr(impairment->queue, 0);
+  int64_t due_at = first->due_at;
+  if (impairment->timer) {
+    if (impairment->timer->at == due_at) return;
+    cancel_timer(impairment->timer);
+  }
+  impairment->timer = new_timer(due_at, 0, impairment_due);
+  impairment->timer->status = retain_conn_status(status);
+}
+
+static char *send_datagram_to_socket(msg_Conn *conn, char *bytes,
+                                     size_t num_bytes);
+
+// Sends the queued datagrams that are due, or all of them if is_ending.
+static void send_due_datagrams(ConnStatus *status, int is_ending) {
+  Impairment *impairment = status->impairment;
+  msg_Conn *  conn       = status->conn;
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  int num_sent = 0;
+  array__for(DelayedDatagram *, delayed, impairment->queue, i) {
+    if (!is_ending && delayed->due_at > loop_now) break;
+    // A failed send is not reported; udp may drop the datagram anyway.
+    send_datagram_to_socket(conn, delayed->bytes, delayed->num_bytes);
+    impairment->stats.num_queued_bytes     -= delayed->num_bytes;
+    total_impairment_stats.num_queued_bytes -= delayed->num_bytes;
+    count_impairment(impairment, num_sent);
+    dbgcheck__free(delayed->bytes, "DelayedDatagram bytes");
+    num_sent++;
+  }
+  *address_of_conn(conn) = saved_address;
+  // Shift the unsent datagrams to the front.
+  Array queue = impairment->queue;
+  memmove(queue->items, (char *)queue->items + num_sent * queue->item_size,
+          (queue->count - num_sent) * queue->item_size);
+  queue->count -= num_sent;
+  schedule_impairment_timer(status);
+}
+
+static void impairment_due(msg_Timer *timer) {
+  ConnStatus *status        = timer->status;
+  status->impairment->timer = NULL;  // The timer is deleted after this call.
+  send_due_datagrams(status, false);
+}
+
+// Sends or queues one copy of a datagram.
+static void delay_datagram(msg_Conn *conn, ConnStatus *status, char *bytes,
+                           size_t num_bytes) {
+  Impairment *    impairment = status->impairment;
+  msg_Impairment *settings   = &impairment->settings;
+
+  int64_t due_at = loop_now;
+  if (settings->max_rate) {
+    if (impairment->link_free_at > due_at) due_at = impairment->link_free_at;
+    due_at += (int64_t)num_bytes * ns_per_sec / settings->max_rate;
+    impairment->link_free_at = due_at;
+  }
+  if (happens(impairment, settings->reorder_rate)) {
+    count_impairment(impairment, num_reordered);
+  } else {
+    due_at += settings->delay;
+    if (settings->jitter > 0) {
+      due_at += next_random(impairment) % (uint64_t)(settings->jitter + 1);
+    }
+  }
+
+  Array queue = impairment->queue;
+  if (due_at <= loop_now && queue->count == 0) {
+    send_datagram_to_socket(conn, bytes, num_bytes);
+    count_impairment(impairment, num_sent);
+    return;
+  }
+  if (impairment->stats.num_queued_bytes + num_bytes > max_impaired_bytes) {
+    count_impairment(impairment, num_dropped);
+    return;
+  }
+
+  // Datagrams usually arrive in due-time order, so search from the back.
+  int index = queue->count;
+  while (index > 0 &&
+         array__item_val(queue, index - 1, DelayedDatagram).due_at > due_at) {
+    index--;
+  }
+  DelayedDatagram delayed = { .due_at = due_at, .num_bytes = num_bytes };
+  delayed.bytes = dbgcheck__malloc(num_bytes, "DelayedDatagram bytes");
+  memcpy(delayed.bytes, bytes, num_bytes);
+  array__insert_items(queue, index, &delayed, 1);
+  impairment->stats.num_queued_bytes     += num_bytes;
+  total_impairment_stats.num_queued_bytes += num_bytes;
+  schedule_impairment_timer(status);
+}
+
+// Returns true if the datagram was taken by the peer's impairment, which
+// drops, queues, or sends it; false if it should be sent as usual.
+static int impair_datagram(msg_Conn *conn, char *bytes, size_t num_bytes) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || status->impairment == NULL) return false;
+  Impairment *impairment = status->impairment;
+  if (happens(impairment, impairment->settings.loss_rate)) {
+    count_impairment(impairment, num_dropped);
+    return true;
+  }
+  if (happens(impairment, impairment->settings.duplicate_rate)) {
+    count_impairment(impairment, num_duplicated);
+    delay_datagram(conn, status, bytes, num_bytes);
+  }
+  delay_datagram(conn, status, bytes, num_bytes);
+  return true;
+}
+
+// Returns true if a datagram just received from the conn's remote address
+// should be dropped. A new peer's first datagram is kept, as the peer has no
+// impairment until it's been seen.
+static int drops_inbound(msg_Conn *conn) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || status->impairment == NULL) return false;
+  Impairment *impairment = status->impairment;
+  if (!happens(impairment, impairment->settings.inbound_loss_rate)) {
+    return false;
+  }
+  count_impairment(impairment, num_inbound_dropped);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Heartbeats and idle eviction.
+//
+// Every udp peer in conn_status is also in the out_beats rotation, a list
+// ordered by next_beat_at. All peers share one interval, so a peer that's
+// rescheduled goes to the tail and the list stays in order. A single timer
+// fires when the head is due; each time, we visit only the peers that are
+// due. A peer that hasn't sent a message in idle_timeout ns is evicted, and
+// one we haven't heard from at all in lost_after ns is lost; both are
+// reported with msg_connection_lost. Other peers are sent a heartbeat. Any
+// message from a peer, including a heartbeat, updates its last_seen_at.
+//
+// Tcp peers don't need this, as the os tells us when a tcp peer is lost.
+
+// Heartbeats are off by default, as a peer built without them can't handle
+// one; an app turns them on with msg_set_heartbeat when its peers are ready.
+
+#define default_heartbeat_interval 0
+#define default_lost_after         (5 * ns_per_sec)
+
+static int64_t heartbeat_interval = default_heartbeat_interval;
+static int64_t lost_after         = default_lost_after;
+static int64_t idle_timeout       = 0;  // Zero when eviction is off.
+
+static uint64_t num_evicted_peers = 0;
+static uint64_t num_lost_peers    = 0;
+
+static ConnStatus *out_beats_head = NULL;  // The next peer due.
+static ConnStatus *out_beats_tail = NULL;
+
+static msg_Timer *beat_timer = NULL;  // Due when out_beats_head is due.
+
+// Returns how often each peer is visited, or 0 if peers aren't visited.
+static int64_t out_beats_interval() {
+  if (heartbeat_interval) return heartbeat_interval;
+  if (idle_timeout)       return idle_timeout / 4 + 1;
+  return 0;
+}
+
+static void beats_due(msg_Timer *timer);
+
+static void arm_beat_timer() {
+  if (beat_timer || out_beats_head == NULL) return;
+  beat_timer = new_timer(out_beats_head->next_beat_at, 0, beats_due);
+}
+
+static void append_beat(ConnStatus *status) {
+  status->next_beat_at = loop_now + out_beats_interval();
+  status->beat_prev = out_beats_tail;
+  status->beat_next = NULL;
+  if (out_beats_tail) out_beats_tail->beat_next = status;
+  else                out_beats_head            = status;
+  out_beats_tail = status;
+  status->is_in_out_beats = true;
+  arm_beat_timer();
+}
+
+static void unlink_beat(ConnStatus *status) {
+  if (status->beat_prev) status->beat_prev->beat_next = status->beat_next;
+  else                   out_beats_head               = status->beat_next;
+  if (status->beat_next) status->beat_next->beat_prev = status->beat_prev;
+  else                   out_beats_tail               = status->beat_prev;
+  status->beat_prev = status->beat_next = NULL;
+  status->is_in_out_beats = false;
+}
+
+static void join_out_beats(ConnStatus *status, msg_Conn *conn) {
+  status->conn = conn;
+  if (out_beats_interval()) append_beat(status);
+}
+
+static void leave_out_beats(ConnStatus *status) {
+  if (status->is_in_out_beats) unlink_beat(status);
+}
+
+static void send_heartbeat(ConnStatus *status) {
+  char buffer[header_len];
+  msg_Data data = { .num_bytes = 0, .bytes = buffer + header_len };
+  set_header(data, msg_type_heartbeat, 0, 0);
+
+  msg_Conn *conn = status->conn;
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  // A failed heartbeat is not reported; the peer will be lost if it's gone.
+  send_data(conn, data);
+  *address_of_conn(conn) = saved_address;
+}
+
+static void lose_peer(ConnStatus *status) {
+  msg_Conn *conn = status->conn;
+  int is_listening_udp = conn->for_listening;
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  local_disconnect(conn, msg_connection_lost);
+  // A non-listening conn is freed after the callback.
+  if (is_listening_udp) *address_of_conn(conn) = saved_address;
+}
+
+static void beats_due(msg_Timer *timer) {
+  beat_timer = NULL;  // The timer is deleted after this call.
+  int num_dropped = 0;
+  while (out_beats_head && out_beats_head->next_beat_at <= loop_now) {
+    ConnStatus *status = out_beats_head;
+    int is_idle = (idle_timeout &&
+                   loop_now - status->last_active_at >= idle_timeout);
+    int is_lost = (heartbeat_interval &&
+                   loop_now - status->last_seen_at >= lost_after);
+    if (is_idle || is_lost) {
+      if (is_idle) num_evicted_peers++;
+      else         num_lost_peers++;
+      lose_peer(status);  // This removes status from out_beats.
+      num_dropped++;
+      continue;
+    }
+    unlink_beat(status);
+    if (heartbeat_interval) send_heartbeat(status);
+    append_beat(status);
+  }
+  // Give back the memory of a map that held many more peers than it does now.
+  if (num_dropped) map__shrink(conn_status);
+  arm_beat_timer();
+}
+
+// Rebuilds out_beats after the heartbeat or eviction settings change.
+static void reset_out_beats() {
+  while (out_beats_head) unlink_beat(out_beats_head);
+  if (beat_timer) cancel_timer(beat_timer);
+  beat_timer = NULL;
+  map__for(pair, conn_status) {
+    ConnStatus *status = (ConnStatus *)pair->value;
+    if (status->conn) join_out_beats(status, status->conn);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Cross-thread posts.
+
+// Posts are pushed onto a lock-free multi-producer, single-consumer queue by
+// any thread, and popped by the run loop thread. The queue is intrusive with a
+// stub node, following Dmitry Vyukov's design. A producer follows each push by
+// signaling the wakeup fd, which is polled along with the conns, so a run loop
+// blocked in poll handles the post right away.
+
+// Besides msg_post and msg_post_send, posts carry the msgbox calls made by
+// callbacks running on worker threads.
+typedef enum {
+  post_type_fn,
+  post_type_send,
+  post_type_get,
+  post_type_disconnect,
+  post_type_unlisten,
+  post_type_listen,
+  post_type_connect,
+  post_type_set_streaming,
+  post_type_send_reliable,
+  post_type_set_coalescing,
+  post_type_flush,
+  post_type_send_zerocopy,
+  post_type_send_file,
+  post_type_add_timer,
+  post_type_cancel_timer,
+  post_type_set_heartbeat,
+  post_type_set_idle_timeout,
+  post_type_set_watermarks,
+  post_type_set_impairment,
+  post_type_set_default_impairment,
+  post_type_set_compression
+} PostType;
+
+typedef struct Post {
+  struct Post *next;
+  PostType     type;
+
+  msg_PostFn   fn;
+  void *       context;   // Also the reply_context or conn_context.
+
+  msg_Conn     conn;      // A snapshot of the conn at the time of the post.
+  msg_Data     data;
+
+  char *       address;   // Owned by the post; used to listen or connect.
+  msg_Callback callback;
+
+  int64_t      values[2];  // Number arguments, such as timeouts.
+} Post;
+
+static Post  post_stub;
+static Post *post_head = &post_stub;  // Producers push here.
+static Post *post_tail = &post_stub;  // The run loop pops from here.
+
+// This is set when a wakeup is signaled and cleared when the loop drains it,
+// so that a burst of posts costs a single write to the wakeup fd.
+static int wakeup_pending = false;
+
+// This is NULL until the run loop thread has set up the wakeup fd.
+static msg_Conn *wakeup_conn = NULL;
+
+static void push_post(Post *post) {
+  atomic_store_ptr(&post->next, NULL);
+  Post *prev = atomic_xchg_ptr(&post_head, post);
+  atomic_store_ptr(&prev->next, post);
+}
+
+// Returns NULL when the queue is empty, or when a producer is midway through
+// a push; in the latter case its signal will bring us back here.
+static Post *pop_post() {
+  Post *tail = post_tail;
+  Post *next = atomic_load_ptr(&tail->next);
+  if (tail == &post_stub) {
+    if (next == NULL) return NULL;
+    post_tail = tail = next;
+    next = atomic_load_ptr(&tail->next);
+  }
+  if (next) {
+    post_tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_ptr(&post_head)) return NULL;
+  push_post(&post_stub);
+  next = atomic_load_ptr(&tail->next);
+  if (next == NULL) return NULL;
+  post_tail = next;
+  return tail;
+}
+
+static void add_post(Post *post) {
+  push_post(post);
+  if (atomic_load_ptr(&wakeup_conn) &&
+      !atomic_xchg_int(&wakeup_pending, true)) {
+    signal_wakeup_fd();
+  }
+}
+
+static void open_wakeup_conn() {
+  int fd = open_wakeup_fd();
+  if (fd == -1) {
+    // Posts still work in this case, but they wait for the next loop cycle.
+    fprintf(stderr, "Internal msgbox error setting up wakeup fd: %s\n",
+            err_str());
+    return;
+  }
+  msg_Conn *conn = new_connection(msg_no_context, NULL);
+  conn->socket   = fd;
+  conn->index    = conns->count;
+  array__add_item_val(conns, conn);
+  add_to_poll_fds(fd, poll_mode_read);
+  atomic_store_ptr(&wakeup_conn, conn);
+}
+
+// Returns true if the live conn could be the conn that snapshot was copied
+// from. A snapshot of a listening udp conn may hold any remote address.
+static int conn_matches_snapshot(msg_Conn *conn, msg_Conn *snapshot) {
+  if (conn->socket        != snapshot->socket        ||
+      conn->protocol_type != snapshot->protocol_type ||
+      conn->for_listening != snapshot->for_listening) {
+    return false;
+  }
+  if (conn->for_listening && conn->protocol_type == msg_udp) return true;
+  return address_eq(address_of_conn(conn), address_of_conn(snapshot));
+}
+
+// Returns the conn in conns that snapshot was copied from, or NULL if that
+// conn has since been closed. This never dereferences a possibly-freed conn.
+static msg_Conn *find_live_conn(msg_Conn *snapshot) {
+  int index = snapshot->index;
+  if (0 <= index && index < conns->count) {
+    msg_Conn *conn = array__item_val(conns, index, msg_Conn *);
+    if (conn_matches_snapshot(conn, snapshot)) return conn;
+  }
+  // The conn may have moved since the snapshot was taken.
+  array__for(msg_Conn **, conn_ptr, conns, i) {
+    if (conn_matches_snapshot(*conn_ptr, snapshot)) return *conn_ptr;
+  }
+  return NULL;
+}
+
+// The bytes of a posted msg_Impairment may not be aligned for it.
+static msg_Impairment posted_impairment(Post *post) {
+  msg_Impairment impairment;
+  memcpy(&impairment, post->data.bytes, sizeof(msg_Impairment));
+  return impairment;
+}
+
+static void run_post_on_conn(Post *post) {
+  msg_Conn *conn = find_live_conn(&post->conn);
+  if (conn == NULL) return;  // The conn was closed after the post.
+
+  // Act with the snapshot's remote address and reply_id, which may differ
+  // from the live conn's on a listening udp conn.
+  Address  saved_address  = *address_of_conn(conn);
+  uint16_t saved_reply_id = conn->reply_id;
+  *address_of_conn(conn)  = *address_of_conn(&post->conn);
+  conn->reply_id          = post->conn.reply_id;
+  switch (post->type) {
+    case post_type_send:       msg_send(conn, post->data);                break;
+    case post_type_get:        msg_get(conn, post->data, post->context);  break;
+    case post_type_disconnect: msg_disconnect(conn);                      break;
+    case post_type_unlisten:   msg_unlisten(conn);                        break;
+    case post_type_set_streaming:
+      msg_set_streaming(conn, (int)(intptr_t)post->context);
+      break;
+    case post_type_send_reliable:
+      msg_send_reliable(conn, post->data, (int)(intptr_t)post->context);
+      break;
+    case post_type_set_coalescing:
+      msg_set_coalescing(conn, (int)(intptr_t)post->context);
+      break;
+    case post_type_flush: msg_flush(conn); break;
+    case post_type_send_zerocopy:
+      msg_send_zerocopy(conn, post->data);
+      post->data.bytes = NULL;  // msg_send_zerocopy owns it now.
+      break;
+    case post_type_send_file: {
+      FileSend *file = (FileSend *)post->data.bytes;
+      msg_send_file(conn, file->fd, file->offset, file->num_left);
+      break;
+    }
+    case post_type_set_watermarks:
+      msg_set_watermarks(conn, (size_t)post->values[0],
+                         (size_t)post->values[1]);
+      break;
+    case post_type_set_impairment:
+      msg_set_impairment(conn, posted_impairment(post));
+      break;
+    case post_type_set_compression:
+      msg_set_compression(conn, (size_t)post->values[0]);
+      break;
+    default:
+      break;
+  }
+  // A disconnected conn is freed after its last callback, so this is safe.
+  *address_of_conn(conn)  = saved_address;
+  conn->reply_id          = saved_reply_id;
+}
+
+// A timer added by a worker holds its delay in at until it joins the heap.
+static void start_posted_timer(msg_Timer *timer) {
+  if (timer->is_canceled) return delete_timer(timer);
+  timer->at += fresh_loop_now();
+  heap_push(timer);
+}
+
+// This is called by the run loop thread once per cycle.
+static void run_posts(int wakeup_was_signaled) {
+  if (wakeup_was_signaled) {
+    // Clear the flag before popping so any later post signals again.
+    atomic_store_int(&wakeup_pending, false);
+    drain_wakeup_fd();
+  }
+  Post *post;
+  while ((post = pop_post())) {
+    switch (post->type) {
+      case post_type_fn:
+        post->fn(post->context);
+        break;
+      case post_type_listen:
+        msg_listen(post->address, post->callback);
+        break;
+      case post_type_connect:
+        msg_connect(post->address, post->callback, post->context);
+        break;
+      case post_type_add_timer:
+        start_posted_timer((msg_Timer *)post->context);
+        break;
+      case post_type_cancel_timer:
+        cancel_timer((msg_Timer *)post->context);
+        break;
+      case post_type_set_heartbeat:
+        msg_set_heartbeat(post->values[0], post->values[1]);
+        break;
+      case post_type_set_idle_timeout:
+        msg_set_idle_timeout(post->values[0]);
+        break;
+      case post_type_set_default_impairment:
+        msg_set_impairment(NULL, posted_impairment(post));
+        break;
+      default:
+        run_post_on_conn(post);
+        break;
+    }
+    if (post->type == post_type_send_file) {
+      close_file(((FileSend *)post->data.bytes)->fd);
+    }
+    if (post->data.bytes) msg_delete_data(post->data);
+    if (post->address) dbgcheck__free(post->address, "Post address");
+    dbgcheck__free(post, "Post");
+  }
+}
+
+// Callbacks on worker threads make their msgbox calls through these functions,
+// which hand the call to the run loop thread. Any data is copied, as the
+// caller still owns it.
+static Post *new_worker_post(PostType type, msg_Conn *conn, msg_Data data,
+                             void *context) {
+  Post *post    = dbgcheck__calloc(sizeof(Post), "Post");
+  post->type    = type;
+  post->context = context;
+  if (conn) post->conn = *conn;
+  if (data.bytes) {
+    post->data = msg_new_data_space(data.num_bytes);
+    memcpy(post->data.bytes, data.bytes, data.num_bytes);
+  }
+  return post;
+}
+
+static void post_from_worker(PostType type, msg_Conn *conn, msg_Data data,
+                             void *context) {
+  add_post(new_worker_post(type, conn, data, context));
+}
+
+static void post_values_from_worker(PostType type, msg_Conn *conn,
+                                    int64_t value0, int64_t value1) {
+  Post *post      = new_worker_post(type, conn, msg_no_data, NULL);
+  post->values[0] = value0;
+  post->values[1] = value1;
+  add_post(post);
+}
+
+static void post_open_from_worker(PostType type, const char *address,
+                                  msg_Callback callback, void *conn_context) {
+  Post *post     = dbgcheck__calloc(sizeof(Post), "Post");
+  post->type     = type;
+  post->address  = dbgcheck__malloc(strlen(address) + 1, "Post address");
+  strcpy(post->address, address);
+  post->callback = callback;
+  post->context  = conn_context;
+  add_post(post);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Worker threads.
+//
+// After msg_use_workers(n) with n > 0, the run loop thread still does all
+// socket i/o and framing, but it hands each PendingCall to a pool of worker
+// threads. A call goes to the strand of its peer's ConnStatus - calls with no
+// known peer share the misc strand - and only one worker at a time runs a
+// given strand, so the callbacks for each peer are made serially and in order.
+// Ready strands wait in per-worker deques; an idle worker steals from others.
+//
+// Callbacks on workers see a copy of their msg_Conn. The msgbox calls they make
+// are posted back to the run loop thread.
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+typedef struct StrandItem {
+  struct StrandItem *next;
+  PendingCall        call;
+  msg_Conn           conn;  // The callback is given this copy of *call.conn.
+} StrandItem;
+
+struct Strand {
+  pthread_mutex_t mutex;
+  StrandItem *    head;
+  StrandItem *    tail;
+  int             is_scheduled;  // True while in a deque or being run.
+  ConnStatus *    status;        // NULL for the misc strand.
+};
+
+typedef struct {
+  pthread_t       thread;
+  pthread_mutex_t mutex;
+  Array           ready;  // Strand * items; the owner pops from the end.
+} Worker;
+
+static Worker *workers     = NULL;
+static int     num_workers = 0;
+static int     next_worker = 0;  // Where the run loop pushes the next strand.
+
+// Idle workers wait on idle_cond until there's a ready strand.
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  idle_cond  = PTHREAD_COND_INITIALIZER;
+static int num_ready_strands = 0;      // Guarded by idle_mutex.
+static int workers_stopping  = false;  // Guarded by idle_mutex.
+
+static Strand misc_strand = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static Strand *new_strand(ConnStatus *status) {
+  Strand *strand = dbgcheck__calloc(sizeof(Strand), "Strand");
+  pthread_mutex_init(&strand->mutex, NULL);
+  strand->status = status;
+  return strand;
+}
 
-  return true;
+static void delete_strand(Strand *strand) {
+  pthread_mutex_destroy(&strand->mutex);
+  dbgcheck__free(strand, "Strand");
 }
 
-typedef int (ms_call_conv *SocketOpener)(socket_t,
-                                         const struct sockaddr *,
-                                         socklen_t);
+static void push_ready_strand(Strand *strand, int worker_index) {
+  Worker *worker = &workers[worker_index];
+  dbgcheck__lock(&worker->mutex);
+  array__add_item_val(worker->ready, strand);
+  dbgcheck__unlock(&worker->mutex);
 
-static void open_socket(const char *address, void *conn_context,
-    msg_Callback callback, int for_listening) {
-  init_if_needed();
+  dbgcheck__lock(&idle_mutex);
+  num_ready_strands++;
+  pthread_cond_signal(&idle_cond);
+  dbgcheck__unlock(&idle_mutex);
+}
 
-  msg_Conn *conn = new_connection(conn_context, callback);
-  conn->for_listening = for_listening;
-  struct sockaddr_in *sockaddr = alloca(sock_in_size);
-  if (!setup_sockaddr(sockaddr, address, conn)) {
-    return;  // Error; setup_sockaddr now owns conn.
+// Returns NULL if no strand is ready. A worker takes the newest strand from
+// its own deque, and otherwise steals the oldest strand from another's.
+static Strand *take_ready_strand(int worker_index) {
+  Strand *strand = NULL;
+  for (int i = 0; i < num_workers && strand == NULL; ++i) {
+    Worker *worker = &workers[(worker_index + i) % num_workers];
+    dbgcheck__lock(&worker->mutex);
+    Array ready = worker->ready;
+    if (ready->count) {
+      int index = (i == 0) ? ready->count - 1 : 0;
+      strand = array__item_val(ready, index, Strand *);
+      array__remove_and_fill(ready, index);
+    }
+    dbgcheck__unlock(&worker->mutex);
   }
+  if (strand) {
+    dbgcheck__lock(&idle_mutex);
+    num_ready_strands--;
+    dbgcheck__unlock(&idle_mutex);
+  }
+  return strand;
+}
 
-  // Make the socket non-blocking so a connect call won't block.
-  const char *failing_fn = make_non_blocking(conn->socket);
-  if (failing_fn) {
-    send_callback_os_error(conn, failing_fn, conn, "msg_Conn");
-    return remove_last_polling_conn();
+static void run_strand(Strand *strand, int worker_index) {
+  dbgcheck__lock(&strand->mutex);
+  StrandItem *item = strand->head;
+  strand->head = strand->tail = NULL;
+  dbgcheck__unlock(&strand->mutex);
+
+  while (item) {
+    StrandItem *next = item->next;
+    item->call.conn = &item->conn;
+    make_call(&item->call);
+    dbgcheck__free(item, "StrandItem");
+    item = next;
   }
 
-  // On tcp, turn on SO_REUSEADDR for easier server restarts.
-  if (conn->protocol_type == msg_tcp) {
-    int optval = 1;
-    // Send (char *)&optval as windows takes a char*; mac/linux takes a void*.
-    setsockopt(conn->socket, SOL_SOCKET, SO_REUSEADDR,
-               (char *)&optval, sizeof(optval));
+  // Calls added while we ran keep the strand scheduled on this worker.
+  dbgcheck__lock(&strand->mutex);
+  int has_more = (strand->head != NULL);
+  strand->is_scheduled = has_more;
+  dbgcheck__unlock(&strand->mutex);
+
+  if (has_more) {
+    push_ready_strand(strand, worker_index);
+  } else {
+    release_conn_status(strand->status);
   }
+}
 
-  char *sys_call_name = for_listening ? "bind" : "connect";
-  SocketOpener sys_open_sock = for_listening ? bind : connect;
-  int ret_val = sys_open_sock(conn->socket,
-                              (struct sockaddr *)sockaddr,
-                              sock_in_size);
-  if (ret_val == -1) {
-    int in_progress = (get_errno() == err_in_progress ||
-                       get_errno() == err_would_block);
-    if (!for_listening && conn->protocol_type == msg_tcp && in_progress) {
-      // Being in progress is ok in this case; we'll send
-      // msg_connection_ready later.
-      set_conn_to_poll_mode(conns->count - 1, poll_mode_write);
-      return;
+static void *worker_main(void *worker_index_vp) {
+  int worker_index = (int)(intptr_t)worker_index_vp;
+  is_worker_thread = true;
+  while (true) {
+    Strand *strand = take_ready_strand(worker_index);
+    if (strand) {
+      run_strand(strand, worker_index);
+      continue;
     }
-    send_callback_os_error(conn, sys_call_name, conn, "msg_Conn");
-    return remove_last_polling_conn();
+    dbgcheck__lock(&idle_mutex);
+    while (num_ready_strands <= 0 && !workers_stopping) {
+      pthread_cond_wait(&idle_cond, &idle_mutex);
+    }
+    // Stopping workers finish all queued calls first.
+    int is_done = (num_ready_strands <= 0 && workers_stopping);
+    dbgcheck__unlock(&idle_mutex);
+    if (is_done) return NULL;
   }
+}
 
-  if (for_listening) {
-    if (conn->protocol_type == msg_tcp) {
-      ret_val = listen(conn->socket, SOMAXCONN);
-      if (ret_val == -1) {
-        send_callback_os_error(conn, "listen", conn, "msg_Conn");
-        return remove_last_polling_conn();
-      }
+// This is called by the run loop thread in place of make_call when there are
+// workers. A tcp call with no status is ordered with the rest of its peer's
+// calls when the peer is known.
+static void dispatch_call(PendingCall *call) {
+  if (call->status == NULL && call->conn->protocol_type == msg_tcp) {
+    call->status = retain_conn_status(status_of_conn(call->conn));
+  }
+  ConnStatus *status = call->status;
+  Strand *strand = &misc_strand;
+  if (status) {
+    if (status->strand == NULL) status->strand = new_strand(status);
+    strand = status->strand;
+  }
+
+  StrandItem *item = dbgcheck__malloc(sizeof(StrandItem), "StrandItem");
+  item->next = NULL;
+  item->call = *call;
+  item->conn = *call->conn;
+
+  dbgcheck__lock(&strand->mutex);
+  if (strand->tail) strand->tail->next = item;
+  else              strand->head       = item;
+  strand->tail = item;
+  int needs_scheduling = !strand->is_scheduled;
+  strand->is_scheduled = true;
+  dbgcheck__unlock(&strand->mutex);
+
+  if (needs_scheduling) {
+    // A scheduled strand keeps its status, and so itself, alive.
+    retain_conn_status(status);
+    push_ready_strand(strand, next_worker);
+    next_worker = (next_worker + 1) % num_workers;
+  }
+}
+
+static void stop_workers() {
+  dbgcheck__lock(&idle_mutex);
+  workers_stopping = true;
+  pthread_cond_broadcast(&idle_cond);
+  dbgcheck__unlock(&idle_mutex);
+
+  // A worker may still steal from the others' deques until it's joined, so
+  // they're all joined before any deque goes away.
+  for (int i = 0; i < num_workers; ++i) pthread_join(workers[i].thread, NULL);
+  for (int i = 0; i < num_workers; ++i) {
+    pthread_mutex_destroy(&workers[i].mutex);
+    array__delete(workers[i].ready);
+  }
+  dbgcheck__free(workers, "Worker");
+  workers     = NULL;
+  num_workers = 0;
+  next_worker = 0;
+  workers_stopping = false;
+}
+
+// Returns no_error (NULL) on success, and an error string otherwise.
+static const char *start_workers(int n) {
+  workers = dbgcheck__calloc(n * sizeof(Worker), "Worker");
+  for (int i = 0; i < n; ++i) {
+    pthread_mutex_init(&workers[i].mutex, NULL);
+    workers[i].ready = array__new(8, sizeof(Strand *));
+    void *worker_index_vp = (void *)(intptr_t)i;
+    if (pthread_create(&workers[i].thread, NULL, worker_main,
+                       worker_index_vp)) {
+      pthread_mutex_destroy(&workers[i].mutex);
+      array__delete(workers[i].ready);
+      stop_workers();
+      return "pthread_create";
     }
-    send_callback(conn, msg_listening, msg_no_data, free_nothing, no_set_name);
-  } else {
-    remote_address_seen(conn);  // Sends the msg_connection_ready event.
+    num_workers = i + 1;
   }
+  return no_error;
+}
+
+#else
+
+// windows versions
+
+static int num_workers = 0;
+
+static void delete_strand(Strand *strand) {}
+
+static void dispatch_call(PendingCall *call) {}
+
+static void stop_workers() {}
+
+static const char *start_workers(int n) {
+  return "msg_use_workers (not yet supported on windows)";
 }
 
+#endif
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Public functions.
 
 void msg_runloop(int timeout_in_ms) {
   init_if_needed();
+  runloop_depth++;
+  update_loop_now();
 
-  // Don't delay pending calls.
+  // Don't delay pending calls, and wake up in time for the next timer.
+  timeout_in_ms = timer_poll_timeout(timeout_in_ms);
   if (immediate_callbacks->count) { timeout_in_ms = 0; }
 
   // Clear any conns marked for removal. Public functions work this way so
@@ -1385,8 +5995,12 @@ void msg_runloop(int timeout_in_ms) {
   }
   // End debug code.
 
+  // With no sockets, polling still works as a sleep until the next timer.
+  // The wakeup conn alone is not a reason to block.
+  int num_user_fds = num_fds - (wakeup_conn ? 1 : 0);
   int ret = 0;
-  if (num_fds) ret = check_poll_fds(timeout_in_ms);
+  int wakeup_was_signaled = false;
+  if (num_user_fds || timer_heap->count) ret = check_poll_fds(timeout_in_ms);
 
   if (ret == -1) {
     // It's difficult to send a standard error callback to the user here because
@@ -1405,6 +6019,11 @@ void msg_runloop(int timeout_in_ms) {
       msg_Conn *conn = *conn_ptr;
       PollMode poll_mode = poll_fds_mode(conn->socket, i);
 
+      if (conn == wakeup_conn) {
+        wakeup_was_signaled = (poll_mode & poll_mode_read);
+        continue;
+      }
+
       // I'm including these since I'm not sure how important they are to track.
       if (verbosity >= 1) {
         if (poll_mode & poll_mode_err) {
@@ -1414,6 +6033,11 @@ void msg_runloop(int timeout_in_ms) {
         }
       }
       if (poll_mode & poll_mode_err) {
+        ConnStatus *status = status_of_conn(conn);
+        if (status && status->zc_sends) {
+          read_zerocopy_completions(conn, status);
+        }
+
         int error;
         socklen_t error_len = sizeof(error);
         // Send in (char *)&error as windows takes type char*; mac/linux
@@ -1432,10 +6056,16 @@ void msg_runloop(int timeout_in_ms) {
         // from trying to send something to a remotely closed connection.
       }
       if (poll_mode & poll_mode_write) {
-        // We only listen for this event when waiting for a tcp connect to
-        // complete.
-        remote_address_seen(conn);  // Sends msg_connection_ready.
-        set_conn_to_poll_mode(i, poll_mode_read);
+        // We listen for this event when a tcp conn has queued bytes, or when
+        // waiting for a tcp connect to complete, in which case there's no
+        // status yet.
+        ConnStatus *status = status_of_conn(conn);
+        if (status) {
+          send_queued_outbound(conn, status);
+        } else {
+          remote_address_seen(conn);  // Sends msg_connection_ready.
+          set_conn_to_poll_mode(i, poll_mode_read);
+        }
       }
       if (poll_mode & poll_mode_read) {
         // TODO Why are the two params to read_from_socket separate, since
@@ -1447,55 +6077,57 @@ void msg_runloop(int timeout_in_ms) {
     array__clear(removals);
   }
 
-  // Check for any unreplied-to udp requests that have timed out.
-  double time_now = now();
-  array__for(Timeout *, timeout, timeouts, i) {
-    // The timeouts are soonest-first; stop as soon as one is not in the past.
-    if (timeout->at > time_now) break;
-
-    // Remove the pending status information and inform the user of the timeout.
-    void *reply_id_key = (void *)(intptr_t)timeout->reply_id;
-    map__key_value *pair = map__get(timeout->status->reply_contexts,
-                                    reply_id_key);
-    // Since we set up the timeout ourselves, it should exist in the status.
-    assert(pair);
-    msg_Conn *conn = timeout->conn;  // Save conn as timeout will soon be freed.
-    conn->reply_context = pair->value;
-    map__unset(timeout->status->reply_contexts, reply_id_key);
-    array__remove_item(timeouts, timeout);
-    i--;  // Back up one item so the next iteration gets the next item.
-    const char *msg = (conn->protocol_type == msg_tcp ? "tcp get timed out" :
-                                                        "udp get timed out");
-    
-    // Set up metadata as it overrides data in conn within make_call.
-    msg_Data data = msg_new_data(msg);
-    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->reply_context  = conn->reply_context;
-    metadata->remote_address = timeout->status->remote_address;
-
-    send_callback(conn, msg_error, data, free_nothing, no_set_name);
-  }
+  // Handle anything sent to us from other threads.
+  run_posts(wakeup_was_signaled);
+
+  // Fire app timers and report any unreplied-to requests that have timed out.
+  update_loop_now();
+  run_due_timers();
 
   // Save the state of pending callbacks so that users can add new callbacks
-  // from within their callbacks.
+  // from within their callbacks. The two arrays trade places each iteration.
   Array saved_immediate_callbacks = immediate_callbacks;
-  immediate_callbacks = array__new(16, sizeof(PendingCall));
+  immediate_callbacks = spare_callbacks;
+  spare_callbacks     = NULL;
+  if (immediate_callbacks == NULL) {
+    immediate_callbacks = array__new(16, sizeof(PendingCall));
+  }
 
   array__for(PendingCall *, call, saved_immediate_callbacks, i) {
-    make_call(call);
+    if (num_workers) dispatch_call(call);
+    else             make_call(call);
+  }
+
+  // A callback may have run a nested loop that already refilled the spare.
+  if (spare_callbacks) {
+    array__delete(saved_immediate_callbacks);
+  } else {
+    array__clear(saved_immediate_callbacks);
+    spare_callbacks = saved_immediate_callbacks;
   }
 
-  // TODO Handle timed callbacks - such as heartbeats - and get timeouts.
-  array__delete(saved_immediate_callbacks);
+  send_due_flushes();
+  send_due_acks();
+  release_shm_records();
+  free_unused_local_ids();
+  rewind_arena();
+  runloop_depth--;
 }
 
 void msg_listen(const char *address, msg_Callback callback) {
+  if (is_worker_thread) {
+    return post_open_from_worker(post_type_listen, address, callback, NULL);
+  }
   int for_listening = true;
   open_socket(address, msg_no_context, callback, for_listening);
 }
 
 void msg_connect(const char *address, msg_Callback callback,
                  void *conn_context) {
+  if (is_worker_thread) {
+    return post_open_from_worker(post_type_connect, address, callback,
+                                 conn_context);
+  }
   int for_listening = false;
   open_socket(address, conn_context, callback, for_listening);
 }
@@ -1505,12 +6137,22 @@ void msg_unlisten(msg_Conn *conn) {
     fprintf(stderr, "Error: msg_unlisten called on NULL connection.\n");
     return;
   }
+  if (is_worker_thread) {
+    return post_from_worker(post_type_unlisten, conn, msg_no_data, NULL);
+  }
   if (!conn->for_listening) {
     const char *err_str = "msg_unlisten called on non-listening connection";
     return send_callback_error(conn, err_str, free_nothing, no_set_name);
   }
   // Tell local_disconnect to free the conn object, even on udp.
   conn->for_listening = false;
+  if (is_mem_address(address_of_conn(conn))) {
+    unlisten_mem(conn);
+    return local_disconnect(conn, msg_listening_ended);
+  }
+  // A local conn's id is released here, as a unixgram:// conn's remote
+  // address is that of its latest peer by now.
+  if (unbind_local_socket(conn->socket)) conn->remote_ip = 0;
   if (closesocket(conn->socket) == -1) {
     int saved_errno = get_errno();
     // TODO Make the fn name here more accurate (it's close on mac/linux and
@@ -1524,7 +6166,15 @@ void msg_unlisten(msg_Conn *conn) {
 }
 
 void msg_disconnect(msg_Conn *conn) {
-  msg_Data data = msg_new_data_space(0);
+  if (is_worker_thread) {
+    return post_from_worker(post_type_disconnect, conn, msg_no_data, NULL);
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (status && status->close_timer) return;  // It's already closing.
+  // Packed messages go out ahead of the close.
+  if (conn->protocol_type == msg_udp && status) send_pack(status);
+
+  msg_Data data = new_transient_data(0);
   int num_bytes = 0, reply_id = 0;
   set_header(data, msg_type_close, reply_id, num_bytes);
 
@@ -1533,21 +6183,117 @@ void msg_disconnect(msg_Conn *conn) {
                                               free_nothing, no_set_name);
   msg_delete_data(data);
 
+  if (conn->protocol_type == msg_tcp && status && start_closing(conn, status)) {
+    return;
+  }
   local_disconnect(conn, msg_connection_closed);
 }
 
 void msg_send(msg_Conn *conn, msg_Data data) {
+  if (is_worker_thread) {
+    return post_from_worker(post_type_send, conn, data, NULL);
+  }
   // Set up the header.
   int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
   set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
 
+  char *failed_sys_call = send_compressible(conn, data);
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+}
+
+void msg_send_zerocopy(msg_Conn *conn, msg_Data data) {
+  if (is_worker_thread) {
+    // The post takes the data itself rather than a copy.
+    Post *post = dbgcheck__calloc(sizeof(Post), "Post");
+    post->type = post_type_send_zerocopy;
+    post->conn = *conn;
+    post->data = data;
+    return add_post(post);
+  }
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
+
+  ConnStatus *status = NULL;
+  if (conn->protocol_type == msg_tcp) status = status_of_conn(conn);
+  if (status && !status->is_coalescing && !status->is_shm &&
+      !status->mem_peer && send_zerocopy(conn, status, data)) {
+    return;
+  }
   char *failed_sys_call = send_data(conn, data);
   if (failed_sys_call) {
     send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
   }
+  msg_delete_data(data);
+}
+
+void msg_send_file(msg_Conn *conn, int fd, int64_t offset, size_t num_bytes) {
+  if (is_worker_thread) {
+    // The post carries the file range and its own dup of fd, which run_posts
+    // closes.
+    FileSend file = { .fd = dup_file(fd), .offset = offset,
+                      .num_left = num_bytes };
+    msg_Data data = { .num_bytes = sizeof(file), .bytes = (char *)&file };
+    return post_from_worker(post_type_send_file, conn, data, NULL);
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (conn->protocol_type != msg_tcp || status == NULL) {
+    return send_callback_error(conn, "msg_send_file needs a connected tcp conn",
+                               free_nothing, no_set_name);
+  }
+  int64_t size = file_size(fd);
+  if (size == -1) {
+    return send_callback_os_error(conn, "fstat", free_nothing, no_set_name);
+  }
+  if (offset < 0 || offset > size || num_bytes > (uint64_t)(size - offset) ||
+      num_bytes > UINT32_MAX) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "msg_send_file: bad range %" PRId64 "+%zu for a "
+             "file of %" PRId64 " bytes", offset, num_bytes, size);
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  if (status->is_shm || status->mem_peer) {
+    return send_file_as_message(conn, fd, offset, num_bytes);
+  }
+  // Keep a dup so that the caller may close fd right away.
+  int file_fd = dup_file(fd);
+  if (file_fd == -1) {
+    return send_callback_os_error(conn, "dup", free_nothing, no_set_name);
+  }
+
+  msg_Data header = new_transient_data(0);
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  set_header(header, msg_type, conn->reply_id, (uint32_t)num_bytes);
+  char *failed_sys_call = send_tcp(conn, header);
+  msg_delete_data(header);
+  if (failed_sys_call) {
+    close_file(file_fd);
+    return send_callback_os_error(conn, failed_sys_call, free_nothing,
+                                  no_set_name);
+  }
+  queue_file_send(conn, status, file_fd, offset, num_bytes);
+}
+
+void msg_send_reliable(msg_Conn *conn, msg_Data data, int is_ordered) {
+  if (is_worker_thread) {
+    void *context = (void *)(intptr_t)is_ordered;
+    return post_from_worker(post_type_send_reliable, conn, data, context);
+  }
+  // Tcp is already reliable and ordered.
+  if (conn->protocol_type == msg_tcp) return msg_send(conn, data);
+  // A peer that can't read reliable messages gets a plain one.
+  ConnStatus *status = status_of_conn(conn);
+  if (status && !peer_can(status, msg_cap_reliable)) {
+    return msg_send(conn, data);
+  }
+  send_reliable(conn, data, is_ordered);
 }
 
 void msg_get(msg_Conn *conn, msg_Data data, void *reply_context) {
+  if (is_worker_thread) {
+    return post_from_worker(post_type_get, conn, data, reply_context);
+  }
   // Look up the next reply id.
   ConnStatus *status = status_of_conn(conn);
   if (status == NULL) {
@@ -1557,16 +6303,16 @@ void msg_get(msg_Conn *conn, msg_Data data, void *reply_context) {
     return send_callback_error(conn, err_msg, free_nothing, no_set_name);
   }
   uint16_t reply_id = status->next_reply_id++;
-  map__set(status->reply_contexts, (void *)(intptr_t)reply_id, reply_context);
 
   // Set up the header.
   set_header(data, msg_type_request, reply_id, (uint32_t)data.num_bytes);
 
-  char *failed_sys_call = send_data(conn, data);
+  char *failed_sys_call = send_compressible(conn, data);
   if (failed_sys_call) {
     send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
   } else {
-    add_timeout(conn, status, reply_id);
+    msg_Timer *timer = add_timeout(conn, status, reply_id, reply_context);
+    map__set(status->pending_gets, (void *)(intptr_t)reply_id, timer);
   }
 }
 
@@ -1588,15 +6334,29 @@ msg_Data msg_new_data_space(size_t num_bytes) {
   msg_Data data = {.num_bytes = num_bytes,
                    .bytes     = dbgcheck__malloc(num_bytes + metadata_len,
                                                  "msg_Data bytes")};
+  // Callbacks read reply_context from here, so it must never be garbage.
+  Metadata *metadata      = (Metadata *)data.bytes;
+  metadata->reply_context = NULL;
+  metadata->alloc_kind    = alloc_kind_heap;
   data.bytes += metadata_len;
   return data;
 }
 
 void msg_delete_data(msg_Data data) {
-  dbgcheck__free(data.bytes - metadata_len, "msg_Data bytes");
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  if (metadata->alloc_kind == alloc_kind_small_block) {
+    return delete_small_block((SmallBlock *)metadata);
+  }
+  if (metadata->alloc_kind == alloc_kind_arena) {
+    atomic_add_int(&arena_num_live, -1);
+    return;
+  }
+  dbgcheck__free(metadata, "msg_Data bytes");
 }
 
 char *msg_ip_str(msg_Conn *conn) {
+  Address *address = address_of_conn(conn);
+  if (is_local_address(address)) return local_path_str(address);
   return inet_ntoa((struct in_addr) { .s_addr = conn->remote_ip});
 }
 
@@ -1608,6 +6368,301 @@ char *msg_error_str(msg_Data data) {
   return msg_as_str(data);
 }
 
+void msg_post(msg_PostFn fn, void *context) {
+  Post *post    = dbgcheck__calloc(sizeof(Post), "Post");
+  post->type    = post_type_fn;
+  post->fn      = fn;
+  post->context = context;
+  add_post(post);
+}
+
+void msg_post_send(msg_Conn *conn, msg_Data data) {
+  Post *post = dbgcheck__calloc(sizeof(Post), "Post");
+  post->type = post_type_send;
+  post->conn = *conn;
+  post->data = data;
+  add_post(post);
+}
+
+void msg_use_virtual_clock(int is_virtual) {
+  init_if_needed();
+  if (is_virtual && !is_clock_virtual) virtual_now = loop_now;
+  is_clock_virtual = is_virtual;
+  update_loop_now();
+}
+
+void msg_advance_clock(int64_t ns) {
+  init_if_needed();
+  if (!is_clock_virtual || ns < 0) return;
+  virtual_now += ns;
+  update_loop_now();
+}
+
+int64_t msg_loop_now() {
+  init_if_needed();
+  return loop_now;
+}
+
+msg_Timer *msg_add_timer(int64_t delay, int64_t interval,
+                         msg_TimerCallback callback, void *context) {
+  init_if_needed();
+  if (interval < 0) interval = 0;
+  msg_Timer *timer;
+  if (is_worker_thread) {
+    timer = alloc_timer(delay, interval, app_timer_fired);
+  } else {
+    timer = new_timer(fresh_loop_now() + delay, interval, app_timer_fired);
+  }
+  timer->callback = callback;
+  timer->context  = context;
+  if (is_worker_thread) {
+    post_from_worker(post_type_add_timer, NULL, msg_no_data, timer);
+  }
+  return timer;
+}
+
+void msg_cancel_timer(msg_Timer *timer) {
+  if (timer == NULL) return;
+  if (is_worker_thread) {
+    return post_from_worker(post_type_cancel_timer, NULL, msg_no_data, timer);
+  }
+  cancel_timer(timer);
+}
+
+msg_TimerStats msg_timer_stats(msg_Timer *timer) {
+  return timer->stats;
+}
+
+void msg_set_heartbeat(int64_t interval, int64_t lost_after_ns) {
+  if (is_worker_thread) {
+    return post_values_from_worker(post_type_set_heartbeat, NULL, interval,
+                                   lost_after_ns);
+  }
+  init_if_needed();
+  if (interval < 0) interval = 0;
+  heartbeat_interval = interval;
+  lost_after         = lost_after_ns;
+  reset_out_beats();
+}
+
+void msg_set_idle_timeout(int64_t timeout) {
+  if (is_worker_thread) {
+    return post_values_from_worker(post_type_set_idle_timeout, NULL, timeout,
+                                   0);
+  }
+  init_if_needed();
+  if (timeout < 0) timeout = 0;
+  idle_timeout = timeout;
+  reset_out_beats();
+}
+
+msg_Stats msg_get_stats() {
+  init_if_needed();
+  return (msg_Stats) {
+    .num_live_peers          = conn_status->count,
+    .num_evicted_peers       = num_evicted_peers,
+    .num_lost_peers          = num_lost_peers,
+    .num_inbound_bytes       = num_inbound_bytes,
+    .num_reassembly_failures = num_reassembly_failures,
+    .num_paced_bytes         = num_paced_bytes,
+    .num_pacing_drops        = num_pacing_drops,
+    .num_zerocopy_bytes      = num_zerocopy_bytes };
+}
+
+static size_t num_outbound_bytes(ConnStatus *status) {
+  size_t num_bytes = status->out_end - status->out_start;
+  if (status->pacer) num_bytes += status->pacer->num_queued_bytes;
+  if (status->file_sends) {
+    array__for(FileSend *, file, status->file_sends, i) {
+      num_bytes += file->num_left;
+    }
+  }
+  return num_bytes;
+}
+
+void msg_set_watermarks(msg_Conn *conn, size_t high, size_t low) {
+  if (is_worker_thread) {
+    return post_values_from_worker(post_type_set_watermarks, conn,
+                                   (int64_t)high, (int64_t)low);
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "No known connection with %s",
+             address_as_str(address_of_conn(conn)));
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  status->high_watermark = high;
+  status->low_watermark  = low < high ? low : high;
+}
+
+void msg_set_coalescing(msg_Conn *conn, int is_coalescing) {
+  if (is_worker_thread) {
+    void *context = (void *)(intptr_t)is_coalescing;
+    return post_from_worker(post_type_set_coalescing, conn, msg_no_data,
+                            context);
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) return;
+  status->is_coalescing = is_coalescing;
+  if (conn->protocol_type == msg_udp) {
+    is_packing_used = true;
+    if (!is_coalescing) send_pack(status);
+    return;
+  }
+  if (!is_coalescing) send_outbound_now(conn, status);
+}
+
+void msg_flush(msg_Conn *conn) {
+  if (is_worker_thread) {
+    return post_from_worker(post_type_flush, conn, msg_no_data, NULL);
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) return;
+  if (conn->protocol_type == msg_udp) send_pack(status);
+  else                                send_outbound_now(conn, status);
+}
+
+size_t msg_outbound_bytes(msg_Conn *conn) {
+  ConnStatus *status = status_of_conn(conn);
+  return status ? num_outbound_bytes(status) : 0;
+}
+
+void msg_set_pacing(size_t max_rate) {
+  max_send_rate = max_rate;
+}
+
+size_t msg_send_rate(msg_Conn *conn) {
+  if (max_send_rate == 0 || conn->protocol_type != msg_udp) return 0;
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) return 0;
+  if (status->pacer == NULL) return max_send_rate;
+  return (size_t)status->pacer->send_rate;
+}
+
+void msg_set_impairment(msg_Conn *conn, msg_Impairment impairment) {
+  if (is_worker_thread) {
+    msg_Data data = { .num_bytes = sizeof(msg_Impairment),
+                      .bytes     = (char *)&impairment };
+    PostType type = conn ? post_type_set_impairment
+                         : post_type_set_default_impairment;
+    return post_from_worker(type, conn, data, NULL);
+  }
+  init_if_needed();
+  if (conn == NULL) {
+    default_impairment  = impairment;
+    is_default_impaired = is_impairing(&impairment);
+    map__for(pair, conn_status) {
+      ConnStatus *status = (ConnStatus *)pair->value;
+      if (status->remote_address.protocol_type != msg_udp) continue;
+      if (is_default_impaired) start_default_impairment(status);
+      else                     set_impairment(status, impairment, 0);
+    }
+    return;
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (conn->protocol_type != msg_udp || status == NULL) {
+    return send_callback_error(conn, "msg_set_impairment needs a udp peer",
+                               free_nothing, no_set_name);
+  }
+  set_impairment(status, impairment, impairment.seed);
+}
+
+msg_ImpairmentStats msg_impairment_stats(msg_Conn *conn) {
+  if (conn == NULL) return total_impairment_stats;
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || status->impairment == NULL) {
+    return (msg_ImpairmentStats) { .num_sent = 0 };
+  }
+  return status->impairment->stats;
+}
+
+void msg_set_handshake(int is_on) {
+  is_handshake_on = is_on;
+}
+
+int msg_peer_version(msg_Conn *conn) {
+  ConnStatus *status = status_of_conn(conn);
+  return (status && status->has_hello) ? status->peer_version : 0;
+}
+
+uint32_t msg_peer_capabilities(msg_Conn *conn) {
+  ConnStatus *status = status_of_conn(conn);
+  return (status && status->has_hello) ? status->peer_capabilities : 0;
+}
+
+void msg_set_compression(msg_Conn *conn, size_t min_len) {
+  if (is_worker_thread) {
+    return post_values_from_worker(post_type_set_compression, conn,
+                                   (int64_t)min_len, 0);
+  }
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "No known connection with %s",
+             address_as_str(address_of_conn(conn)));
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  status->min_compressed_len = min_len;
+  if (min_len) is_compression_used = true;
+}
+
+msg_CompressionStats msg_compression_stats(msg_Conn *conn) {
+  if (conn == NULL) return total_compression_stats;
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) return (msg_CompressionStats) { .num_compressed = 0 };
+  return status->compression;
+}
+
+void msg_set_fragmentation(size_t max_len, int64_t timeout) {
+  size_t min_len = header_len + fragment_header_len + 1;
+  if (max_len < min_len)     max_len = min_len;
+  if (max_len > max_datagram_limit) max_len = max_datagram_limit;
+  max_datagram_len   = max_len;
+  reassembly_timeout = timeout;
+}
+
+void msg_set_streaming(msg_Conn *conn, int is_streaming) {
+  if (is_worker_thread) {
+    void *context = (void *)(intptr_t)is_streaming;
+    return post_from_worker(post_type_set_streaming, conn, msg_no_data,
+                            context);
+  }
+  if (conn->protocol_type != msg_tcp) return;
+  ConnStatus *status = status_of_conn(conn);
+  if (status) status->is_streaming = is_streaming;
+}
+
+msg_Chunk msg_chunk_info(msg_Data data) {
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  size_t    offset   = metadata->chunk_offset;
+  return (msg_Chunk) {
+    .offset      = offset,
+    .total_bytes = metadata->header.num_bytes,
+    .is_final    = (offset + data.num_bytes == metadata->header.num_bytes) };
+}
+
+void msg_set_max_message_size(size_t num_bytes) {
+  max_message_size = num_bytes;
+}
+
+void msg_set_inbound_limit(size_t num_bytes) {
+  inbound_limit = num_bytes;
+}
+
+void msg_use_workers(int n) {
+  init_if_needed();
+  if (n < 0) n = 0;
+  if (n == num_workers) return;
+  stop_workers();
+  if (n == 0) return;
+  const char *failed_call = start_workers(n);
+  if (failed_call) {
+    fprintf(stderr, "Error starting msgbox workers in '%s'; callbacks will "
+                    "run on the run loop thread.\n", failed_call);
+  }
+}
+
 void *msg_no_context = NULL;
 
 const int msg_tcp = SOCK_STREAM;
@@ -6,10 +6,19 @@
 //
 // All calls are non-blocking.
 //
-// An address has the format (tcp|udp)://(<ip addr>|*):<port>.
+// An address has the format (tcp|udp)://(<ip addr>|*):<port>, or
+// (unix|unixgram)://<path> for a unix domain socket on the same host, which
+// acts like tcp or udp respectively. A shm://<name> address acts like tcp, but
+// its messages go through shared memory, and are delivered in place; a message
+// sent over shm may be up to 512 KB. A mem://<name> address also acts like tcp,
+// but only within this process: its conns have no sockets, and each message is
+// handed straight to the peer's callback queue, as for simulations.
 // Examples:
 //   You could listen on "tcp://*:8100".
 //   You could connect to "udp://1.2.3.4:8200".
+//   You could listen on "unix:///tmp/chat.sock".
+//   You could connect to "shm://chat".
+//   You could listen on "mem://sim".
 //
 // See the examples directory for basic usage examples.
 //
@@ -38,23 +47,96 @@ typedef enum {
   msg_connection_ready,
   msg_connection_closed,
   msg_connection_lost,
-  msg_error
+  msg_error,
+  msg_message_chunk,
+  msg_send_blocked,
+  msg_send_drained
 } msg_Event;
 
 struct msg_Conn;
 
 typedef void (*msg_Callback)(struct msg_Conn *, msg_Event, msg_Data);
 
+typedef void (*msg_PostFn)(void *context);
+
+typedef struct msg_Timer msg_Timer;
+
+typedef void (*msg_TimerCallback)(msg_Timer *timer, void *context);
+
+// All times are in nanoseconds.
+typedef struct {
+  uint64_t num_fires;
+  uint64_t num_skipped;     // Periodic ticks skipped because the loop was late.
+  int64_t  last_fired_at;   // The msg_loop_now value of the latest firing.
+  int64_t  last_lateness;   // How long after its due time the timer fired.
+  int64_t  max_lateness;
+  int64_t  total_lateness;  // Divide by num_fires for the mean lateness.
+  int64_t  max_drift;       // Largest gap between ticks minus the interval.
+} msg_TimerStats;
+
+// Gauges returned by msg_get_stats. The num_{evicted,lost}_peers fields
+// count peers dropped by idle eviction or by missed heartbeats since startup.
+typedef struct {
+  int      num_live_peers;     // Peers, tcp or udp, that msgbox tracks now.
+  uint64_t num_evicted_peers;
+  uint64_t num_lost_peers;
+  size_t   num_inbound_bytes;  // Buffered for partly received messages.
+  uint64_t num_reassembly_failures;  // Fragmented udp messages dropped.
+  size_t   num_paced_bytes;    // Datagrams waiting for their pacing slot.
+  uint64_t num_pacing_drops;   // Datagrams dropped by a full pacing queue.
+  size_t   num_zerocopy_bytes; // Sent data the kernel may still be reading.
+} msg_Stats;
+
+// Describes the data of a msg_message_chunk event; see msg_set_streaming.
+typedef struct {
+  size_t offset;       // Where the chunk's bytes start within the message.
+  size_t total_bytes;  // The size of the whole message.
+  int    is_final;     // True for the message's last chunk.
+} msg_Chunk;
+
+// Settings and counts for fault injection; see msg_set_impairment. Rates are
+// fractions from 0 to 1, and times are in nanoseconds.
+typedef struct {
+  double   loss_rate;          // Of datagrams sent to the peer.
+  double   inbound_loss_rate;  // Of datagrams received from the peer.
+  double   duplicate_rate;
+  double   reorder_rate;
+  int64_t  delay;
+  int64_t  jitter;             // The most extra delay, chosen at random.
+  size_t   max_rate;           // In bytes per second; 0 means no cap.
+  uint64_t seed;
+} msg_Impairment;
+
+typedef struct {
+  uint64_t num_sent;             // Datagrams sent, counting duplicates.
+  uint64_t num_dropped;          // Lost, or dropped by a full queue.
+  uint64_t num_duplicated;
+  uint64_t num_reordered;
+  uint64_t num_inbound_dropped;
+  size_t   num_queued_bytes;     // Delayed datagrams waiting to be sent.
+} msg_ImpairmentStats;
+
+typedef struct {
+  uint64_t num_compressed;      // Messages sent compressed.
+  uint64_t num_incompressible;  // Messages sent as is, as they didn't shrink.
+  uint64_t num_bytes_before;    // The bodies of compressed messages, as given.
+  uint64_t num_bytes_after;     // The same bodies as sent.
+  int64_t  compress_time;       // Nanoseconds, with incompressible messages.
+  uint64_t num_decompressed;    // Messages received compressed.
+  int64_t  decompress_time;     // Nanoseconds.
+} msg_CompressionStats;
+
 typedef struct msg_Conn {
   void *conn_context;
   void *reply_context;
   msg_Callback callback;
 
-  uint32_t remote_ip;      // Network byte-order.
-  uint16_t remote_port;    // Host byte-order.
-  uint16_t protocol_type;  // Valid values are msg_tcp or msg_udp.
+  uint32_t remote_ip;      // Network byte-order; an id for unix conns.
+  uint16_t remote_port;    // Host byte-order; 0 for unix conns.
+  uint16_t protocol_type;  // Valid values are msg_tcp or msg_udp; unix, shm,
+                           // and mem conns are msg_tcp, unixgram conns msg_udp.
 
-  int socket;
+  int socket;              // -1 for mem conns.
   int for_listening;
   uint16_t reply_id;
   int index;
@@ -79,6 +161,60 @@ void msg_disconnect(msg_Conn *conn);
 void msg_send(msg_Conn *conn, msg_Data data);
 void msg_get (msg_Conn *conn, msg_Data data, void *reply_context);
 
+// Sends a message over udp that's retransmitted until the peer acks it. An
+// ordered message is delivered only after every earlier reliable message to
+// the same peer; other reliable messages are delivered as they arrive. A peer
+// that stops acking is reported with msg_connection_lost. Over tcp, this is
+// the same as msg_send.
+void msg_send_reliable(msg_Conn *conn, msg_Data data, int is_ordered);
+
+// Sends data as msg_send does, but takes ownership of it: msgbox deletes data
+// when it's done with it, so don't use or delete it after this call. Where the
+// os supports it, a tcp message of 16 KB or more is sent with MSG_ZEROCOPY, so
+// the kernel reads it in place instead of copying it, and data is deleted once
+// the kernel reports that it's finished.
+void msg_send_zerocopy(msg_Conn *conn, msg_Data data);
+
+// Sends num_bytes of the file fd, starting at offset, as the body of a message
+// on a tcp conn. The peer gets an ordinary msg_message, or msg_reply. The body
+// goes from the file to the socket with sendfile, rather than through a
+// msg_Data. msgbox sends from a dup of fd, so fd may be closed after the call,
+// but the file's bytes must not change until they're sent.
+void msg_send_file(msg_Conn *conn, int fd, int64_t offset, size_t num_bytes);
+
+// Thread-safe calls; unlike the rest of msgbox, these may be called from any
+// thread. Each wakes up the thread calling msg_runloop, which then makes the
+// call. msg_post calls fn(context). msg_post_send is msg_send followed by
+// msg_delete_data(data); conn may be a copy of a msg_Conn given to a
+// callback, which is useful for listening udp conns as their remote address
+// changes from one callback to the next.
+
+void msg_post     (msg_PostFn fn, void *context);
+void msg_post_send(msg_Conn *conn, msg_Data data);
+
+// Worker threads. With n > 0, msg_runloop only does socket i/o and framing,
+// and callbacks are made on a pool of n threads. Callbacks for the same peer
+// are still made one at a time and in order. A callback's conn is a copy that
+// is only valid until the callback returns; msgbox calls made from callbacks
+// are passed back to the run loop thread. A timer added from a callback starts
+// its delay when the run loop thread takes the call. Calls that return msgbox
+// state, such as msg_timer_stats, must be made from the run loop thread. Timer
+// callbacks stay on the run loop thread. Call this from the run loop thread;
+// msg_use_workers(0) finishes the queued callbacks and joins the workers. Not
+// yet supported on windows.
+
+void msg_use_workers(int n);
+
+// Streaming. After msg_set_streaming(conn, true) on a tcp conn, each one-way
+// message that starts arriving is passed to the callback as it arrives, in one
+// or more msg_message_chunk events, rather than as a single msg_message event
+// once it has fully arrived. Requests and replies are still delivered whole.
+// Call msg_chunk_info on the data of a msg_message_chunk event to see where it
+// fits in its message. Streamed messages aren't subject to the max message
+// size, since they're never held whole.
+void      msg_set_streaming(msg_Conn *conn, int is_streaming);
+msg_Chunk msg_chunk_info   (msg_Data data);
+
 // Functions for working with msg_Data.
 
 char *msg_as_str(msg_Data data);  // Assumes the underlying data is a C string.
@@ -95,10 +231,153 @@ char *msg_address_str(msg_Conn *conn);
 
 char *msg_error_str(msg_Data data);
 
+// Functions for working with time.
+
+// Returns the loop's cached monotonic time in nanoseconds, so it's very cheap
+// to call from callbacks. It's refreshed as each msg_runloop call starts and
+// again after polling, by msg_use_virtual_clock and msg_advance_clock, and by
+// calls made outside msg_runloop that set a due time, such as msg_add_timer
+// and msg_get. Otherwise, it may be as old as the last msg_runloop call.
+int64_t msg_loop_now();
+
+// The virtual clock. After msg_use_virtual_clock(true), msg_loop_now, timers,
+// and msg_get timeouts follow a clock that starts at the current loop time and
+// only moves forward by msg_advance_clock(ns) calls, rather than with real
+// time. Timers that come due are fired by the next msg_runloop call, which
+// doesn't wait for events while any timer is pending. This keeps simulations,
+// such as those with many mem:// conns, repeatable.
+void msg_use_virtual_clock(int is_virtual);
+void msg_advance_clock    (int64_t ns);
+
+// Timers are called from within msg_runloop, which sets its poll timeout so
+// that it wakes up when the next timer is due. The first call is delay ns
+// after msg_loop_now; an interval of 0 makes a one-shot timer, and otherwise
+// the timer repeats every interval ns until it's canceled. One-shot timers
+// are freed after they fire, and must not be canceled after that.
+msg_Timer *    msg_add_timer   (int64_t delay, int64_t interval,
+                                msg_TimerCallback callback, void *context);
+void           msg_cancel_timer(msg_Timer *timer);
+msg_TimerStats msg_timer_stats (msg_Timer *timer);
+
+// Heartbeats track the liveness of udp peers. Every interval ns, msgbox sends
+// a heartbeat to each udp peer; a peer that msgbox hasn't heard from in
+// lost_after ns gets a msg_connection_lost event. An interval of 0 turns
+// heartbeats off, which is the default, as peers built without heartbeats
+// can't handle them.
+void msg_set_heartbeat(int64_t interval, int64_t lost_after);
+
+// Idle eviction drops udp peers that haven't sent a message, not counting
+// heartbeats, in timeout ns. Each evicted peer gets a msg_connection_lost
+// event. A timeout of 0, the default, turns eviction off.
+void msg_set_idle_timeout(int64_t timeout);
+
+// Returns the current gauges; see msg_Stats.
+msg_Stats msg_get_stats();
+
+// Limits on inbound data. An incoming message larger than the max message
+// size, or one that would take the bytes buffered for partly received
+// messages past the inbound limit, gets a msg_error; a tcp conn is then closed
+// as its stream can't be read past the refused message, and a udp message is
+// dropped. Buffers grow as a message's bytes arrive, so the inbound limit
+// tracks bytes received rather than announced message sizes. Zero, the
+// default for both, means no limit.
+void msg_set_max_message_size(size_t num_bytes);
+void msg_set_inbound_limit   (size_t num_bytes);
+
+// A udp message that doesn't fit in a datagram of max_datagram_len bytes is
+// sent in fragments of that size and reassembled by the receiving msgbox.
+// A message that's incomplete after reassembly_timeout ns is dropped, as is
+// one superseded by a newer fragmented message from the same peer; these
+// count as reassembly failures in msg_Stats. A reassembled message may be up
+// to 1 MB. The defaults are 1400 bytes and 1 second.
+void msg_set_fragmentation(size_t max_datagram_len, int64_t reassembly_timeout);
+
+// Pacing spreads the datagrams sent to each udp peer out at the peer's send
+// rate, in bytes per second, rather than sending bursts at once. A peer's rate
+// starts at max_rate; losses and acks of reliable messages lower and raise it,
+// up to max_rate. A datagram that would put more than 1 MB in a peer's queue is
+// dropped. A max_rate of 0, the default, turns pacing off. msg_send_rate gives
+// the current rate for the peer of a udp conn, or 0 if there's none.
+void   msg_set_pacing(size_t max_rate);
+size_t msg_send_rate (msg_Conn *conn);
+
+// Fault injection, for testing under a bad network without os tools. After
+// msg_set_impairment, each datagram sent to the peer of a udp conn may be lost
+// or duplicated, and leaves after the delay plus a random jitter, and after
+// any wait for a link capped at max_rate. Jitter may reorder datagrams; a
+// reordered datagram skips the delay and jitter, so it passes those ahead of
+// it. Datagrams received from the peer are lost at inbound_loss_rate. A run
+// with the same seed and the same sends makes the same random choices. A conn
+// of NULL sets the impairment of every udp peer, present and future; an
+// all-zero msg_Impairment turns it off. msg_impairment_stats gives the counts
+// for the peer of conn, or the totals for a conn of NULL; call it from the run
+// loop thread.
+void                msg_set_impairment  (msg_Conn *conn,
+                                         msg_Impairment impairment);
+msg_ImpairmentStats msg_impairment_stats(msg_Conn *conn);
+
+// Outbound data that a peer isn't ready for is queued: tcp bytes the socket
+// won't take yet, and udp datagrams waiting for their pacing slot.
+// msg_outbound_bytes gives the number of bytes queued for the peer of conn.
+// After msg_set_watermarks, a conn gets a msg_send_blocked event when its
+// queue grows past high bytes, and then a msg_send_drained event when it's
+// back down to low bytes, so that the app can send less to a slow peer.
+// Set these after msg_connection_ready; a high of 0, the default, means no
+// events. Call msg_outbound_bytes from the run loop thread.
+void   msg_set_watermarks(msg_Conn *conn, size_t high, size_t low);
+size_t msg_outbound_bytes(msg_Conn *conn);
+
+// Handshakes. After msg_set_handshake(true), msgbox sends each new peer its
+// protocol version and msg_cap_* capabilities just after msg_connection_ready,
+// and a peer that gets them answers with its own, even if its handshakes are
+// off. Wire features the peer doesn't list are then not used with it: a
+// reliable message goes out as a plain one, coalesced udp messages aren't
+// packed, and a udp message too large for one datagram gets an EMSGSIZE error.
+// msg_peer_version and msg_peer_capabilities return 0 until the peer's
+// handshake arrives; call them from the run loop thread. Peers that never send
+// one are assumed to support all of these, as before handshakes. Messages of
+// unknown types are dropped, so that later versions may add types. Handshakes
+// are off by default, since older versions of msgbox can't read them.
+void     msg_set_handshake    (int is_on);
+int      msg_peer_version     (msg_Conn *conn);
+uint32_t msg_peer_capabilities(msg_Conn *conn);
+
+// Compression. After msg_set_compression, each one-way message, request, or
+// reply sent to the peer of conn with a body of at least min_len bytes is
+// compressed with a bundled LZ codec, unless that doesn't make it smaller; the
+// peer expands it before its callback. The peer must be a version of msgbox
+// that reads compressed messages; if its handshake says it can't, messages to
+// it aren't compressed. A min_len of 0, the default, turns compression off.
+// Mem conns and msg_send_zerocopy don't compress. msg_compression_stats gives
+// the counts for the peer of conn, or the totals for a conn of NULL; call it
+// from the run loop thread.
+void                 msg_set_compression  (msg_Conn *conn, size_t min_len);
+msg_CompressionStats msg_compression_stats(msg_Conn *conn);
+
+// Coalescing. After msg_set_coalescing(conn, true) on a tcp conn, its sends
+// are queued, and the queue is sent with a single system call at the end of
+// the run loop iteration, so that many small messages share a packet. On a udp
+// conn, the peer's messages are packed into as few datagrams of the max
+// datagram length as they fit in, and unpacked by the receiving msgbox.
+// msg_flush sends a conn's queued bytes right away, as for urgent data.
+// Turning coalescing off flushes the conn.
+void msg_set_coalescing(msg_Conn *conn, int is_coalescing);
+void msg_flush         (msg_Conn *conn);
+
 // Constants.
 
 extern void *msg_no_context;
 
+// Multipliers for expressing nanosecond time values, as in 30 * msg_ms.
+#define msg_ms  ((int64_t)1000000)
+#define msg_sec ((int64_t)1000000000)
+
+// Capability bits for msg_peer_capabilities.
+#define msg_cap_fragments   0x1  // Reassembles fragmented udp messages.
+#define msg_cap_reliable    0x2  // Reads msg_send_reliable messages.
+#define msg_cap_packing     0x4  // Unpacks coalesced udp messages.
+#define msg_cap_compression 0x8  // Expands compressed messages.
+
 // Valid values for msg_Conn.protocol_type.
 extern const int msg_udp;
 extern const int msg_tcp;
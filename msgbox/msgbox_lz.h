@@ -0,0 +1,237 @@
+// msgbox_lz.h
+//
+// https://github.com/tylerneylon/msgbox
+//
+// A small, fast LZ77 codec for compressing message
+// bodies, with no dependencies.
+//
+// This is a header-only file for the same reason as
+// msgbox_now.h: its functions stay static, which keeps
+// them out of the global linkage namespace.
+//
+// The compressed format is the block format of LZ4. It's
+// a series of sequences, each of which is a token byte,
+// a run of literal bytes, and a match that copies bytes
+// from earlier in the output. The token's high 4 bits
+// are the literal count, and its low 4 bits are the match
+// length minus 4; a nibble of 15 is followed by more
+// length bytes, each added in, until one is under 255.
+// The match's offset back into the output follows the
+// literals as 2 little-endian bytes. The last sequence
+// has only literals, and it ends the block.
+//
+// lz_decompress checks every length and offset against
+// its buffers, so it's safe to use on untrusted input.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef true
+#define true  1
+#define false 0
+#endif
+
+#define lz_min_match     4
+#define lz_max_offset    65535
+#define lz_hash_bits     12
+#define lz_last_literals 5  // Matches end at least this far from the end.
+
+// No block decompresses to more than this many times its own length, which
+// lets a caller bound the room it reserves for untrusted input.
+#define lz_max_ratio 255
+
+static uint32_t lz_read32(const uint8_t *bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static uint64_t lz_read64(const uint8_t *bytes) {
+  uint64_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - lz_hash_bits);
+}
+
+// Returns the number of bytes, up to max_len, that match at a and b.
+static size_t lz_match_len(const uint8_t *a, const uint8_t *b, size_t max_len) {
+  size_t len = 0;
+  while (len + 8 <= max_len && lz_read64(a + len) == lz_read64(b + len)) {
+    len += 8;
+  }
+  while (len < max_len && a[len] == b[len]) len++;
+  return len;
+}
+
+// Copies len bytes 8 at a time, so it may read and write up to 7 bytes past
+// them; callers check that there's room. Each 8 bytes are read before they're
+// written, so src may overlap dst if it's at least 8 bytes behind.
+static void lz_wild_copy(uint8_t *dst, const uint8_t *src, size_t len) {
+  uint8_t *end = dst + len;
+  while (dst < end) {
+    memcpy(dst, src, 8);
+    dst += 8;
+    src += 8;
+  }
+}
+
+// Writes the extra bytes of a length whose nibble was 15.
+static uint8_t *lz_put_len(uint8_t *dst, size_t len) {
+  for (; len >= 255; len -= 255) *dst++ = 255;
+  *dst++ = (uint8_t)len;
+  return dst;
+}
+
+// Adds the extra bytes of a length whose nibble was 15 to *len.
+// Returns false if the input ends first.
+static int lz_get_len(const uint8_t **src, const uint8_t *src_end,
+                      size_t *len) {
+  uint8_t byte;
+  do {
+    if (*src == src_end) return false;
+    byte  = *(*src)++;
+    *len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Writes a sequence to *dst; a match_len of 0 means there's no match.
+// Returns false, writing nothing, if the sequence won't fit before dst_end.
+static int lz_put_sequence(uint8_t **dst, uint8_t *dst_end,
+                           const uint8_t *literals, size_t num_literals,
+                           size_t offset, size_t match_len) {
+  size_t max_len = 1 + num_literals + num_literals / 255 + 1 +
+                   2 + match_len / 255 + 1;
+  if ((size_t)(dst_end - *dst) < max_len) return false;
+
+  uint8_t *out       = *dst;
+  size_t   extra_len = match_len ? match_len - lz_min_match : 0;
+  uint8_t *token     = out++;
+  *token = (uint8_t)((num_literals < 15 ? num_literals : 15) << 4);
+  if (num_literals >= 15) out = lz_put_len(out, num_literals - 15);
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+
+  if (match_len) {
+    *out++  = (uint8_t)(offset & 0xFF);
+    *out++  = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)(extra_len < 15 ? extra_len : 15);
+    if (extra_len >= 15) out = lz_put_len(out, extra_len - 15);
+  }
+  *dst = out;
+  return true;
+}
+
+// Compresses in_len bytes from in into out, which has room for out_len bytes.
+// Returns the compressed length, or 0 if it won't fit in out_len bytes; a
+// caller can pass an out_len under in_len to give up on data that doesn't
+// shrink.
+static size_t lz_compress(const char *in, size_t in_len,
+                          char *out, size_t out_len) {
+  const uint8_t *src     = (const uint8_t *)in;
+  uint8_t       *dst     = (uint8_t *)out;
+  uint8_t       *dst_end = dst + out_len;
+
+  // Each entry is the latest position of a 4-byte sequence with that hash.
+  // Stale entries are harmless, as each candidate is checked.
+  uint32_t table[1 << lz_hash_bits];
+  memset(table, 0, sizeof(table));
+
+  size_t anchor = 0;  // The start of the literals not yet written.
+  size_t i      = 1;  // Position 0 can only be a candidate.
+  if (in_len > lz_last_literals + lz_min_match) {
+    size_t match_limit = in_len - lz_last_literals;
+    while (i + lz_min_match <= match_limit) {
+      uint32_t  sequence  = lz_read32(src + i);
+      uint32_t *entry     = &table[lz_hash(sequence)];
+      size_t    candidate = *entry;
+      *entry = (uint32_t)i;
+      if (i - candidate > lz_max_offset ||
+          lz_read32(src + candidate) != sequence) {
+        // Skip ahead faster the longer nothing has matched, so data that
+        // doesn't compress costs little.
+        i += 1 + ((i - anchor) >> 6);
+        continue;
+      }
+
+      size_t len = lz_min_match +
+                   lz_match_len(src + candidate + lz_min_match,
+                                src + i + lz_min_match,
+                                match_limit - i - lz_min_match);
+      if (!lz_put_sequence(&dst, dst_end, src + anchor, i - anchor,
+                           i - candidate, len)) {
+        return 0;
+      }
+      i     += len;
+      anchor = i;
+      // Matches often follow one another; this lets the next one start here.
+      table[lz_hash(lz_read32(src + i - 2))] = (uint32_t)(i - 2);
+    }
+  }
+  if (!lz_put_sequence(&dst, dst_end, src + anchor, in_len - anchor, 0, 0)) {
+    return 0;
+  }
+  return dst - (uint8_t *)out;
+}
+
+// Decompresses in_len bytes from in into out.
+// Returns true iff they decompress to exactly out_len bytes.
+static int lz_decompress(const char *in, size_t in_len,
+                         char *out, size_t out_len) {
+  const uint8_t *src       = (const uint8_t *)in;
+  const uint8_t *src_end   = src + in_len;
+  uint8_t       *dst       = (uint8_t *)out;
+  uint8_t       *dst_start = dst;
+  uint8_t       *dst_end   = dst + out_len;
+
+  while (src < src_end) {
+    uint8_t token        = *src++;
+    size_t  num_literals = token >> 4;
+    if (num_literals == 15 && !lz_get_len(&src, src_end, &num_literals)) {
+      return false;
+    }
+    if (num_literals > (size_t)(src_end - src) ||
+        num_literals > (size_t)(dst_end - dst)) {
+      return false;
+    }
+    if (num_literals + 8 <= (size_t)(src_end - src) &&
+        num_literals + 8 <= (size_t)(dst_end - dst)) {
+      lz_wild_copy(dst, src, num_literals);
+    } else {
+      memcpy(dst, src, num_literals);
+    }
+    src += num_literals;
+    dst += num_literals;
+    if (src == src_end) break;  // The last sequence has no match.
+
+    if (src_end - src < 2) return false;
+    size_t offset = src[0] | ((size_t)src[1] << 8);
+    src += 2;
+    size_t len = token & 0xF;
+    if (len == 15 && !lz_get_len(&src, src_end, &len)) return false;
+    len += lz_min_match;
+    if (offset == 0 || offset > (size_t)(dst - dst_start) ||
+        len > (size_t)(dst_end - dst)) {
+      return false;
+    }
+
+    const uint8_t *match = dst - offset;
+    if (offset >= 8 && len + 8 <= (size_t)(dst_end - dst)) {
+      lz_wild_copy(dst, match, len);
+      dst += len;
+    } else if (offset >= len) {
+      memcpy(dst, match, len);
+      dst += len;
+    } else {
+      // The match overlaps the bytes it writes, which repeats them.
+      while (len--) *dst++ = *match++;
+    }
+  }
+  return dst == dst_end;
+}
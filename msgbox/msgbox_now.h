@@ -3,54 +3,63 @@
 // https://github.com/tylerneylon/msgbox
 //
 // A cross-platform way to get a high resolution
-// timestamp.
+// monotonic timestamp.
 //
 // This is a header-only file in order to support
 // static linkage, which avoids polluting the
 // global linkage namespace with the "now" symbol.
 //
-// The "now" function returns the number of seconds
-// since the start of 1970 as a floating-point value.
+// The "now" function returns the number of nanoseconds
+// since an arbitrary fixed point in the past. Unlike the
+// wall clock, this value never jumps when the system time
+// is changed, so it's safe to use for timeouts.
 //
 
 #pragma once
 
+#include <inttypes.h>
+
 #ifndef true
 #define true  1
 #define false 0
 #endif
 
+#define ns_per_sec ((int64_t)1000000000)
+
 #ifdef _WIN32
 
 #include <windows.h>
 
 // windows version
-static double now() {
-  static double counts_per_sec;
+static int64_t now() {
+  static int64_t counts_per_sec;
 
   static int is_initialized = false;
   if (!is_initialized) {
     LARGE_INTEGER counts_per_sec_int;
     QueryPerformanceFrequency(&counts_per_sec_int);
-    counts_per_sec = (double)counts_per_sec_int.QuadPart;
+    counts_per_sec = counts_per_sec_int.QuadPart;
     is_initialized = true;
   }
 
-  LARGE_INTEGER counts;
-  QueryPerformanceCounter(&counts);
-  double seconds = (double)counts.QuadPart / counts_per_sec;
-  return seconds;
+  LARGE_INTEGER counts_int;
+  QueryPerformanceCounter(&counts_int);
+  int64_t counts = counts_int.QuadPart;
+
+  // Split the conversion to avoid overflowing counts * ns_per_sec.
+  return (counts / counts_per_sec) * ns_per_sec +
+         (counts % counts_per_sec) * ns_per_sec / counts_per_sec;
 }
 
 #else
 
-#include <sys/time.h>
+#include <time.h>
 
 // mac/linux version
-static double now() {
-  struct timeval t;
-  gettimeofday(&t, NULL);  // 2nd param = optional time zone pointer.
-  return (double)t.tv_sec + 1e-6 * (double)t.tv_usec;
+static int64_t now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * ns_per_sec + (int64_t)t.tv_nsec;
 }
 
 #endif
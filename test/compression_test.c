@@ -0,0 +1,266 @@
+// compression_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for msg_set_compression, which compresses large message bodies on the
+// wire and expands them before the receiver's callback.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define min_len      1024
+#define snapshot_len (200 * 1024)
+
+msg_Conn *listening_conn;
+msg_Conn *server_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_messages;
+int num_intact;
+int num_replies;
+int num_errors;
+
+// The message last made by new_snapshot or new_random_data.
+msg_Data sent;
+
+// Returns a body like a game's state snapshot, which compresses well.
+msg_Data new_snapshot(size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  size_t len = 0;
+  for (int i = 0; len < num_bytes; ++i) {
+    char entity[128];
+    int entity_len = snprintf(entity, sizeof(entity),
+                              "{\"id\":%d,\"name\":\"player_%d\",\"x\":%d.5,"
+                              "\"y\":%d.25,\"hp\":100,\"state\":\"idle\"},",
+                              i, i % 50, i * 7 % 1000, i * 13 % 1000);
+    if (entity_len > num_bytes - len) entity_len = (int)(num_bytes - len);
+    memcpy(data.bytes + len, entity, entity_len);
+    len += entity_len;
+  }
+  return data;
+}
+
+msg_Data new_random_data(size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)rand();
+  return data;
+}
+
+int is_sent_data(msg_Data data) {
+  return data.num_bytes == sent.num_bytes &&
+         memcmp(data.bytes, sent.bytes, data.num_bytes) == 0;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error)           num_errors++;
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+
+  if (event == msg_connection_ready) {
+    server_conn = conn;
+    msg_set_compression(conn, min_len);
+  }
+  if (event == msg_message) {
+    server_conn = conn;
+    num_messages++;
+    if (is_sent_data(data)) num_intact++;
+  }
+  if (event == msg_request) {
+    num_messages++;
+    if (is_sent_data(data)) num_intact++;
+    // Replies are compressed too.
+    msg_send(conn, data);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+  if (event == msg_reply) {
+    num_replies++;
+    if (is_sent_data(data)) num_intact++;
+  }
+}
+
+void reset() {
+  listening_conn  = NULL;
+  server_conn     = NULL;
+  client_conn     = NULL;
+  listening_ended = false;
+  num_messages    = 0;
+  num_intact      = 0;
+  num_replies     = 0;
+  num_errors      = 0;
+}
+
+int start_conns(const char *address) {
+  reset();
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+
+  msg_connect(address, client_update, msg_no_context);
+  for (int i = 0; i < 100 && client_conn == NULL; ++i) msg_runloop(5);
+  test_that(client_conn != NULL);
+  msg_set_compression(client_conn, min_len);
+  return test_success;
+}
+
+int end_conns() {
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  for (int i = 0; i < 100 && !listening_ended; ++i) msg_runloop(5);
+  test_that(listening_ended);
+  return test_success;
+}
+
+// Sends sent, then waits for the server to see it.
+void send_and_wait() {
+  int num_expected = num_messages + 1;
+  msg_send(client_conn, sent);
+  for (int i = 0; i < 200 && num_messages + num_errors < num_expected; ++i) {
+    msg_runloop(5);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Large bodies are compressed, small ones aren't, and all arrive as sent.
+int tcp_test() {
+  test_that(start_conns("tcp://127.0.0.1:2481") == test_success);
+
+  sent = new_snapshot(snapshot_len);
+  send_and_wait();
+  msg_delete_data(sent);
+  sent = msg_new_data("small");
+  send_and_wait();
+  msg_delete_data(sent);
+  test_that(num_messages == 2);
+  test_that(num_intact == 2);
+
+  msg_CompressionStats stats = msg_compression_stats(client_conn);
+  test_printf("A snapshot of %d bytes was sent as %d bytes.\n",
+              (int)stats.num_bytes_before, (int)stats.num_bytes_after);
+  test_that(stats.num_compressed == 1);
+  test_that(stats.num_bytes_before == snapshot_len);
+  test_that(stats.num_bytes_after < snapshot_len / 4);
+  test_that(stats.compress_time > 0);
+  test_that(msg_compression_stats(server_conn).num_decompressed == 1);
+
+  // A request and its reply are each compressed.
+  sent = new_snapshot(snapshot_len);
+  msg_get(client_conn, sent, msg_no_context);
+  for (int i = 0; i < 200 && num_replies < 1; ++i) msg_runloop(5);
+  msg_delete_data(sent);
+  test_that(num_replies == 1);
+  test_that(num_intact == 4);
+  test_that(msg_compression_stats(server_conn).num_compressed == 1);
+  test_that(msg_compression_stats(client_conn).num_decompressed == 1);
+
+  return end_conns();
+}
+
+// Messages that don't shrink are sent as they are.
+int incompressible_test() {
+  test_that(start_conns("tcp://127.0.0.1:2482") == test_success);
+  msg_CompressionStats before = msg_compression_stats(NULL);
+
+  sent = new_random_data(snapshot_len);
+  send_and_wait();
+  msg_delete_data(sent);
+  test_that(num_intact == 1);
+
+  msg_CompressionStats stats = msg_compression_stats(client_conn);
+  test_that(stats.num_compressed == 0);
+  test_that(stats.num_incompressible == 1);
+  msg_CompressionStats totals = msg_compression_stats(NULL);
+  test_that(totals.num_incompressible == before.num_incompressible + 1);
+  test_that(totals.num_decompressed == before.num_decompressed);
+
+  return end_conns();
+}
+
+// Compressed udp messages may be fragmented and packed like any other.
+int udp_test() {
+  test_that(start_conns("udp://127.0.0.1:2483") == test_success);
+
+  sent = new_snapshot(20 * 1024);
+  send_and_wait();
+  msg_delete_data(sent);
+  test_that(num_intact == 1);
+
+  msg_set_coalescing(client_conn, true);
+  sent = new_snapshot(4096);
+  for (int i = 0; i < 3; ++i) msg_send(client_conn, sent);
+  for (int i = 0; i < 100 && num_messages < 4; ++i) msg_runloop(5);
+  msg_delete_data(sent);
+  test_that(num_intact == 4);
+  test_that(msg_compression_stats(client_conn).num_compressed == 4);
+  test_that(msg_compression_stats(server_conn).num_decompressed == 4);
+
+  return end_conns();
+}
+
+// The max message size applies to a message's expanded size.
+int max_size_test() {
+  test_that(start_conns("tcp://127.0.0.1:2484") == test_success);
+
+  msg_set_max_message_size(snapshot_len / 2);
+  sent = new_snapshot(snapshot_len);
+  send_and_wait();
+  msg_delete_data(sent);
+  msg_set_max_message_size(0);
+  test_that(num_messages == 0);
+  test_that(num_errors == 1);
+
+  return end_conns();
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+
+  start_all_tests(argv[0]);
+  run_tests(tcp_test, incompressible_test, udp_test, max_size_test);
+  return end_all_tests();
+}
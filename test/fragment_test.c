@@ -0,0 +1,310 @@
+// fragment_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for udp fragmentation and reassembly. Messages between msgbox conns
+// check the round trip; a plain udp socket sends hand-built fragments to check
+// that incomplete messages are dropped and counted, and that fragments that
+// disagree with the rest of their message are dropped.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk"
+};
+
+// These match the values used on the wire.
+#define wire_one_way   0
+#define wire_fragment  5
+#define slice_len      100
+
+#define message_len (70 * 1024)  // Too large for a single datagram.
+#define request_len (20 * 1024)
+#define reply_len   (30 * 1024)
+
+int port;
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_messages;
+int num_replies;
+size_t last_message_len;
+int last_message_ok;
+
+msg_Data new_pattern_data(size_t num_bytes, int seed) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i * seed);
+  return data;
+}
+
+int has_pattern(msg_Data data, int seed) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i * seed)) return false;
+  }
+  return true;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+
+  if (event == msg_message) {
+    num_messages++;
+    last_message_len = data.num_bytes;
+    last_message_ok  = has_pattern(data, 7);
+  }
+
+  if (event == msg_request) {
+    test_that(data.num_bytes == request_len);
+    test_that(has_pattern(data, 3));
+    msg_Data reply = new_pattern_data(reply_len, 5);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+
+  if (event == msg_reply) {
+    num_replies++;
+    test_that(conn->reply_context == &num_replies);
+    test_that(data.num_bytes == reply_len);
+    test_that(has_pattern(data, 5));
+  }
+}
+
+void listen_and_reset() {
+  listening_ended  = false;
+  num_messages     = 0;
+  num_replies      = 0;
+  last_message_len = 0;
+  last_message_ok  = false;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+}
+
+void unlisten() {
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+}
+
+void run_loop_for(int64_t duration) {
+  int64_t end = msg_loop_now() + duration;
+  while (msg_loop_now() < end) msg_runloop(5);
+}
+
+// Returns a udp socket connected to the server.
+int open_raw_peer() {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  return sock;
+}
+
+// Sends a fragment with the given fields, holding len bytes at offset of a
+// one-way message filled with the pattern checked by server_update.
+void raw_send_slice(int sock, uint16_t message_id, uint16_t packet_id,
+                    uint16_t num_packets, uint32_t num_bytes, uint32_t offset,
+                    uint32_t len) {
+  char buffer[8 + 12 + slice_len];
+  uint16_t outer[2] = { htons(wire_fragment), 0 };
+  uint32_t outer_len = htonl(12 + len);
+  uint16_t frag[4] = { htons(wire_one_way), htons(message_id),
+                       htons(packet_id),    htons(num_packets) };
+  uint32_t frag_len = htonl(num_bytes);
+  memcpy(buffer,      outer,      4);
+  memcpy(buffer + 4,  &outer_len, 4);
+  memcpy(buffer + 8,  frag,       8);
+  memcpy(buffer + 16, &frag_len,  4);
+  for (uint32_t i = 0; i < len; ++i) buffer[20 + i] = (char)((offset + i) * 7);
+  send(sock, buffer, 20 + len, 0);
+}
+
+// Sends fragment packet_id of a one-way message of num_bytes bytes, as a
+// msgbox peer would.
+void raw_send_fragment(int sock, uint16_t message_id, uint16_t packet_id,
+                       uint32_t num_bytes) {
+  uint16_t num_packets = (num_bytes + slice_len - 1) / slice_len;
+  uint32_t offset      = packet_id * slice_len;
+  uint32_t len         = num_bytes - offset;
+  if (len > slice_len) len = slice_len;
+  raw_send_slice(sock, message_id, packet_id, num_packets, num_bytes, offset,
+                 len);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Messages, requests, and replies larger than a datagram arrive intact.
+int round_trip_test() {
+  listen_and_reset();
+  client_conn = NULL;
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  msg_Data data = new_pattern_data(message_len, 7);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  for (int i = 0; i < 100 && num_messages == 0; ++i) msg_runloop(5);
+
+  data = new_pattern_data(request_len, 3);
+  msg_get(client_conn, data, &num_replies);
+  msg_delete_data(data);
+
+  for (int i = 0; i < 200 && (num_messages < 1 || num_replies < 1); ++i) {
+    msg_runloop(5);
+  }
+  test_that(num_messages == 1);
+  test_that(last_message_len == message_len);
+  test_that(last_message_ok);
+  test_that(num_replies == 1);
+  test_that(msg_get_stats().num_reassembly_failures == 0);
+
+  msg_disconnect(client_conn);
+  unlisten();
+  return test_success;
+}
+
+// Fragments are placed by their packet_id, whatever order they arrive in.
+int out_of_order_test() {
+  listen_and_reset();
+
+  int sock = open_raw_peer();
+  uint32_t num_bytes = 5 * slice_len + 42;
+  for (int i = 5; i >= 0; --i) raw_send_fragment(sock, 1, i, num_bytes);
+  // A duplicate fragment is ignored.
+  raw_send_fragment(sock, 1, 5, num_bytes);
+
+  for (int i = 0; i < 100 && num_messages == 0; ++i) msg_runloop(5);
+  test_that(num_messages == 1);
+  test_that(last_message_len == num_bytes);
+  test_that(last_message_ok);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+// Incomplete messages are dropped, after a timeout or when a newer message
+// starts, and the drops are counted.
+int incomplete_message_test() {
+  listen_and_reset();
+  msg_set_fragmentation(1400, 50 * msg_ms);
+  uint64_t failures = msg_get_stats().num_reassembly_failures;
+
+  int sock = open_raw_peer();
+  uint32_t num_bytes = 3 * slice_len;
+  raw_send_fragment(sock, 1, 0, num_bytes);
+  raw_send_fragment(sock, 1, 1, num_bytes);
+  run_loop_for(100 * msg_ms);
+  test_that(num_messages == 0);
+  test_that(msg_get_stats().num_reassembly_failures == failures + 1);
+
+  // The late fragment starts a new reassembly, which a newer message ends.
+  raw_send_fragment(sock, 1, 2, num_bytes);
+  for (int i = 0; i < 3; ++i) raw_send_fragment(sock, 2, i, num_bytes);
+  for (int i = 0; i < 100 && num_messages == 0; ++i) msg_runloop(5);
+  test_that(num_messages == 1);
+  test_that(last_message_ok);
+  test_that(msg_get_stats().num_reassembly_failures == failures + 2);
+  test_that(msg_get_stats().num_inbound_bytes == 0);
+
+  msg_set_fragmentation(1400, 1 * msg_sec);
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+// Fragments that disagree with the first one of their message are dropped,
+// and the message is still reassembled from the rest.
+int inconsistent_fragments_test() {
+  listen_and_reset();
+  uint64_t failures = msg_get_stats().num_reassembly_failures;
+
+  int sock = open_raw_peer();
+  uint32_t num_bytes = 3 * slice_len;
+  raw_send_fragment(sock, 1, 0, num_bytes);
+  raw_send_slice(sock, 1, 1, 4, num_bytes, slice_len, slice_len);
+  raw_send_slice(sock, 1, 1, 3, num_bytes + 1, slice_len, slice_len);
+  // A short slice would leave a gap that a count of bytes wouldn't notice.
+  raw_send_slice(sock, 1, 1, 3, num_bytes, slice_len / 2, slice_len / 2);
+  raw_send_slice(sock, 1, 2, 3, num_bytes, 2 * slice_len + slice_len / 2,
+                 slice_len / 2);
+  run_loop_for(20 * msg_ms);
+  test_that(num_messages == 0);
+
+  raw_send_fragment(sock, 1, 1, num_bytes);
+  raw_send_fragment(sock, 1, 2, num_bytes);
+  for (int i = 0; i < 100 && num_messages == 0; ++i) msg_runloop(5);
+  test_that(num_messages == 1);
+  test_that(last_message_len == num_bytes);
+  test_that(last_message_ok);
+  test_that(msg_get_stats().num_reassembly_failures == failures);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(round_trip_test, out_of_order_test, incomplete_message_test,
+            inconsistent_fragments_test);
+  return end_all_tests();
+}
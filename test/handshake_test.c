@@ -0,0 +1,194 @@
+// handshake_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the optional handshake that tells each side its peer's protocol
+// version and capabilities.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define all_capabilities \
+  (msg_cap_fragments | msg_cap_reliable | msg_cap_packing | msg_cap_compression)
+
+msg_Conn *listening_conn;
+msg_Conn *server_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_messages;
+int num_reliable;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+
+  // Handshakes aren't delivered as messages.
+  if (event == msg_message) {
+    server_conn = conn;
+    num_messages++;
+    if (strcmp(msg_as_str(data), "reliable") == 0) num_reliable++;
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+void reset() {
+  listening_conn  = NULL;
+  server_conn     = NULL;
+  client_conn     = NULL;
+  listening_ended = false;
+  num_messages    = 0;
+  num_reliable    = 0;
+}
+
+// Listens on address, connects to it, and has the client send one message, so
+// that the server learns its conn to the client. The handshake is on for the
+// client's hello when is_client_on is true, and for the server's when
+// is_server_on is true.
+int start_conns(const char *address, int is_client_on, int is_server_on) {
+  reset();
+  msg_set_handshake(is_server_on);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+
+  msg_set_handshake(is_client_on);
+  msg_connect(address, client_update, msg_no_context);
+  for (int i = 0; i < 100 && client_conn == NULL; ++i) msg_runloop(5);
+  test_that(client_conn != NULL);
+  msg_set_handshake(is_server_on);
+
+  msg_Data data = msg_new_data("hello");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  for (int i = 0; i < 100 && num_messages < 1; ++i) msg_runloop(5);
+  test_that(num_messages == 1);
+  test_that(server_conn != NULL);
+
+  // Let any hello sent in answer arrive.
+  for (int i = 0; i < 4; ++i) msg_runloop(5);
+  return test_success;
+}
+
+int end_conns() {
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  for (int i = 0; i < 100 && !listening_ended; ++i) msg_runloop(5);
+  test_that(listening_ended);
+  msg_set_handshake(false);
+  return test_success;
+}
+
+// Checks that both sides of the conns know each other's version and
+// capabilities.
+int check_peers_known() {
+  test_that(msg_peer_version(client_conn) == 1);
+  test_that(msg_peer_version(server_conn) == 1);
+  test_that(msg_peer_capabilities(client_conn) == all_capabilities);
+  test_that(msg_peer_capabilities(server_conn) == all_capabilities);
+  return test_success;
+}
+
+int run_handshake(const char *address) {
+  test_that(start_conns(address, true, true) == test_success);
+  test_that(num_messages == 1);
+  test_that(check_peers_known() == test_success);
+  return end_conns();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// With handshakes on, both ends of a tcp conn learn about each other.
+int tcp_test() {
+  return run_handshake("tcp://127.0.0.1:2468");
+}
+
+// The same holds for udp, where the hello is the first datagram.
+int udp_test() {
+  return run_handshake("udp://127.0.0.1:2469");
+}
+
+// And for mem:// conns, which handshake as they connect.
+int mem_test() {
+  return run_handshake("mem://handshake_test");
+}
+
+// A side with handshakes off still answers a hello. Over udp, the server's
+// side of the conn starts only as the client's first message arrives.
+int one_sided_test() {
+  test_that(start_conns("udp://127.0.0.1:2470", true, false) == test_success);
+  test_that(check_peers_known() == test_success);
+  test_that(end_conns() == test_success);
+
+  test_that(start_conns("udp://127.0.0.1:2471", false, true) == test_success);
+  test_that(check_peers_known() == test_success);
+  return end_conns();
+}
+
+// Without handshakes, peers are unknown, and every feature is still used.
+int off_test() {
+  test_that(start_conns("udp://127.0.0.1:2472", false, false) == test_success);
+  test_that(msg_peer_version(client_conn) == 0);
+  test_that(msg_peer_version(server_conn) == 0);
+  test_that(msg_peer_capabilities(client_conn) == 0);
+
+  msg_Data data = msg_new_data("reliable");
+  msg_send_reliable(client_conn, data, true);
+  msg_delete_data(data);
+  for (int i = 0; i < 100 && num_reliable < 1; ++i) msg_runloop(5);
+  test_that(num_reliable == 1);
+  return end_conns();
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+
+  start_all_tests(argv[0]);
+  run_tests(tcp_test, udp_test, mem_test, one_sided_test, off_test);
+  return end_all_tests();
+}
@@ -0,0 +1,304 @@
+// heartbeat_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for udp heartbeats, lost-peer detection, and idle eviction.
+// Besides msgbox conns, these tests use a plain udp socket as a peer that
+// can go quiet without closing anything, as a crashed process would.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+#define interval   (20 * msg_ms)
+#define lost_after (100 * msg_ms)
+
+// These match the message_type values used on the wire.
+#define wire_one_way   0
+#define wire_heartbeat 3
+
+int port;
+
+msg_Conn *listening_conn;
+int num_ready;
+int num_messages;
+int num_lost;
+int64_t last_message_at;
+int64_t lost_at;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)        listening_conn = conn;
+  if (event == msg_connection_ready) num_ready++;
+  if (event == msg_message) {
+    num_messages++;
+    last_message_at = msg_loop_now();
+  }
+  if (event == msg_connection_lost) {
+    num_lost++;
+    lost_at = msg_loop_now();
+  }
+}
+
+void start_listening() {
+  num_ready    = 0;
+  num_messages = 0;
+  num_lost     = 0;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+}
+
+void listen_and_reset() {
+  msg_set_heartbeat(interval, lost_after);
+  start_listening();
+}
+
+void unlisten() {
+  msg_unlisten(listening_conn);
+  msg_runloop(0);
+  port++;
+}
+
+void run_loop_for(int64_t duration) {
+  int64_t end = msg_loop_now() + duration;
+  while (msg_loop_now() < end) msg_runloop(5);
+}
+
+// Returns a non-blocking udp socket connected to the server.
+int open_raw_peer() {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  return sock;
+}
+
+void raw_send(int sock, uint16_t message_type, const char *str) {
+  char buffer[64];
+  uint32_t num_bytes = str ? (uint32_t)strlen(str) + 1 : 0;
+  uint16_t type_n    = htons(message_type);
+  uint16_t reply_id  = 0;
+  uint32_t bytes_n   = htonl(num_bytes);
+  memcpy(buffer,     &type_n,   2);
+  memcpy(buffer + 2, &reply_id, 2);
+  memcpy(buffer + 4, &bytes_n,  4);
+  if (str) memcpy(buffer + 8, str, num_bytes);
+  send(sock, buffer, 8 + num_bytes, 0);
+}
+
+// Returns the number of heartbeats waiting in the socket.
+int raw_count_heartbeats(int sock) {
+  int count = 0;
+  char buffer[64];
+  while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) >= 8) {
+    uint16_t type_n;
+    memcpy(&type_n, buffer, 2);
+    if (ntohs(type_n) == wire_heartbeat) count++;
+  }
+  return count;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Heartbeats are off until msg_set_heartbeat is called, as peers may not
+// understand them.
+int default_off_test() {
+  start_listening();
+
+  int sock = open_raw_peer();
+  raw_send(sock, wire_one_way, "hello");
+  while (num_messages == 0) msg_runloop(5);
+
+  // This is well past the interval heartbeats would have had by default.
+  run_loop_for(1500 * msg_ms);
+  test_that(raw_count_heartbeats(sock) == 0);
+  test_that(num_lost == 0);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+// A peer that goes quiet is reported as lost, and it's a new peer if it
+// comes back.
+int lost_peer_test() {
+  listen_and_reset();
+
+  int sock = open_raw_peer();
+  raw_send(sock, wire_one_way, "hello");
+  while (num_messages == 0) msg_runloop(5);
+  test_that(num_ready == 1);
+
+  while (num_lost == 0) msg_runloop(5);
+  int64_t silence = lost_at - last_message_at;
+  test_printf("Peer was lost after %lld ns of silence.\n", (long long)silence);
+  test_that(silence >= lost_after);
+  test_that(silence <= lost_after + 3 * interval);
+
+  // The server sent heartbeats until the peer was lost.
+  int num_beats = raw_count_heartbeats(sock);
+  test_printf("The peer received %d heartbeats.\n", num_beats);
+  test_that(num_beats >= 3);
+
+  raw_send(sock, wire_one_way, "hello again");
+  while (num_messages < 2) msg_runloop(5);
+  test_that(num_ready == 2);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+// A peer that only sends heartbeats stays connected; heartbeats have no
+// callbacks of their own.
+int heartbeats_keep_peer_test() {
+  listen_and_reset();
+
+  int sock = open_raw_peer();
+  for (int i = 0; i < 15; ++i) {
+    raw_send(sock, wire_heartbeat, NULL);
+    run_loop_for(interval);
+  }
+  test_that(num_ready == 1);
+  test_that(num_messages == 0);
+  test_that(num_lost == 0);
+
+  while (num_lost == 0) msg_runloop(5);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+int client_lost;
+msg_Conn *client_conn;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+  if (event == msg_connection_ready) client_conn = conn;
+  if (event == msg_connection_lost)  client_lost = true;
+}
+
+// Two msgbox peers with nothing to say keep each other alive.
+int idle_peers_test() {
+  listen_and_reset();
+  client_lost = false;
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  run_loop_for(4 * lost_after);
+  test_that(num_ready == 1);
+  test_that(num_lost == 0);
+  test_that(!client_lost);
+
+  // Turning heartbeats off stops both the heartbeats and the checks.
+  msg_set_heartbeat(0, 0);
+  run_loop_for(2 * lost_after);
+  test_that(num_lost == 0);
+  test_that(!client_lost);
+
+  msg_disconnect(client_conn);
+  unlisten();
+  return test_success;
+}
+
+#define num_idle_peers 100
+#define idle_timeout   (150 * msg_ms)
+
+// Peers that send heartbeats but no messages are evicted, and the stats
+// account for them.
+int idle_eviction_test() {
+  listen_and_reset();
+  msg_set_idle_timeout(idle_timeout);
+  msg_Stats before = msg_get_stats();
+
+  int busy_sock = open_raw_peer();
+  int idle_socks[num_idle_peers];
+  for (int i = 0; i < num_idle_peers; ++i) {
+    idle_socks[i] = open_raw_peer();
+    raw_send(idle_socks[i], wire_one_way, "hello");
+  }
+  while (num_messages < num_idle_peers) msg_runloop(5);
+  test_that(msg_get_stats().num_live_peers == before.num_live_peers +
+                                              num_idle_peers);
+
+  int64_t start = msg_loop_now();
+  while (num_lost < num_idle_peers) {
+    raw_send(busy_sock, wire_one_way, "still here");
+    for (int i = 0; i < num_idle_peers; ++i) {
+      raw_send(idle_socks[i], wire_heartbeat, NULL);
+    }
+    run_loop_for(interval);
+    test_that(msg_loop_now() - start < 4 * idle_timeout);
+  }
+  test_that(msg_loop_now() - start >= idle_timeout - interval);
+
+  msg_Stats after = msg_get_stats();
+  test_that(after.num_live_peers == before.num_live_peers + 1);
+  test_that(after.num_evicted_peers == before.num_evicted_peers +
+                                       num_idle_peers);
+  test_that(after.num_lost_peers == before.num_lost_peers);
+
+  msg_set_idle_timeout(0);
+  for (int i = 0; i < num_idle_peers; ++i) close(idle_socks[i]);
+  close(busy_sock);
+  unlisten();
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(default_off_test, lost_peer_test, heartbeats_keep_peer_test,
+            idle_peers_test, idle_eviction_test);
+  return end_all_tests();
+}
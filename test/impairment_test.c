@@ -0,0 +1,260 @@
+// impairment_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for fault injection. A client and server in the same process talk
+// over loopback udp, with faults injected into the client's sends or the
+// server's receives.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define num_to_send 100
+#define message_len 100  // Small, so that loopback doesn't drop a burst.
+
+int port;
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+msg_Conn  server_peer;  // A copy of the listening conn, at the client.
+int listening_ended;
+int num_messages;
+int num_out_of_order;
+int last_index;
+int64_t last_arrival;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event == msg_message) {
+    // Each message starts with its index.
+    int index;
+    memcpy(&index, data.bytes, sizeof(index));
+    if (index < last_index) num_out_of_order++;
+    last_index   = index;
+    last_arrival = msg_loop_now();
+    server_peer  = *conn;
+    num_messages++;
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+// Listens, and connects a client that's sent one message, so that the server
+// has seen it.
+void start_conns() {
+  listening_ended  = false;
+  client_conn      = NULL;
+  num_messages     = 0;
+  num_out_of_order = 0;
+  last_index       = -1;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+}
+
+void end_conns() {
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+}
+
+void send_indexed(int num_messages) {
+  msg_Data data = msg_new_data_space(message_len);
+  memset(data.bytes, 'x', message_len);
+  for (int i = 0; i < num_messages; ++i) {
+    memcpy(data.bytes, &i, sizeof(i));
+    msg_send(client_conn, data);
+  }
+  msg_delete_data(data);
+}
+
+void run_loop_for(int64_t duration) {
+  int64_t end = msg_loop_now() + duration;
+  while (msg_loop_now() < end) msg_runloop(5);
+}
+
+// Sends num_to_send messages with the given loss rate and seed, and returns the
+// number lost.
+int run_lossy(double loss_rate, uint64_t seed) {
+  start_conns();
+  msg_Impairment impairment = { .loss_rate = loss_rate, .seed = seed };
+  msg_set_impairment(client_conn, impairment);
+  send_indexed(num_to_send);
+  run_loop_for(100 * msg_ms);
+
+  msg_ImpairmentStats stats = msg_impairment_stats(client_conn);
+  test_printf("%d of %d messages were lost.\n", (int)stats.num_dropped,
+              num_to_send);
+  int is_consistent = (stats.num_sent + stats.num_dropped == num_to_send &&
+                       num_messages == (int)stats.num_sent);
+  end_conns();
+  return is_consistent ? (int)stats.num_dropped : -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Loss drops about the given fraction, and the same seed drops the same ones.
+int loss_test() {
+  int num_lost = run_lossy(0.3, 1);
+  test_that(num_lost > num_to_send / 10 && num_lost < num_to_send / 2);
+  test_that(run_lossy(0.3, 1) == num_lost);
+  test_that(run_lossy(0.3, 2) >= 0);
+  return test_success;
+}
+
+// Delayed datagrams arrive after the delay, and in order without jitter.
+int delay_test() {
+  start_conns();
+  msg_Impairment impairment = { .delay = 60 * msg_ms };
+  msg_set_impairment(client_conn, impairment);
+
+  int64_t start = msg_loop_now();
+  send_indexed(10);
+  test_that(msg_impairment_stats(client_conn).num_queued_bytes > 0);
+  run_loop_for(30 * msg_ms);
+  test_that(num_messages == 0);
+  for (int i = 0; i < 100 && num_messages < 10; ++i) msg_runloop(5);
+  test_that(num_messages == 10);
+  test_that(num_out_of_order == 0);
+  test_that(last_arrival - start >= 60 * msg_ms);
+  test_that(msg_impairment_stats(client_conn).num_queued_bytes == 0);
+
+  end_conns();
+  return test_success;
+}
+
+// Duplicated datagrams arrive twice.
+int duplicate_test() {
+  start_conns();
+  msg_Impairment impairment = { .duplicate_rate = 1 };
+  msg_set_impairment(client_conn, impairment);
+  send_indexed(10);
+  run_loop_for(50 * msg_ms);
+  test_that(num_messages == 20);
+  test_that(msg_impairment_stats(client_conn).num_duplicated == 10);
+  end_conns();
+  return test_success;
+}
+
+// Reordered datagrams pass the delayed ones ahead of them.
+int reorder_test() {
+  start_conns();
+  msg_Impairment impairment = { .delay = 20 * msg_ms, .reorder_rate = 0.25,
+                                .seed  = 3 };
+  msg_set_impairment(client_conn, impairment);
+  send_indexed(40);
+  for (int i = 0; i < 100 && num_messages < 40; ++i) msg_runloop(5);
+  test_that(num_messages == 40);
+  test_printf("%d messages arrived out of order.\n", num_out_of_order);
+  test_that(num_out_of_order > 0);
+  test_that(msg_impairment_stats(client_conn).num_reordered > 0);
+  end_conns();
+  return test_success;
+}
+
+// A bandwidth cap spreads a burst out.
+int rate_test() {
+  start_conns();
+  size_t max_rate = 10 * 1024;
+  msg_Impairment impairment = { .max_rate = max_rate };
+  msg_set_impairment(client_conn, impairment);
+
+  int64_t start = msg_loop_now();
+  send_indexed(20);
+  for (int i = 0; i < 200 && num_messages < 20; ++i) msg_runloop(5);
+  double elapsed  = (double)(last_arrival - start) / msg_sec;
+  double expected = 20.0 * message_len / max_rate;
+  test_printf("The burst took %.3fs; the cap alone takes %.3fs.\n",
+              elapsed, expected);
+  test_that(num_messages == 20);
+  test_that(elapsed > expected * 0.8);
+  end_conns();
+  return test_success;
+}
+
+// Inbound loss drops datagrams from a peer on receipt, and impairing conn NULL
+// applies to every peer.
+int inbound_test() {
+  start_conns();
+  send_indexed(1);
+  for (int i = 0; i < 100 && num_messages < 1; ++i) msg_runloop(5);
+  test_that(num_messages == 1);
+
+  msg_Impairment impairment = { .inbound_loss_rate = 1 };
+  msg_set_impairment(NULL, impairment);
+  send_indexed(10);
+  run_loop_for(50 * msg_ms);
+  test_that(num_messages == 1);
+  test_that(msg_impairment_stats(&server_peer).num_inbound_dropped == 10);
+  test_that(msg_impairment_stats(NULL).num_inbound_dropped == 10);
+
+  // An all-zero impairment turns it off.
+  msg_set_impairment(NULL, (msg_Impairment) { .seed = 0 });
+  send_indexed(10);
+  for (int i = 0; i < 100 && num_messages < 11; ++i) msg_runloop(5);
+  test_that(num_messages == 11);
+
+  end_conns();
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(loss_test, delay_test, duplicate_test, reorder_test, rate_test,
+            inbound_test);
+  return end_all_tests();
+}
@@ -0,0 +1,338 @@
+// inbound_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for inbound tcp buffering: buffers that grow as bytes arrive,
+// streamed messages, the max message size, and the inbound buffer limit.
+// Besides msgbox conns, these tests use plain tcp sockets as peers that can
+// announce a message in a header and then send as little of it as they like.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk"
+};
+
+// This matches the message_type value used on the wire.
+#define wire_one_way 0
+
+#define large_len (1024 * 1024)
+
+int port;
+
+msg_Conn *listening_conn;
+int num_ready;
+int num_messages;
+int num_closed;
+int num_lost;
+int num_errors;
+int listening_ended;
+int large_message_ok;
+
+// These track chunks when the server streams messages.
+int    use_streaming;
+int    num_chunks;
+int    num_final_chunks;
+size_t next_offset;
+size_t max_inbound_bytes;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) {
+    test_printf("Server: Error: %s\n", msg_error_str(data));
+    num_errors++;
+  }
+
+  if (event == msg_listening)         listening_conn = conn;
+  if (event == msg_listening_ended)   listening_ended = true;
+  if (event == msg_connection_ready)  num_ready++;
+
+  if (event == msg_connection_ready && use_streaming) {
+    msg_set_streaming(conn, true);
+  }
+
+  if (event == msg_message_chunk) {
+    msg_Chunk chunk = msg_chunk_info(data);
+    num_chunks++;
+    test_that(chunk.offset == next_offset);
+    for (int i = 0; i < data.num_bytes; ++i) {
+      if (data.bytes[i] != (char)((chunk.offset + i) * 7)) {
+        test_failed("Chunk byte %zu is wrong.", chunk.offset + i);
+      }
+    }
+    next_offset += data.num_bytes;
+    test_that(chunk.is_final == (next_offset == chunk.total_bytes));
+    if (chunk.is_final) {
+      num_final_chunks++;
+      next_offset = 0;
+    }
+    size_t inbound_bytes = msg_get_stats().num_inbound_bytes;
+    if (inbound_bytes > max_inbound_bytes) max_inbound_bytes = inbound_bytes;
+  }
+  if (event == msg_connection_closed) num_closed++;
+  if (event == msg_connection_lost)   num_lost++;
+
+  if (event == msg_message) {
+    num_messages++;
+    if (data.num_bytes == large_len) {
+      large_message_ok = true;
+      for (int i = 0; i < large_len; ++i) {
+        if (data.bytes[i] != (char)(i * 7)) large_message_ok = false;
+      }
+    }
+  }
+}
+
+void listen_and_reset() {
+  num_ready         = 0;
+  num_messages      = 0;
+  num_closed        = 0;
+  num_lost          = 0;
+  num_errors        = 0;
+  listening_ended   = false;
+  large_message_ok  = false;
+  use_streaming     = false;
+  num_chunks        = 0;
+  num_final_chunks  = 0;
+  next_offset       = 0;
+  max_inbound_bytes = 0;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+}
+
+void unlisten() {
+  msg_set_max_message_size(0);
+  msg_set_inbound_limit(0);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+}
+
+// Returns a blocking tcp socket connected to the server.
+int open_raw_peer() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  while (num_ready == 0) msg_runloop(5);
+  return sock;
+}
+
+// Sends a header announcing a one-way message of num_bytes bytes, followed by
+// num_sent bytes of it.
+void raw_send_partial(int sock, uint32_t num_bytes, uint32_t num_sent) {
+  char header[8];
+  uint16_t type_n   = htons(wire_one_way);
+  uint16_t reply_id = 0;
+  uint32_t bytes_n  = htonl(num_bytes);
+  memcpy(header,     &type_n,   2);
+  memcpy(header + 2, &reply_id, 2);
+  memcpy(header + 4, &bytes_n,  4);
+  send(sock, header, 8, 0);
+
+  char *body = calloc(1, num_sent + 1);
+  send(sock, body, num_sent, 0);
+  free(body);
+}
+
+// Runs the loop until the server has seen num_events events of some kind.
+void run_until(int *count, int num_events) {
+  for (int i = 0; i < 400 && *count < num_events; ++i) msg_runloop(5);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// A peer that announces a huge message and sends a little of it only costs
+// the server about what it sent.
+int lazy_growth_test() {
+  listen_and_reset();
+  size_t before = msg_get_stats().num_inbound_bytes;
+
+  int sock = open_raw_peer();
+  raw_send_partial(sock, 1 << 30, 10000);
+  for (int i = 0; i < 20; ++i) msg_runloop(5);
+
+  size_t held = msg_get_stats().num_inbound_bytes - before;
+  test_printf("Holding %zu bytes for a 1 GB message.\n", held);
+  test_that(held >= 10000);
+  test_that(held <= 4 * 10000);
+
+  close(sock);
+  run_until(&num_lost, 1);
+  test_that(num_lost == 1);
+  test_that(msg_get_stats().num_inbound_bytes == before);
+
+  unlisten();
+  return test_success;
+}
+
+msg_Conn *client_conn;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+// A message much larger than the initial buffer arrives intact.
+int large_message_test() {
+  listen_and_reset();
+  client_conn = NULL;
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  msg_Data data = msg_new_data_space(large_len);
+  for (int i = 0; i < large_len; ++i) data.bytes[i] = (char)(i * 7);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+
+  run_until(&num_messages, 1);
+  test_that(num_messages == 1);
+  test_that(large_message_ok);
+  test_that(num_errors == 0);
+
+  msg_disconnect(client_conn);
+  run_until(&num_closed, 1);
+  unlisten();
+  return test_success;
+}
+
+// A streaming conn receives a large message as a series of chunks, and the
+// message is never held whole.
+int streaming_test() {
+  listen_and_reset();
+  use_streaming = true;
+  client_conn   = NULL;
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  while (num_ready == 0) msg_runloop(5);
+
+  msg_Data data = msg_new_data_space(large_len);
+  for (int i = 0; i < large_len; ++i) data.bytes[i] = (char)(i * 7);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+
+  // A small message comes as a single, final chunk.
+  data = msg_new_data_space(5);
+  for (int i = 0; i < 5; ++i) data.bytes[i] = (char)(i * 7);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+
+  run_until(&num_final_chunks, 2);
+  test_printf("Received %d chunks; held at most %zu bytes.\n",
+              num_chunks, max_inbound_bytes);
+  test_that(num_final_chunks == 2);
+  test_that(num_chunks > 2);
+  test_that(num_messages == 0);
+  test_that(max_inbound_bytes <= 64 * 1024);
+  test_that(num_errors == 0);
+
+  msg_disconnect(client_conn);
+  run_until(&num_closed, 1);
+  unlisten();
+  return test_success;
+}
+
+// A message over the max size is refused, and its conn is closed.
+int max_message_size_test() {
+  listen_and_reset();
+  msg_set_max_message_size(1000);
+
+  int sock = open_raw_peer();
+  raw_send_partial(sock, 1000, 1000);
+  run_until(&num_messages, 1);
+  test_that(num_messages == 1);
+
+  raw_send_partial(sock, 1001, 1001);
+  run_until(&num_closed, 1);
+  test_that(num_errors == 1);
+  test_that(num_closed == 1);
+  test_that(num_messages == 1);
+
+  // The peer sees the close.
+  char byte;
+  test_that(recv(sock, &byte, 1, 0) <= 0);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+// A peer whose message outgrows the inbound limit is refused, and other
+// messages still get through.
+int inbound_limit_test() {
+  listen_and_reset();
+  msg_set_inbound_limit(16 * 1024);
+
+  int sock = open_raw_peer();
+  raw_send_partial(sock, 1000, 1000);
+  run_until(&num_messages, 1);
+  test_that(num_messages == 1);
+
+  raw_send_partial(sock, large_len, 64 * 1024);
+  run_until(&num_closed, 1);
+  test_that(num_errors == 1);
+  test_that(num_closed == 1);
+  test_that(msg_get_stats().num_inbound_bytes == 0);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(lazy_growth_test, large_message_test, streaming_test,
+            max_message_size_test, inbound_limit_test);
+  return end_all_tests();
+}
@@ -0,0 +1,252 @@
+// local_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for unix:// and unixgram:// conns, which should act like tcp and udp
+// conns between processes on the same host.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define large_len (200 * 1024)  // Big enough to need many reads or fragments.
+
+char path[64];
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int server_ready;
+int server_closed;
+int num_messages;
+int num_replies;
+int large_message_ok;
+char server_peer_address[128];
+
+msg_Data new_pattern_data(size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i * 11);
+  return data;
+}
+
+int has_pattern(msg_Data data) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i * 11)) return false;
+  }
+  return true;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)         listening_conn = conn;
+  if (event == msg_listening_ended)   listening_ended = true;
+  if (event == msg_connection_ready)  server_ready = true;
+  if (event == msg_connection_closed) server_closed = true;
+
+  if (event == msg_message) {
+    num_messages++;
+    if (data.num_bytes == large_len) large_message_ok = has_pattern(data);
+    snprintf(server_peer_address, 128, "%s", msg_address_str(conn));
+  }
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "request");
+    msg_Data reply = msg_new_data("reply");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+  if (event == msg_reply) {
+    num_replies++;
+    test_str_eq(msg_as_str(data), "reply");
+  }
+}
+
+void reset() {
+  listening_conn   = NULL;
+  client_conn      = NULL;
+  listening_ended  = false;
+  server_ready     = false;
+  server_closed    = false;
+  num_messages     = 0;
+  num_replies      = 0;
+  large_message_ok = false;
+  server_peer_address[0] = '\0';
+}
+
+int is_socket_file(const char *file_path) {
+  struct stat file_stat;
+  return stat(file_path, &file_stat) == 0 && S_ISSOCK(file_stat.st_mode);
+}
+
+// Runs a message, a large message, and a request through the given scheme,
+// then disconnects and unlistens.
+int run_round_trip(const char *scheme) {
+  reset();
+
+  char address[128];
+  snprintf(address, 128, "%s://%s", scheme, path);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+  test_that(is_socket_file(path));
+
+  msg_connect(address, client_update, msg_no_context);
+  for (int i = 0; i < 100 && client_conn == NULL; ++i) msg_runloop(5);
+  test_that(client_conn != NULL);
+  test_str_eq(msg_address_str(client_conn), address);
+  test_str_eq(msg_ip_str(client_conn), path);
+
+  msg_Data data = msg_new_data("hello");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  data = new_pattern_data(large_len);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  // Like udp, unixgram drops datagrams that find the peer's buffer full.
+  for (int i = 0; i < 100 && num_messages < 2; ++i) msg_runloop(5);
+
+  data = msg_new_data("request");
+  msg_get(client_conn, data, msg_no_context);
+  msg_delete_data(data);
+  for (int i = 0; i < 100 && num_replies < 1; ++i) msg_runloop(5);
+  test_that(server_ready);
+  test_that(num_messages == 2);
+  test_that(large_message_ok);
+  test_that(num_replies == 1);
+  test_printf("The server saw its peer as %s.\n", server_peer_address);
+  test_that(strncmp(server_peer_address, scheme, strlen(scheme)) == 0);
+
+  msg_disconnect(client_conn);
+  for (int i = 0; i < 100 && !server_closed; ++i) msg_runloop(5);
+  test_that(server_closed);
+
+  msg_unlisten(listening_conn);
+  for (int i = 0; i < 100 && !listening_ended; ++i) msg_runloop(5);
+  test_that(listening_ended);
+  test_that(!is_socket_file(path));
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// unix:// conns carry messages, requests, and replies like tcp conns.
+int stream_test() {
+  return run_round_trip("unix");
+}
+
+// unixgram:// conns carry them like udp conns, with fragmentation.
+int datagram_test() {
+  return run_round_trip("unixgram");
+}
+
+void error_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) num_messages++;
+}
+
+// A listener replaces a stale socket file, but not any other kind of file.
+int stale_path_test() {
+  reset();
+
+  // Leave a socket file behind, as a crashed server would.
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  test_that(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  close(sock);
+  test_that(is_socket_file(path));
+
+  char address[128];
+  snprintf(address, 128, "unix://%s", path);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+  msg_unlisten(listening_conn);
+  for (int i = 0; i < 100 && !listening_ended; ++i) msg_runloop(5);
+  test_that(!is_socket_file(path));
+
+  FILE *file = fopen(path, "w");
+  fclose(file);
+  msg_listen(address, error_update);
+  msg_runloop(0);
+  test_that(num_messages == 1);  // The bind failed.
+  struct stat file_stat;
+  test_that(stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode));
+  unlink(path);
+  return test_success;
+}
+
+// Malformed local addresses are reported as errors.
+int bad_address_test() {
+  reset();
+  msg_connect("unix://", error_update, msg_no_context);
+  msg_runloop(0);
+  test_that(num_messages == 1);
+
+  char long_path[256];
+  memset(long_path, 'a', sizeof(long_path));
+  memcpy(long_path, "unix://", 7);
+  long_path[sizeof(long_path) - 1] = '\0';
+  msg_connect(long_path, error_update, msg_no_context);
+  msg_runloop(0);
+  test_that(num_messages == 2);
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  snprintf(path, sizeof(path), "/tmp/msgbox_local_test.%d", getpid());
+
+  start_all_tests(argv[0]);
+  run_tests(stream_test, datagram_test, stale_path_test, bad_address_test);
+  return end_all_tests();
+}
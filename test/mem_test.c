@@ -0,0 +1,324 @@
+// mem_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for mem:// conns, which act like tcp conns between a client and server
+// in the same process, and for the virtual clock.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define large_len   (200 * 1024)
+#define num_clients 10000
+
+#define address "mem://sim"
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_server_ready;
+int num_client_ready;
+int num_server_closed;
+int num_client_closed;
+int num_messages;
+int num_replies;
+int num_errors;
+int num_timeouts;
+int num_gets_ended;
+void *ended_get_context;
+int num_timer_fires;
+int large_message_ok;
+char server_peer_address[128];
+
+msg_Data new_pattern_data(size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i * 11);
+  return data;
+}
+
+int has_pattern(msg_Data data) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i * 11)) return false;
+  }
+  return true;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)         listening_conn = conn;
+  if (event == msg_listening_ended)   listening_ended = true;
+  if (event == msg_connection_ready)  num_server_ready++;
+  if (event == msg_connection_closed) num_server_closed++;
+
+  if (event == msg_message) {
+    num_messages++;
+    if (data.num_bytes == large_len) large_message_ok = has_pattern(data);
+    snprintf(server_peer_address, 128, "%s", msg_address_str(conn));
+  }
+  // A request for "silence" is never replied to.
+  if (event == msg_request && strcmp(msg_as_str(data), "silence") != 0) {
+    test_str_eq(msg_as_str(data), "request");
+    msg_Data reply = msg_new_data("reply");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_connection_ready) {
+    client_conn = conn;
+    num_client_ready++;
+  }
+  if (event == msg_connection_closed) num_client_closed++;
+  if (event == msg_reply) {
+    num_replies++;
+    test_str_eq(msg_as_str(data), "reply");
+  }
+  if (event == msg_error) {
+    num_errors++;
+    if (strcmp(msg_as_str(data), "tcp get timed out") == 0) num_timeouts++;
+    // A msg_get pending at a disconnect ends before the conn closes.
+    if (strcmp(msg_as_str(data), "tcp get ended by a disconnect") == 0) {
+      test_that(num_client_closed == 0);
+      num_gets_ended++;
+      ended_get_context = conn->reply_context;
+    }
+  }
+}
+
+// Each client of scale_test sends a request once it's connected.
+void scale_client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_connection_ready) {
+    msg_Data request = msg_new_data("request");
+    msg_get(conn, request, msg_no_context);
+    msg_delete_data(request);
+  }
+  client_update(conn, event, data);
+}
+
+void reset() {
+  listening_conn    = NULL;
+  client_conn       = NULL;
+  listening_ended   = false;
+  num_server_ready  = 0;
+  num_client_ready  = 0;
+  num_server_closed = 0;
+  num_client_closed = 0;
+  num_messages      = 0;
+  num_replies       = 0;
+  num_errors        = 0;
+  num_timeouts      = 0;
+  num_gets_ended    = 0;
+  ended_get_context = NULL;
+  num_timer_fires   = 0;
+  large_message_ok  = false;
+  server_peer_address[0] = '\0';
+}
+
+// Listens on address and connects a client to it. Mem conns never wait on
+// the os, so each step takes a single loop iteration.
+int start_conns() {
+  reset();
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+
+  msg_connect(address, client_update, msg_no_context);
+  msg_runloop(0);
+  test_that(client_conn != NULL);
+  test_that(num_server_ready == 1);
+  return test_success;
+}
+
+int end_conns() {
+  msg_unlisten(listening_conn);
+  msg_runloop(0);
+  test_that(listening_ended);
+  return test_success;
+}
+
+void timer_fired(msg_Timer *timer, void *context) {
+  num_timer_fires++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// mem:// conns carry messages, requests, and replies like tcp conns.
+int round_trip_test() {
+  test_that(start_conns() == test_success);
+  test_str_eq(msg_address_str(client_conn), address);
+
+  msg_Data data = msg_new_data("hello");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  data = new_pattern_data(large_len);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  data = msg_new_data("request");
+  msg_get(client_conn, data, msg_no_context);
+  msg_delete_data(data);
+
+  // One iteration delivers the messages, and the next one the reply.
+  msg_runloop(0);
+  msg_runloop(0);
+  test_that(num_messages == 2);
+  test_that(large_message_ok);
+  test_that(num_replies == 1);
+  test_printf("The server saw its peer as %s.\n", server_peer_address);
+  test_str_eq(server_peer_address, "mem://(unnamed)");
+
+  msg_disconnect(client_conn);
+  msg_runloop(0);
+  test_that(num_server_closed == 1);
+  test_that(num_client_closed == 1);
+
+  return end_conns();
+}
+
+// Connecting with no listener, or listening twice on a name, is an error.
+int refused_test() {
+  reset();
+  msg_connect(address, client_update, msg_no_context);
+  msg_runloop(0);
+  test_that(num_errors == 1);
+  test_that(client_conn == NULL);
+
+  test_that(start_conns() == test_success);
+  msg_listen(address, client_update);
+  msg_runloop(0);
+  test_that(num_errors == 1);
+
+  msg_disconnect(client_conn);
+  return end_conns();
+}
+
+// Many clients in one process each get a conn and a reply of their own.
+int scale_test() {
+  reset();
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+
+  for (int i = 0; i < num_clients; ++i) {
+    msg_connect(address, scale_client_update, msg_no_context);
+  }
+  // The iterations deliver the connections, the requests, and the replies.
+  for (int i = 0; i < 3; ++i) msg_runloop(0);
+  test_that(num_client_ready == num_clients);
+  test_that(num_server_ready == num_clients);
+  test_that(num_messages == 0);
+  test_that(num_replies == num_clients);
+  test_that(num_errors == 0);
+
+  return end_conns();
+}
+
+// Timeouts and timers follow the virtual clock rather than real time.
+int virtual_clock_test() {
+  test_that(start_conns() == test_success);
+  msg_use_virtual_clock(true);
+  int64_t start = msg_loop_now();
+
+  msg_Data data = msg_new_data("silence");
+  msg_get(client_conn, data, msg_no_context);
+  msg_delete_data(data);
+  msg_add_timer(300 * msg_ms, 0, timer_fired, msg_no_context);
+
+  msg_runloop(0);
+  msg_advance_clock(299 * msg_ms);
+  msg_runloop(0);
+  test_that(msg_loop_now() == start + 299 * msg_ms);
+  test_that(num_timer_fires == 0);
+
+  msg_advance_clock(1 * msg_ms);
+  msg_runloop(0);
+  test_that(num_timer_fires == 1);
+  test_that(num_timeouts == 0);
+
+  // The msg_get timeout is 1 second.
+  msg_advance_clock(800 * msg_ms);
+  msg_runloop(0);
+  test_that(num_timeouts == 1);
+
+  // A pending timer keeps the loop from waiting on real time.
+  msg_Timer *timer = msg_add_timer(msg_sec, 0, timer_fired, msg_no_context);
+  time_t real_start = time(NULL);
+  msg_runloop(5000);
+  test_that(time(NULL) - real_start <= 1);
+  msg_cancel_timer(timer);
+
+  msg_use_virtual_clock(false);
+  msg_disconnect(client_conn);
+  return end_conns();
+}
+
+// A msg_get still pending when its conn closes ends with a msg_error that
+// carries its reply_context.
+int disconnect_get_test() {
+  test_that(start_conns() == test_success);
+
+  int reply_context;
+  msg_Data data = msg_new_data("silence");
+  msg_get(client_conn, data, &reply_context);
+  msg_delete_data(data);
+  msg_runloop(0);
+
+  msg_disconnect(client_conn);
+  msg_runloop(0);
+  test_that(num_gets_ended == 1);
+  test_that(ended_get_context == &reply_context);
+  test_that(num_client_closed == 1);
+  test_that(num_timeouts == 0);
+
+  return end_conns();
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+
+  start_all_tests(argv[0]);
+  run_tests(round_trip_test, refused_test, scale_test, virtual_clock_test,
+            disconnect_get_test);
+  return end_all_tests();
+}
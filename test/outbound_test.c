@@ -0,0 +1,547 @@
+// outbound_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for outbound queues, their watermark events, and coalescing. A plain
+// tcp socket plays a peer that stops reading, so that a msgbox client's sends
+// back up; a udp peer's pacing queue backs up the same way when sent a burst.
+// Plain sockets also count the packets that coalesced sends produce, and check
+// the bytes of zero-copy sends. File sends go between msgbox conns.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define header_len   8
+#define message_len  (64 * 1024)
+#define max_messages 1024  // Stop here if the socket never backs up.
+#define high_mark    (256 * 1024)
+#define low_mark     (64 * 1024)
+
+int port;
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_blocked;
+int num_drained;
+int num_closed;
+int num_messages;
+int num_replies;
+char last_message[64];
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event == msg_message) {
+    num_messages++;
+    snprintf(last_message, sizeof(last_message), "%s", msg_as_str(data));
+  }
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "request");
+    msg_Data reply = msg_new_data("reply");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) {
+    client_conn = conn;
+    msg_set_watermarks(conn, high_mark, low_mark);
+  }
+  if (event == msg_send_blocked) num_blocked++;
+  if (event == msg_send_drained) num_drained++;
+  // A conn from an earlier test may close as this one starts.
+  if (event == msg_connection_closed && conn == client_conn) num_closed++;
+  if (event == msg_reply) {
+    num_replies++;
+    test_str_eq(msg_as_str(data), "reply");
+  }
+}
+
+void reset() {
+  client_conn     = NULL;
+  listening_ended = false;
+  num_blocked     = 0;
+  num_drained     = 0;
+  num_closed      = 0;
+  num_messages    = 0;
+  num_replies     = 0;
+}
+
+// Returns a blocking tcp socket listening on port.
+int open_raw_listener() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  int yes  = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  listen(sock, 1);
+  return sock;
+}
+
+// Connects client_conn to a raw peer on port, and sends it messages until its
+// socket backs up, and then 8 more. Returns the number sent.
+int send_until_backed_up(int listener, int *sock) {
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  *sock = accept(listener, NULL, NULL);
+
+  msg_Data data = msg_new_data_space(message_len);
+  memset(data.bytes, 'x', message_len);
+  int num_sent = 0;
+  while (num_sent < max_messages && msg_outbound_bytes(client_conn) == 0) {
+    msg_send(client_conn, data);
+    num_sent++;
+  }
+  for (int i = 0; i < 8; ++i, ++num_sent) msg_send(client_conn, data);
+  msg_delete_data(data);
+  return num_sent;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Sends to a tcp peer that isn't reading are queued rather than blocking; the
+// queue's growth and drain are reported, and every byte arrives.
+int tcp_test() {
+  reset();
+  int listener, sock;
+  listener = open_raw_listener();
+  // Go well past the high watermark.
+  int num_sent = send_until_backed_up(listener, &sock);
+  test_printf("Queued %zu bytes after %d messages.\n",
+              msg_outbound_bytes(client_conn), num_sent);
+
+  msg_runloop(0);
+  test_that(num_blocked == 1);
+  test_that(num_drained == 0);
+
+  // Read everything while running the loop to send the rest.
+  size_t num_expected = (size_t)num_sent * (header_len + message_len);
+  size_t num_read     = 0;
+  char   buffer[65536];
+  while (num_read < num_expected) {
+    msg_runloop(0);
+    long just_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (just_read > 0) num_read += just_read;
+  }
+  msg_runloop(0);
+  test_that(num_read == num_expected);
+  test_that(num_blocked == 1);
+  test_that(num_drained == 1);
+  test_that(msg_outbound_bytes(client_conn) == 0);
+
+  msg_disconnect(client_conn);
+  close(sock);
+  close(listener);
+  port++;
+  return test_success;
+}
+
+// A disconnect from a peer that isn't reading doesn't wait for it; the queued
+// bytes and the close go out as the peer reads, and then the conn closes.
+int disconnect_test() {
+  reset();
+  int listener, sock;
+  listener = open_raw_listener();
+  int num_sent = send_until_backed_up(listener, &sock);
+
+  msg_disconnect(client_conn);
+  msg_runloop(0);
+  test_that(num_closed == 0);
+
+  // Sends after the disconnect are dropped.
+  msg_Data data = msg_new_data("dropped");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+
+  size_t num_expected = (size_t)num_sent * (header_len + message_len) +
+                        header_len;  // The close message has only a header.
+  size_t num_read     = 0;
+  char   buffer[65536];
+  for (int i = 0; i < 100000 && num_closed == 0; ++i) {
+    msg_runloop(0);
+    long just_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (just_read > 0) num_read += just_read;
+  }
+  test_that(num_closed == 1);
+  long just_read;
+  while ((just_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+    num_read += just_read;
+  }
+  test_that(num_read == num_expected);
+
+  close(sock);
+  close(listener);
+  port++;
+  return test_success;
+}
+
+// A peer that never reads holds up a disconnect's close for a bounded time.
+int disconnect_timeout_test() {
+  reset();
+  int listener, sock;
+  listener = open_raw_listener();
+  send_until_backed_up(listener, &sock);
+
+  time_t start = time(NULL);
+  msg_disconnect(client_conn);
+  test_that(time(NULL) - start <= 1);
+  msg_runloop(0);
+  test_that(num_closed == 0);
+
+  while (num_closed == 0 && time(NULL) - start < 30) msg_runloop(100);
+  test_that(num_closed == 1);
+  test_printf("The conn closed after %d seconds.\n", (int)(time(NULL) - start));
+  test_that(time(NULL) - start >= 4);
+
+  close(sock);
+  close(listener);
+  port++;
+  return test_success;
+}
+
+// A udp peer's pacing queue counts as its outbound bytes.
+int udp_test() {
+  reset();
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  msg_set_watermarks(client_conn, 8000, 2000);
+  msg_set_pacing(100 * 1024);
+
+  msg_Data data = msg_new_data_space(1000);
+  memset(data.bytes, 'x', data.num_bytes);
+  for (int i = 0; i < 20; ++i) msg_send(client_conn, data);
+  msg_delete_data(data);
+  test_that(msg_outbound_bytes(client_conn) > 8000);
+
+  for (int i = 0; i < 200 && num_messages < 20; ++i) msg_runloop(5);
+  msg_runloop(0);
+  test_that(num_messages == 20);
+  test_that(num_blocked == 1);
+  test_that(num_drained == 1);
+  test_that(msg_outbound_bytes(client_conn) == 0);
+
+  msg_set_pacing(0);
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+  return test_success;
+}
+
+// A coalescing conn's sends wait for the end of the loop iteration or for a
+// msg_flush call.
+int coalescing_test() {
+  reset();
+  int listener = open_raw_listener();
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  int sock = accept(listener, NULL, NULL);
+  msg_set_coalescing(client_conn, true);
+
+  msg_Data data = msg_new_data("hi");
+  size_t message_size = header_len + data.num_bytes;
+  for (int i = 0; i < 10; ++i) msg_send(client_conn, data);
+  test_that(msg_outbound_bytes(client_conn) == 10 * message_size);
+
+  char buffer[1024];
+  usleep(10000);
+  test_that(recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) == -1);
+
+  // The whole batch goes out at the end of the iteration.
+  msg_runloop(0);
+  test_that(msg_outbound_bytes(client_conn) == 0);
+  usleep(10000);
+  test_that(recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) ==
+            10 * message_size);
+
+  msg_send(client_conn, data);
+  test_that(msg_outbound_bytes(client_conn) == message_size);
+  msg_flush(client_conn);
+  test_that(msg_outbound_bytes(client_conn) == 0);
+  usleep(10000);
+  test_that(recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) == message_size);
+  msg_delete_data(data);
+
+  msg_disconnect(client_conn);
+  close(sock);
+  close(listener);
+  port++;
+  return test_success;
+}
+
+// A coalescing udp conn packs its messages into as few datagrams as fit.
+int udp_packing_test() {
+  reset();
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  msg_set_coalescing(client_conn, true);
+
+  // Twelve 108-byte framed messages fit in a 1400-byte datagram, so 100 of
+  // them need 9 datagrams.
+  msg_Data data = msg_new_data_space(100);
+  memset(data.bytes, 'x', data.num_bytes);
+  for (int i = 0; i < 100; ++i) msg_send(client_conn, data);
+  msg_delete_data(data);
+  msg_runloop(0);
+
+  int  num_datagrams = 0;
+  long num_bytes     = 0;
+  char buffer[2048];
+  usleep(10000);
+  while (true) {
+    long just_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (just_read <= 0) break;
+    if (just_read == header_len) continue;  // Skip any heartbeat.
+    num_datagrams++;
+    num_bytes += just_read;
+    test_that(just_read <= 1400);
+  }
+  test_printf("Sent 100 messages in %d datagrams.\n", num_datagrams);
+  test_that(num_datagrams == 9);
+  test_that(num_bytes == 100 * (header_len + 100) + 9 * header_len);
+
+  msg_disconnect(client_conn);
+  close(sock);
+  port++;
+  return test_success;
+}
+
+// Packed messages, requests, and replies arrive as separate events.
+int packed_round_trip_test() {
+  reset();
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  msg_set_coalescing(client_conn, true);
+
+  for (int i = 0; i < 10; ++i) {
+    char str[16];
+    snprintf(str, 16, "message %d", i);
+    msg_Data data = msg_new_data(str);
+    msg_send(client_conn, data);
+    msg_delete_data(data);
+  }
+  msg_Data data = msg_new_data("request");
+  msg_get(client_conn, data, msg_no_context);
+  msg_delete_data(data);
+
+  for (int i = 0; i < 100 && (num_messages < 10 || num_replies < 1); ++i) {
+    msg_runloop(5);
+  }
+  test_that(num_messages == 10);
+  test_str_eq(last_message, "message 9");
+  test_that(num_replies == 1);
+
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+  return test_success;
+}
+
+// Zero-copy sends arrive intact, and their data is released once the kernel
+// is done with it.
+int zerocopy_test() {
+  reset();
+  int listener = open_raw_listener();
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+  int sock = accept(listener, NULL, NULL);
+
+  int num_sends = 8;
+  for (int i = 0; i < num_sends; ++i) {
+    msg_Data data = msg_new_data_space(message_len);
+    for (int j = 0; j < message_len; ++j) data.bytes[j] = (char)(i + j * 7);
+    msg_send_zerocopy(client_conn, data);
+  }
+
+  // Read every message, checking each byte past its header.
+  size_t msg_size   = header_len + message_len;
+  size_t total_size = num_sends * msg_size;
+  size_t num_read   = 0;
+  int    num_wrong  = 0;
+  char   buffer[4096];
+  for (int i = 0; i < 1000 && num_read < total_size; ++i) {
+    msg_runloop(1);
+    long just_read;
+    while ((just_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+      for (long k = 0; k < just_read; ++k, ++num_read) {
+        size_t msg_index = num_read / msg_size;
+        size_t offset    = num_read % msg_size;
+        if (offset < header_len) continue;
+        int j = (int)(offset - header_len);
+        if (buffer[k] != (char)(msg_index + j * 7)) num_wrong++;
+      }
+    }
+  }
+  test_that(num_read == total_size);
+  test_that(num_wrong == 0);
+
+  for (int i = 0; i < 200 && msg_get_stats().num_zerocopy_bytes; ++i) {
+    msg_runloop(5);
+  }
+  test_printf("%zd zero-copy bytes still held.\n",
+              msg_get_stats().num_zerocopy_bytes);
+  test_that(msg_get_stats().num_zerocopy_bytes == 0);
+
+  msg_disconnect(client_conn);
+  close(sock);
+  close(listener);
+  port++;
+  return test_success;
+}
+
+// A file's bytes arrive as an ordinary message, in order with the messages
+// sent around it.
+#define file_len (300 * 1024)
+
+int file_messages_ok;
+
+void file_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event != msg_message) return;
+
+  // Expect "before", then the file range, then "after".
+  num_messages++;
+  if (num_messages == 2) {
+    int is_ok = (data.num_bytes == file_len - 1000);
+    for (size_t i = 0; is_ok && i < data.num_bytes; ++i) {
+      is_ok = (data.bytes[i] == (char)((i + 1000) * 13));
+    }
+    if (!is_ok) file_messages_ok = false;
+  } else {
+    char *expected = (num_messages == 1) ? "before" : "after";
+    if (strcmp(msg_as_str(data), expected) != 0) file_messages_ok = false;
+  }
+}
+
+int file_test() {
+  reset();
+  file_messages_ok = true;
+
+  char path[] = "/tmp/outbound_test_XXXXXX";
+  int fd = mkstemp(path);
+  unlink(path);
+  char *bytes = malloc(file_len);
+  for (int i = 0; i < file_len; ++i) bytes[i] = (char)(i * 13);
+  test_that(write(fd, bytes, file_len) == file_len);
+  free(bytes);
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, file_server_update);
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  msg_Data data = msg_new_data("before");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  msg_send_file(client_conn, fd, 1000, file_len - 1000);
+  close(fd);  // msgbox keeps its own dup.
+  data = msg_new_data("after");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+
+  for (int i = 0; i < 200 && num_messages < 3; ++i) msg_runloop(5);
+  test_that(num_messages == 3);
+  test_that(file_messages_ok);
+  test_that(msg_outbound_bytes(client_conn) == 0);
+
+  msg_disconnect(client_conn);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(tcp_test, disconnect_test, disconnect_timeout_test, udp_test,
+            coalescing_test, udp_packing_test, packed_round_trip_test,
+            zerocopy_test, file_test);
+  return end_all_tests();
+}
@@ -0,0 +1,237 @@
+// pacing_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for udp pacing and congestion control. A burst between msgbox conns
+// checks that pacing spreads it out; a plain udp socket stands in for a peer
+// that loses and then acks reliable messages, which moves the send rate.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk"
+};
+
+// These match the values used on the wire.
+#define wire_reliable 6
+#define wire_ack      7
+
+#define outer_len    8   // The message header.
+#define reliable_len 16  // The reliable header that follows it.
+
+#define burst_len    100
+#define message_len  1000
+#define max_rate     (200 * 1024)
+
+int port;
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_messages;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+  if (event == msg_message)         num_messages++;
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+}
+
+void listen_and_reset() {
+  listening_ended = false;
+  num_messages    = 0;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+}
+
+void unlisten() {
+  msg_set_pacing(0);
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+}
+
+void run_loop_for(int64_t duration) {
+  int64_t end = msg_loop_now() + duration;
+  while (msg_loop_now() < end) msg_runloop(5);
+}
+
+// Returns a non-blocking udp socket bound to port + 1.
+int open_raw_peer() {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port + 1);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  return sock;
+}
+
+// Receives every waiting datagram, and returns how many were reliable
+// messages. The last sender's address is kept in last_sender.
+struct sockaddr_in last_sender;
+
+int raw_recv_all(int sock) {
+  char buffer[2048];
+  int num_reliable = 0;
+  while (true) {
+    socklen_t addr_len = sizeof(last_sender);
+    long num_bytes = recvfrom(sock, buffer, sizeof(buffer), 0,
+                              (struct sockaddr *)&last_sender, &addr_len);
+    if (num_bytes < outer_len) return num_reliable;
+    uint16_t type;
+    memcpy(&type, buffer, 2);
+    if (ntohs(type) == wire_reliable) num_reliable++;
+  }
+}
+
+// Acks every reliable message before seq ack.
+void raw_send_ack(int sock, uint16_t ack) {
+  char buffer[outer_len + reliable_len];
+  memset(buffer, 0, sizeof(buffer));
+  uint16_t type = htons(wire_ack);
+  uint32_t len  = htonl(reliable_len);
+  ack = htons(ack);
+  memcpy(buffer,         &type, 2);
+  memcpy(buffer + 4,     &len,  4);
+  memcpy(buffer + 8 + 6, &ack,  2);
+  sendto(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&last_sender,
+         sizeof(last_sender));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// A burst leaves at the paced rate, and none of it is lost.
+int paced_burst_test() {
+  listen_and_reset();
+  client_conn = NULL;
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  msg_set_pacing(max_rate);
+  test_that(msg_send_rate(client_conn) == max_rate);
+
+  int64_t start = msg_loop_now();
+  msg_Data data = msg_new_data_space(message_len);
+  memset(data.bytes, 'x', message_len);
+  for (int i = 0; i < burst_len; ++i) msg_send(client_conn, data);
+  msg_delete_data(data);
+  test_that(msg_get_stats().num_paced_bytes > 0);
+
+  for (int i = 0; i < 400 && num_messages < burst_len; ++i) msg_runloop(5);
+  double elapsed = (double)(msg_loop_now() - start) / msg_sec;
+  double expected = (double)burst_len * message_len / max_rate;
+  test_printf("The burst took %.3fs; pacing alone takes %.3fs.\n",
+              elapsed, expected);
+  test_that(num_messages == burst_len);
+  test_that(elapsed > expected * 0.8);
+  test_that(msg_get_stats().num_paced_bytes == 0);
+  test_that(msg_get_stats().num_pacing_drops == 0);
+
+  msg_disconnect(client_conn);
+  unlisten();
+  return test_success;
+}
+
+// A resent reliable message halves the send rate, and acks raise it again.
+int congestion_test() {
+  listen_and_reset();
+  client_conn = NULL;
+  msg_set_pacing(max_rate);
+
+  int sock = open_raw_peer();
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port + 1);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  // The raw peer doesn't ack the first send, so it's resent.
+  msg_Data data = msg_new_data("a");
+  msg_send_reliable(client_conn, data, false);
+  int num_copies = 0;
+  for (int i = 0; i < 100 && num_copies < 2; ++i) {
+    msg_runloop(5);
+    num_copies += raw_recv_all(sock);
+  }
+  test_that(num_copies == 2);
+  size_t cut_rate = msg_send_rate(client_conn);
+  test_printf("The rate went from %d to %zu.\n", max_rate, cut_rate);
+  test_that(cut_rate <= max_rate / 2);
+
+  raw_send_ack(sock, 1);
+  run_loop_for(20 * msg_ms);
+  msg_send_reliable(client_conn, data, false);
+  run_loop_for(20 * msg_ms);
+  raw_recv_all(sock);
+  raw_send_ack(sock, 2);
+  run_loop_for(20 * msg_ms);
+  test_that(msg_send_rate(client_conn) > cut_rate);
+  msg_delete_data(data);
+
+  msg_disconnect(client_conn);
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(paced_burst_test, congestion_test);
+  return end_all_tests();
+}
@@ -0,0 +1,191 @@
+// post_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the thread-safe msg_post and msg_post_send functions.
+// The server and client share a single process and run loop here, while
+// replies are computed on separate threads.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+int port;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// replies sent from another thread
+
+#define num_requests 8
+
+typedef struct {
+  msg_Conn conn;  // A copy, as the original's remote address may change.
+  int      value;
+} Job;
+
+msg_Conn *listening_conn;
+int num_replies;
+int client_closed;
+int server_closed;
+
+void *worker(void *job_vp) {
+  Job *job = (Job *)job_vp;
+  usleep(1000);
+  msg_Data data = msg_new_data_space(sizeof(int));
+  *(int *)data.bytes = job->value * 2;
+  msg_post_send(&job->conn, data);  // msgbox now owns data.
+  free(job);
+  return NULL;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+
+  if (event == msg_listening) listening_conn = conn;
+
+  if (event == msg_request) {
+    Job *job   = malloc(sizeof(Job));
+    job->conn  = *conn;
+    job->value = *(int *)data.bytes;
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, job);
+    pthread_detach(thread);
+  }
+
+  if (event == msg_connection_closed) server_closed = true;
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) {
+    for (int i = 1; i <= num_requests; ++i) {
+      msg_Data data = msg_new_data_space(sizeof(int));
+      *(int *)data.bytes = i;
+      msg_get(conn, data, (void *)(intptr_t)i);
+      msg_delete_data(data);
+    }
+  }
+
+  if (event == msg_reply) {
+    int sent = (int)(intptr_t)conn->reply_context;
+    test_that(*(int *)data.bytes == sent * 2);
+    if (++num_replies == num_requests) msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) client_closed = true;
+}
+
+int post_send_test(const char *protocol) {
+  num_replies   = 0;
+  client_closed = false;
+  server_closed = false;
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  msg_connect(address, client_update, msg_no_context);
+
+  while (!client_closed || !server_closed) msg_runloop(10);
+  test_that(num_replies == num_requests);
+
+  msg_unlisten(listening_conn);
+  msg_runloop(0);
+  port++;
+
+  return test_success;
+}
+
+int udp_post_send_test() { return post_send_test("udp"); }
+
+int tcp_post_send_test() { return post_send_test("tcp"); }
+
+
+///////////////////////////////////////////////////////////////////////////////
+// msg_post wakes up a blocked run loop
+
+int was_posted;
+
+void posted_fn(void *context) {
+  test_that(context == &was_posted);
+  was_posted = true;
+}
+
+void *poster(void *unused) {
+  usleep(20000);
+  msg_post(posted_fn, &was_posted);
+  return NULL;
+}
+
+void idle_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_listening) listening_conn = conn;
+}
+
+int wakeup_test() {
+  was_posted = false;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port++);
+  msg_listen(address, idle_update);
+  msg_runloop(0);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, poster, NULL);
+
+  int64_t start = msg_loop_now();
+  while (!was_posted) msg_runloop(5000);
+  int64_t elapsed = msg_loop_now() - start;
+  test_printf("Run loop woke up after %lld ns.\n", (long long)elapsed);
+  test_that(elapsed < 2 * msg_sec);
+
+  pthread_join(thread, NULL);
+  msg_unlisten(listening_conn);
+  msg_runloop(0);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(udp_post_send_test, tcp_post_send_test, wakeup_test);
+  return end_all_tests();
+}
@@ -0,0 +1,312 @@
+// reliable_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for reliable udp messages. Messages between msgbox conns check the
+// round trip; a plain udp socket stands in for a peer that loses, reorders,
+// or repeats datagrams, and checks the acks and resends that msgbox sends it.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk"
+};
+
+// These match the values used on the wire.
+#define wire_one_way  0
+#define wire_reliable 6
+#define wire_ack      7
+#define wire_ordered  1
+
+#define outer_len    8   // The message header.
+#define reliable_len 16  // The reliable header that follows it.
+
+#define large_len 5000  // Sent in fragments.
+
+int port;
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int num_messages;
+int num_replies;
+int num_lost;
+
+// The first byte of each message received, in order.
+char received[16];
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)       listening_conn = conn;
+  if (event == msg_listening_ended) listening_ended = true;
+
+  if (event == msg_message) {
+    if (data.num_bytes == large_len) {
+      for (int i = 0; i < large_len; ++i) {
+        if (data.bytes[i] != (char)(i * 7)) test_failed("Bad byte %d.", i);
+      }
+    }
+    if (num_messages < array_size(received)) {
+      received[num_messages] = data.bytes[0];
+    }
+    num_messages++;
+  }
+
+  if (event == msg_request) {
+    msg_Data reply = msg_new_data("reply");
+    msg_send_reliable(conn, reply, true);
+    msg_delete_data(reply);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  if (event == msg_connection_ready) client_conn = conn;
+  if (event == msg_connection_lost)  num_lost++;
+
+  if (event == msg_reply) {
+    num_replies++;
+    test_that(conn->reply_context == &num_replies);
+    test_str_eq(msg_as_str(data), "reply");
+  }
+}
+
+void listen_and_reset() {
+  listening_ended = false;
+  num_messages    = 0;
+  num_replies     = 0;
+  num_lost        = 0;
+  memset(received, 0, sizeof(received));
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(0);
+}
+
+void unlisten() {
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(5);
+  port++;
+}
+
+void run_loop_for(int64_t duration) {
+  int64_t end = msg_loop_now() + duration;
+  while (msg_loop_now() < end) msg_runloop(5);
+}
+
+// Returns a non-blocking udp socket; if is_bound, it's bound to port + 1, and
+// otherwise it's connected to the server at port.
+int open_raw_peer(int is_bound) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(is_bound ? port + 1 : port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (is_bound) bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  else          connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  return sock;
+}
+
+// Sends a one-byte reliable one-way message, or an ack if type is wire_ack.
+void raw_send(int sock, uint16_t type, uint16_t seq, uint16_t flags,
+              uint16_t ack, char byte) {
+  int num_bytes = reliable_len + (type == wire_ack ? 0 : 1);
+  uint16_t outer[2] = { htons(type), 0 };
+  uint32_t outer_num_bytes = htonl(num_bytes);
+  uint16_t inner[4] = { htons(wire_one_way), htons(seq), htons(flags),
+                        htons(ack) };
+  char buffer[outer_len + reliable_len + 1];
+  memset(buffer, 0, sizeof(buffer));
+  memcpy(buffer,     outer,            4);
+  memcpy(buffer + 4, &outer_num_bytes, 4);
+  memcpy(buffer + 8, inner,            8);
+  buffer[outer_len + reliable_len] = byte;
+  send(sock, buffer, outer_len + num_bytes, 0);
+}
+
+// Reads one datagram into type, seq, and ack; returns false if there's none.
+// The sender's address is kept in last_sender.
+struct sockaddr_in last_sender;
+
+int raw_recv(int sock, uint16_t *type, uint16_t *seq, uint16_t *ack) {
+  char buffer[2048];
+  socklen_t addr_len = sizeof(last_sender);
+  long num_bytes = recvfrom(sock, buffer, sizeof(buffer), 0,
+                            (struct sockaddr *)&last_sender, &addr_len);
+  if (num_bytes < outer_len + reliable_len) return false;
+  uint16_t fields[4];
+  memcpy(type,   buffer,     2);
+  memcpy(fields, buffer + 8, 8);
+  *type = ntohs(*type);
+  *seq  = ntohs(fields[1]);
+  *ack  = ntohs(fields[3]);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Reliable messages, including a fragmented one and a reply, arrive intact
+// and in order between msgbox conns.
+int round_trip_test() {
+  listen_and_reset();
+  client_conn = NULL;
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  char *strs[] = {"a", "b", "c"};
+  for (int i = 0; i < array_size(strs); ++i) {
+    msg_Data data = msg_new_data(strs[i]);
+    msg_send_reliable(client_conn, data, true);
+    msg_delete_data(data);
+  }
+  msg_Data data = msg_new_data_space(large_len);
+  for (int i = 0; i < large_len; ++i) data.bytes[i] = (char)(i * 7);
+  msg_send_reliable(client_conn, data, true);
+  msg_delete_data(data);
+
+  data = msg_new_data("request");
+  msg_get(client_conn, data, &num_replies);
+  msg_delete_data(data);
+
+  for (int i = 0; i < 200 && (num_messages < 4 || num_replies < 1); ++i) {
+    msg_runloop(5);
+  }
+  test_that(num_messages == 4);
+  test_that(memcmp(received, "abc", 3) == 0);
+  test_that(num_replies == 1);
+
+  msg_disconnect(client_conn);
+  unlisten();
+  return test_success;
+}
+
+// Ordered messages wait for earlier ones, unordered ones don't, duplicates
+// are dropped, and every message is acked.
+int ordering_test() {
+  listen_and_reset();
+
+  int sock = open_raw_peer(false);
+  raw_send(sock, wire_reliable, 1, wire_ordered, 0, 'b');
+  raw_send(sock, wire_reliable, 2, 0,            0, 'c');
+  for (int i = 0; i < 100 && num_messages < 1; ++i) msg_runloop(5);
+  test_that(num_messages == 1);
+  test_that(received[0] == 'c');
+
+  raw_send(sock, wire_reliable, 0, wire_ordered, 0, 'a');
+  raw_send(sock, wire_reliable, 0, wire_ordered, 0, 'a');
+  for (int i = 0; i < 100 && num_messages < 3; ++i) msg_runloop(5);
+  run_loop_for(20 * msg_ms);
+  test_that(num_messages == 3);
+  test_that(memcmp(received, "cab", 3) == 0);
+
+  // The latest ack covers all three messages.
+  uint16_t type, seq, ack, last_ack = 0;
+  while (raw_recv(sock, &type, &seq, &ack)) {
+    if (type == wire_ack) last_ack = ack;
+  }
+  test_that(last_ack == 3);
+
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+// An unacked message is resent until the peer acks it.
+int resend_test() {
+  listen_and_reset();
+  client_conn = NULL;
+
+  int sock = open_raw_peer(true);
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port + 1);
+  msg_connect(address, client_update, msg_no_context);
+  while (client_conn == NULL) msg_runloop(5);
+
+  msg_Data data = msg_new_data("a");
+  msg_send_reliable(client_conn, data, false);
+  msg_delete_data(data);
+
+  // The raw peer drops the first copy, so a second one is sent.
+  uint16_t type, seq, ack;
+  int num_copies = 0;
+  for (int i = 0; i < 100 && num_copies < 2; ++i) {
+    msg_runloop(5);
+    while (raw_recv(sock, &type, &seq, &ack)) {
+      if (type == wire_reliable && seq == 0) num_copies++;
+    }
+  }
+  test_that(num_copies == 2);
+
+  // Once acked, the message isn't sent again.
+  connect(sock, (struct sockaddr *)&last_sender, sizeof(last_sender));
+  raw_send(sock, wire_ack, 0, 0, 1, 0);
+  run_loop_for(20 * msg_ms);
+  while (raw_recv(sock, &type, &seq, &ack));
+  run_loop_for(600 * msg_ms);
+  num_copies = 0;
+  while (raw_recv(sock, &type, &seq, &ack)) {
+    if (type == wire_reliable) num_copies++;
+  }
+  test_that(num_copies == 0);
+  test_that(num_lost == 0);
+
+  msg_disconnect(client_conn);
+  close(sock);
+  unlisten();
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(round_trip_test, ordering_test, resend_test);
+  return end_all_tests();
+}
@@ -0,0 +1,369 @@
+// shm_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for shm:// conns, which carry tcp-like messages through rings in
+// shared memory between processes on the same host. A raw peer that sets up
+// its own region writes malformed records, which the server must refuse.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_send_blocked",
+  "msg_send_drained"
+};
+
+#define large_len    (200 * 1024)  // Several of these fill a ring.
+#define small_len    (32 * 1024)
+#define num_in_burst 36            // Of small_len; more than a ring holds.
+
+char address[64];
+
+msg_Conn *listening_conn;
+msg_Conn *client_conn;
+int listening_ended;
+int server_closed;
+int num_messages;
+int num_patterned;
+int num_in_order;
+int num_replies;
+int num_errors;
+int num_greetings;
+char server_peer_address[128];
+
+msg_Data new_pattern_data(size_t num_bytes, int seed) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i * 11 + seed);
+  return data;
+}
+
+int has_pattern(msg_Data data, int seed) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i * 11 + seed)) return false;
+  }
+  return true;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)         listening_conn = conn;
+  if (event == msg_listening_ended)   listening_ended = true;
+  if (event == msg_connection_closed) server_closed = true;
+
+  // This is sent before the client's setup message arrives.
+  if (event == msg_connection_ready) {
+    msg_Data greeting = msg_new_data("greeting");
+    msg_send(conn, greeting);
+    msg_delete_data(greeting);
+  }
+
+  if (event == msg_message) {
+    snprintf(server_peer_address, 128, "%s", msg_address_str(conn));
+    if (data.num_bytes > 1024) {
+      // Each patterned message is seeded with its index among them.
+      if (has_pattern(data, num_patterned)) num_in_order++;
+      num_patterned++;
+    }
+    num_messages++;
+  }
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "request");
+    msg_Data reply = msg_new_data("reply");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error)            num_errors++;
+  if (event == msg_connection_ready) client_conn = conn;
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "greeting");
+    num_greetings++;
+  }
+  if (event == msg_reply) {
+    num_replies++;
+    test_str_eq(msg_as_str(data), "reply");
+  }
+}
+
+void reset() {
+  listening_conn   = NULL;
+  client_conn      = NULL;
+  listening_ended  = false;
+  server_closed    = false;
+  num_messages     = 0;
+  num_patterned    = 0;
+  num_in_order     = 0;
+  num_replies      = 0;
+  num_errors       = 0;
+  num_greetings    = 0;
+  server_peer_address[0] = '\0';
+}
+
+// Listens on address and connects a client to it.
+int start_conns() {
+  reset();
+  msg_listen(address, server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+
+  msg_connect(address, client_update, msg_no_context);
+  for (int i = 0; i < 100 && client_conn == NULL; ++i) msg_runloop(5);
+  test_that(client_conn != NULL);
+  return test_success;
+}
+
+// Disconnects the client and waits for the server to see the close.
+int end_conns() {
+  msg_disconnect(client_conn);
+  for (int i = 0; i < 100 && !server_closed; ++i) msg_runloop(5);
+  test_that(server_closed);
+
+  msg_unlisten(listening_conn);
+  for (int i = 0; i < 100 && !listening_ended; ++i) msg_runloop(5);
+  test_that(listening_ended);
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// shm:// conns carry messages, requests, and replies like tcp conns.
+int round_trip_test() {
+  test_that(start_conns() == test_success);
+  test_str_eq(msg_address_str(client_conn), address);
+
+  msg_Data data = msg_new_data("hello");
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  data = new_pattern_data(large_len, 0);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  data = msg_new_data("request");
+  msg_get(client_conn, data, msg_no_context);
+  msg_delete_data(data);
+
+  for (int i = 0; i < 100 && num_replies < 1; ++i) msg_runloop(5);
+  test_that(num_messages == 2);
+  test_that(num_in_order == 1);
+  test_that(num_replies == 1);
+  test_that(num_greetings == 1);
+  test_printf("The server saw its peer as %s.\n", server_peer_address);
+  test_str_eq(server_peer_address, "shm://(unnamed)");
+
+  return end_conns();
+}
+
+// A burst larger than the ring waits for room, and arrives in order.
+int burst_test() {
+  test_that(start_conns() == test_success);
+
+  int num_sent = 5 * num_in_burst;
+  for (int i = 0; i < num_sent; ++i) {
+    msg_Data data = new_pattern_data(large_len, i);
+    msg_send(client_conn, data);
+    msg_delete_data(data);
+  }
+  test_that(msg_outbound_bytes(client_conn) > 0);
+  for (int i = 0; i < 500 && num_messages < num_sent; ++i) msg_runloop(5);
+  test_that(num_messages == num_sent);
+  test_that(num_in_order == num_sent);
+  test_that(msg_outbound_bytes(client_conn) == 0);
+
+  return end_conns();
+}
+
+// Messages still queued at a disconnect arrive before the close.
+int close_test() {
+  test_that(start_conns() == test_success);
+
+  // The messages that don't fit in the ring go over the socket at the close.
+  for (int i = 0; i < num_in_burst; ++i) {
+    msg_Data data = new_pattern_data(small_len, i);
+    msg_send(client_conn, data);
+    msg_delete_data(data);
+  }
+  test_that(end_conns() == test_success);
+  test_that(num_messages == num_in_burst);
+  test_that(num_in_order == num_in_burst);
+  return test_success;
+}
+
+// A message too large for the ring is refused with an error.
+int too_large_test() {
+  test_that(start_conns() == test_success);
+
+  msg_Data data = msg_new_data_space(1024 * 1024);
+  msg_send(client_conn, data);
+  msg_delete_data(data);
+  msg_runloop(0);
+  test_that(num_errors == 1);
+
+  return end_conns();
+}
+
+#ifdef __linux__
+
+// These match the wire values and the layout of a region in msgbox.c.
+#define wire_shm_setup       9
+#define wire_doorbell        10
+#define ring_struct_len      128
+#define ring_len             (1024 * 1024)
+#define region_len           (2 * ring_struct_len + 2 * ring_len)
+#define record_struct_len    32
+#define record_num_bytes_at  28
+
+int bad_peer_errors;
+int bad_peer_closed;
+
+void bad_peer_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_listening)         listening_conn = conn;
+  if (event == msg_listening_ended)   listening_ended = true;
+  if (event == msg_error) {
+    test_printf("Server: Error: %s\n", msg_as_str(data));
+    bad_peer_errors++;
+  }
+  if (event == msg_connection_closed) bad_peer_closed = true;
+  if (event == msg_message)           num_messages++;
+}
+
+void send_raw_header(int sock, uint16_t message_type, int fd) {
+  uint16_t header[4] = { htons(message_type), 0, 0, 0 };
+  struct iovec  iov = { .iov_base = header, .iov_len = sizeof(header) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd != -1) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  sendmsg(sock, &msg, 0);
+}
+
+// Plays a connecting peer that writes a record with the given len and
+// num_bytes fields into its ring, and checks that the server closes the conn
+// without delivering it.
+int check_bad_record(uint32_t len, uint32_t num_bytes) {
+  reset();
+  bad_peer_errors = 0;
+  bad_peer_closed = false;
+  msg_listen(address, bad_peer_server_update);
+  msg_runloop(0);
+  test_that(listening_conn != NULL);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sun_family = AF_UNIX;
+  int path_len = snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path),
+                          "@msgbox.shm.%s", address + 6);
+  sockaddr.sun_path[0] = '\0';  // It's an abstract socket.
+  test_that(connect(sock, (struct sockaddr *)&sockaddr,
+                    offsetof(struct sockaddr_un, sun_path) + path_len) == 0);
+
+  int fd = memfd_create("shm_test", 0);
+  test_that(ftruncate(fd, region_len) == 0);
+  char *region = mmap(NULL, region_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+  test_that(region != MAP_FAILED);
+  send_raw_header(sock, wire_shm_setup, fd);
+  close(fd);
+
+  // The peer that connects produces into the first ring.
+  char *record = region + 2 * ring_struct_len;
+  memcpy(record, &len, sizeof(len));
+  memcpy(record + record_num_bytes_at, &num_bytes, sizeof(num_bytes));
+  uint64_t head = record_struct_len + 8;
+  memcpy(region, &head, sizeof(head));
+  send_raw_header(sock, wire_doorbell, -1);
+
+  for (int i = 0; i < 100 && !bad_peer_closed; ++i) msg_runloop(5);
+  test_that(bad_peer_closed);
+  test_that(bad_peer_errors == 1);
+  test_that(num_messages == 0);
+
+  munmap(region, region_len);
+  close(sock);
+  msg_unlisten(listening_conn);
+  for (int i = 0; i < 100 && !listening_ended; ++i) msg_runloop(5);
+  test_that(listening_ended);
+  return test_success;
+}
+
+// A peer that writes a malformed record into its ring has its conn closed.
+int bad_record_test() {
+  uint32_t record_len = record_struct_len + 8;
+  // Too long, shorter than a record, unaligned, and past the end.
+  test_that(check_bad_record(record_len, 1000)  == test_success);
+  test_that(check_bad_record(20, 0)             == test_success);
+  test_that(check_bad_record(record_len + 4, 0) == test_success);
+  test_that(check_bad_record(ring_len + 8, 0)   == test_success);
+  return test_success;
+}
+
+#else
+
+int bad_record_test() {
+  return test_success;
+}
+
+#endif
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  snprintf(address, sizeof(address), "shm://msgbox_shm_test.%d", getpid());
+
+  start_all_tests(argv[0]);
+  run_tests(round_trip_test, burst_test, close_test, too_large_test,
+            bad_record_test);
+  return end_all_tests();
+}
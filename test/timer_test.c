@@ -0,0 +1,167 @@
+// timer_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for app timers added with msg_add_timer.
+// These run in a single process as timers don't need a remote side.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// periodic and one-shot timers
+
+int num_ticks;
+int one_shot_fired;
+int64_t first_tick_at;
+
+void tick(msg_Timer *timer, void *context) {
+  test_that(context == &num_ticks);
+  if (num_ticks == 0) first_tick_at = msg_loop_now();
+  num_ticks++;
+  test_printf("tick %d at %lld\n", num_ticks, (long long)msg_loop_now());
+  if (num_ticks == 5) {
+    msg_TimerStats stats = msg_timer_stats(timer);
+    test_that(stats.num_fires == 5);
+    test_that(stats.last_lateness >= 0);
+    test_that(stats.max_lateness >= stats.last_lateness);
+    test_that(stats.total_lateness >= stats.max_lateness);
+
+    // Canceling a timer from within its own callback is allowed.
+    msg_cancel_timer(timer);
+  }
+}
+
+void one_shot(msg_Timer *timer, void *context) {
+  one_shot_fired++;
+}
+
+int periodic_test() {
+  num_ticks      = 0;
+  one_shot_fired = 0;
+
+  int64_t start = msg_loop_now();
+  msg_add_timer(10 * msg_ms, 10 * msg_ms, tick, &num_ticks);
+  msg_add_timer(25 * msg_ms, 0, one_shot, NULL);
+
+  // With no sockets and no timers, a -1 timeout would block forever; here we
+  // expect msg_runloop to return as timers come due.
+  while (num_ticks < 5 || !one_shot_fired) msg_runloop(-1);
+
+  test_that(one_shot_fired == 1);
+  test_that(first_tick_at - start >= 10 * msg_ms);
+  test_that(msg_loop_now() - start >= 50 * msg_ms);
+
+  // Give the canceled timer a chance to misfire.
+  msg_add_timer(30 * msg_ms, 0, one_shot, NULL);
+  while (one_shot_fired < 2) msg_runloop(-1);
+  test_that(num_ticks == 5);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// timer order and cancellation
+
+int fired_order[3];
+int num_fired;
+
+void record_fire(msg_Timer *timer, void *context) {
+  fired_order[num_fired++] = (int)(intptr_t)context;
+}
+
+int order_test() {
+  num_fired = 0;
+
+  msg_add_timer(30 * msg_ms, 0, record_fire, (void *)(intptr_t)3);
+  msg_add_timer(10 * msg_ms, 0, record_fire, (void *)(intptr_t)1);
+  msg_Timer *canceled = msg_add_timer(15 * msg_ms, 0, record_fire,
+                                      (void *)(intptr_t)-1);
+  msg_add_timer(20 * msg_ms, 0, record_fire, (void *)(intptr_t)2);
+  msg_cancel_timer(canceled);
+
+  while (num_fired < 3) msg_runloop(-1);
+
+  test_that(fired_order[0] == 1);
+  test_that(fired_order[1] == 2);
+  test_that(fired_order[2] == 3);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// caller timeouts don't delay timers
+
+int late_timer_fired;
+
+void late_timer(msg_Timer *timer, void *context) {
+  late_timer_fired = true;
+}
+
+int long_timeout_test() {
+  late_timer_fired = false;
+
+  int64_t start = msg_loop_now();
+  msg_add_timer(20 * msg_ms, 0, late_timer, NULL);
+
+  // The timer should cut the 10s timeout short.
+  while (!late_timer_fired) msg_runloop(10000);
+
+  test_that(msg_loop_now() - start < 5 * msg_sec);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// timers added outside the loop start from the current time
+
+int outside_timer_fired;
+
+void outside_timer(msg_Timer *timer, void *context) {
+  outside_timer_fired = true;
+}
+
+int outside_loop_test() {
+  outside_timer_fired = false;
+
+  // Work done outside the loop leaves its cached time behind.
+  msg_runloop(0);
+  usleep(300 * 1000);
+
+  int64_t start = msg_loop_now();
+  msg_add_timer(200 * msg_ms, 0, outside_timer, NULL);
+  msg_runloop(0);
+  test_that(!outside_timer_fired);
+
+  while (!outside_timer_fired) msg_runloop(-1);
+  test_that(msg_loop_now() - start >= 200 * msg_ms);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(periodic_test, order_test, long_timeout_test, outside_loop_test);
+  return end_all_tests();
+}
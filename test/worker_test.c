@@ -0,0 +1,278 @@
+// worker_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for msg_use_workers. A client sends a burst of numbered messages to an
+// echo server, and both sides check that the callbacks for each peer arrive in
+// order even though they run on a pool of workers. The server and client share
+// a single process and run loop here.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+#define num_workers  4
+#define max_clients  4
+#define num_messages 200
+
+typedef struct {
+  int next_value;  // The value we expect in the next message.
+} Counter;
+
+int port;
+int num_clients;
+pthread_t loop_thread;
+
+Counter client_counters[max_clients];
+Counter server_counters[max_clients];
+int num_server_counters;
+
+msg_Conn listening_conn;  // A copy; conns given to callbacks are temporary.
+int num_echoes;
+int num_server_closes;
+int listening_ended;
+
+msg_Data new_value_data(int value) {
+  msg_Data data = msg_new_data_space(sizeof(int));
+  *(int *)data.bytes = value;
+  return data;
+}
+
+// Checks that value is the next one expected by counter.
+void check_order(Counter *counter, int value) {
+  test_that(counter != NULL);
+  test_that(value == counter->next_value);
+  counter->next_value = value + 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  test_that(!pthread_equal(pthread_self(), loop_thread));
+
+  if (event == msg_listening) listening_conn = *conn;
+
+  if (event == msg_connection_ready) {
+    int i = __atomic_fetch_add(&num_server_counters, 1, __ATOMIC_ACQ_REL);
+    test_that(i < max_clients);
+    conn->conn_context = &server_counters[i];
+  }
+
+  if (event == msg_message) {
+    int value = *(int *)data.bytes;
+    check_order((Counter *)conn->conn_context, value);
+
+    // Give callbacks for other peers a chance to overtake this one.
+    usleep(rand() % 200);
+    msg_send(conn, data);
+  }
+
+  if (event == msg_connection_closed) {
+    int n = __atomic_add_fetch(&num_server_closes, 1, __ATOMIC_ACQ_REL);
+    if (n == num_clients) msg_unlisten(&listening_conn);
+  }
+
+  if (event == msg_listening_ended) {
+    __atomic_store_n(&listening_ended, true, __ATOMIC_RELEASE);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// clients
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  test_that(!pthread_equal(pthread_self(), loop_thread));
+
+  if (event == msg_connection_ready) {
+    for (int i = 0; i < num_messages; ++i) {
+      msg_Data data = new_value_data(i);
+      msg_send(conn, data);
+      msg_delete_data(data);
+    }
+  }
+
+  if (event == msg_message) {
+    int value = *(int *)data.bytes;
+    check_order((Counter *)conn->conn_context, value);
+    __atomic_add_fetch(&num_echoes, 1, __ATOMIC_ACQ_REL);
+    if (value == num_messages - 1) msg_disconnect(conn);
+  }
+}
+
+int echo_test(const char *protocol, int clients) {
+  num_clients         = clients;
+  num_server_counters = 0;
+  num_echoes          = 0;
+  num_server_closes   = 0;
+  listening_ended     = false;
+  memset(client_counters, 0, sizeof(client_counters));
+  memset(server_counters, 0, sizeof(server_counters));
+
+  loop_thread = pthread_self();
+  msg_use_workers(num_workers);
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  for (int i = 0; i < num_clients; ++i) {
+    msg_connect(address, client_update, &client_counters[i]);
+  }
+
+  while (!__atomic_load_n(&listening_ended, __ATOMIC_ACQUIRE)) {
+    msg_runloop(10);
+  }
+  msg_use_workers(0);
+
+  test_that(num_echoes == num_clients * num_messages);
+  for (int i = 0; i < num_clients; ++i) {
+    test_that(client_counters[i].next_value == num_messages);
+    test_that(server_counters[i].next_value == num_messages);
+  }
+
+  port++;
+  return test_success;
+}
+
+// Clients in one process share a remote address, and so a peer status; a
+// single client keeps this test independent of that.
+int udp_worker_test() { return echo_test("udp", 1); }
+
+int tcp_worker_test() { return echo_test("tcp", 1); }
+
+
+///////////////////////////////////////////////////////////////////////////////
+// timers
+
+msg_Timer *tick_timer;  // Only used on the client's strand.
+int num_ticks;
+int one_shot_fired;
+
+void tick(msg_Timer *timer, void *context) {
+  test_that(pthread_equal(pthread_self(), loop_thread));
+  __atomic_add_fetch(&num_ticks, 1, __ATOMIC_ACQ_REL);
+}
+
+void one_shot(msg_Timer *timer, void *context) {
+  test_that(pthread_equal(pthread_self(), loop_thread));
+  __atomic_store_n(&one_shot_fired, true, __ATOMIC_RELEASE);
+}
+
+void timer_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Server: Error: %s", msg_as_str(data));
+
+  if (event == msg_listening)         listening_conn = *conn;
+  if (event == msg_message)           msg_send(conn, data);
+  if (event == msg_connection_closed) msg_unlisten(&listening_conn);
+
+  if (event == msg_listening_ended) {
+    __atomic_store_n(&listening_ended, true, __ATOMIC_RELEASE);
+  }
+}
+
+// The client arms its timers from a worker, then bounces a message off the
+// server until the periodic timer has ticked a few times, and cancels it.
+void timer_client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_failed("Client: Error: %s", msg_as_str(data));
+
+  test_that(!pthread_equal(pthread_self(), loop_thread));
+
+  if (event == msg_connection_ready) {
+    tick_timer = msg_add_timer(msg_ms, msg_ms, tick, NULL);
+    msg_add_timer(msg_ms, 0, one_shot, NULL);
+  }
+
+  if (event == msg_connection_ready || event == msg_message) {
+    if (__atomic_load_n(&num_ticks, __ATOMIC_ACQUIRE) < 3) {
+      msg_Data data = new_value_data(0);
+      msg_send(conn, data);
+      msg_delete_data(data);
+    } else {
+      msg_cancel_timer(tick_timer);
+      msg_disconnect(conn);
+    }
+  }
+}
+
+int timer_worker_test() {
+  num_ticks       = 0;
+  one_shot_fired  = false;
+  listening_ended = false;
+
+  loop_thread = pthread_self();
+  msg_use_workers(num_workers);
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, timer_server_update);
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, timer_client_update, msg_no_context);
+
+  while (!__atomic_load_n(&listening_ended, __ATOMIC_ACQUIRE)) {
+    msg_runloop(10);
+  }
+  msg_use_workers(0);
+
+  test_that(one_shot_fired);
+
+  // The cancel was handled before the disconnect, so there are no more ticks.
+  int ticks = num_ticks;
+  for (int i = 0; i < 5; ++i) msg_runloop(2);
+  test_that(num_ticks == ticks);
+
+  port++;
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(udp_worker_test, tcp_worker_test, timer_worker_test);
+  return end_all_tests();
+}